@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include "simple_db.h"
+
+//
+// simple_db_bench：仿照 LevelDB 的 db_bench，依次运行 --benchmarks 中的负载，每个负载输出吞吐和延迟分位数。
+// 所有操作都通过嵌入式接口执行 SQL，计时包含语句解析。fill 类负载会先删掉旧数据库重新创建
+//   fillseq     按 id 顺序插入 num 行
+//   fillrandom  按随机顺序插入 num 行
+//   readrandom  按 --distribution 选 id，执行 reads 次单行查询
+//   readseq     全表扫描一次，按行计数
+//   scan        按 --distribution 选起点，执行 reads / scan_length 次长度为 scan_length 的范围查询
+//   mixed       reads 次操作，read_percent% 是单行查询，其余插入新行
+//   filter      执行 reads / num 次按 username like 过滤的全表查询，每次约匹配 1% 的行，
+//               引擎内部用 --scan-threads 个线程并行扫描
+//
+#define DEFAULT_BENCH_NUM 100000
+#define DEFAULT_SCAN_LENGTH 100
+#define DEFAULT_ZIPF_THETA 0.99
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN
+} Distribution;
+
+typedef struct {
+    const char *db_path;
+    const char *benchmarks;
+    uint32_t num;           // 表的行数
+    uint32_t reads;         // 读负载的操作数
+    uint32_t threads;       // readrandom、scan 和 mixed 的线程数
+    uint32_t scan_length;
+    uint32_t read_percent;
+    Distribution distribution;
+    double zipf_theta;
+    uint64_t seed;
+    DbOptions db_options;
+} BenchOptions;
+
+// YCSB 的 Zipfian 生成器（Gray 等人的算法），排名 0 最热。排名再经过哈希打散，热点不集中在表的一端
+typedef struct {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} Zipfian;
+
+typedef struct {
+    uint64_t state;
+} Random;
+
+uint64_t random_next(Random *random) {
+    // xorshift64*
+    random->state ^= random->state >> 12;
+    random->state ^= random->state << 25;
+    random->state ^= random->state >> 27;
+    return random->state * 2685821657736338717ULL;
+}
+
+double random_double(Random *random) {
+    return (random_next(random) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void zipfian_init(Zipfian *zipf, uint64_t n, double theta) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+    double zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        zetan += 1.0 / pow((double) i, theta);
+    }
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = zetan;
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+}
+
+uint64_t zipfian_next(Zipfian *zipf, Random *random) {
+    double u = random_double(random);
+    double uz = u * zipf->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, zipf->theta)) {
+        return 1;
+    }
+    uint64_t rank = (uint64_t) (zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+uint64_t hash64(uint64_t value) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ (value & 0xff)) * 1099511628211ULL;
+        value >>= 8;
+    }
+    return hash;
+}
+
+typedef struct {
+    BenchOptions *options;
+    Table *table;
+    Zipfian *zipf;
+    uint32_t thread_num;
+    uint64_t num_ops;
+    uint64_t *latencies;    // 每个操作的耗时（纳秒）
+    uint64_t done;          // 实际完成的操作数（readseq 是行数）
+    uint64_t found;
+    uint32_t *next_insert_id; // mixed 插入的新 id，各线程共享
+} BenchThread;
+
+uint64_t now_nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 按分布选一个已有的 id（1 到 num）
+uint32_t bench_pick_id(BenchThread *thread, Random *random) {
+    uint32_t num = thread->options->num;
+    if (thread->options->distribution == DIST_ZIPFIAN) {
+        return hash64(zipfian_next(thread->zipf, random)) % num + 1;
+    }
+    return random_next(random) % num + 1;
+}
+
+// 执行一条语句，返回行数；出错时退出
+uint64_t bench_run(Table *table, const char *sql) {
+    PrepareResult prepare_result;
+    DbStatement *stmt = db_prepare(table, sql, &prepare_result);
+    if (prepare_result != PREPARE_SUCCESS) {
+        printf("error preparing '%s'.\n", sql);
+        exit(EXIT_FAILURE);
+    }
+    RowView row;
+    ExecuteResult result;
+    uint64_t num_rows = 0;
+    while ((result = db_step_view(stmt, &row)) == EXECUTE_ROW) {
+        num_rows++;
+    }
+    db_finalize(stmt);
+    if (result != EXECUTE_SUCCESS) {
+        printf("'%s' failed: %s\n", sql, execute_result_message(result));
+        exit(EXIT_FAILURE);
+    }
+    return num_rows;
+}
+
+// 表中最大的 id，不小于 from，用于让 mixed 在已有的数据库上接着插入新行
+uint32_t bench_max_id(Table *table, uint32_t from) {
+    PrepareResult prepare_result;
+    DbStatement *stmt = db_prepare(table, "select max(id)", &prepare_result);
+    if (prepare_result != PREPARE_SUCCESS) {
+        printf("error preparing 'select max(id)'.\n");
+        exit(EXIT_FAILURE);
+    }
+    RowView row;
+    uint32_t max_id = from;
+    // 空表没有结果行
+    if (db_step_view(stmt, &row) == EXECUTE_ROW && row.id > max_id) {
+        max_id = row.id;
+    }
+    db_finalize(stmt);
+    return max_id;
+}
+
+void bench_insert(Table *table, uint32_t id) {
+    char sql[128];
+    snprintf(sql, sizeof(sql), "insert %u user%u user%u@example.com", id, id, id);
+    bench_run(table, sql);
+}
+
+void *bench_fill(BenchThread *thread, bool random_order) {
+    uint32_t num = thread->options->num;
+    uint32_t *ids = malloc(sizeof(uint32_t) * num);
+    for (uint32_t i = 0; i < num; i++) {
+        ids[i] = i + 1;
+    }
+    if (random_order) {
+        Random random = {thread->options->seed};
+        for (uint32_t i = num - 1; i > 0; i--) {
+            uint32_t j = random_next(&random) % (i + 1);
+            uint32_t tmp = ids[i];
+            ids[i] = ids[j];
+            ids[j] = tmp;
+        }
+    }
+    for (uint32_t i = 0; i < num; i++) {
+        uint64_t start = now_nanos();
+        bench_insert(thread->table, ids[i]);
+        thread->latencies[i] = now_nanos() - start;
+    }
+    thread->done = num;
+    free(ids);
+    return NULL;
+}
+
+void *bench_fillseq(void *arg) {
+    return bench_fill(arg, false);
+}
+
+void *bench_fillrandom(void *arg) {
+    return bench_fill(arg, true);
+}
+
+void *bench_readrandom(void *arg) {
+    BenchThread *thread = arg;
+    Random random = {thread->options->seed + thread->thread_num * 7919 + 1};
+    char sql[64];
+    for (uint64_t i = 0; i < thread->num_ops; i++) {
+        snprintf(sql, sizeof(sql), "select where id = %u", bench_pick_id(thread, &random));
+        uint64_t start = now_nanos();
+        thread->found += bench_run(thread->table, sql);
+        thread->latencies[i] = now_nanos() - start;
+    }
+    thread->done = thread->num_ops;
+    return NULL;
+}
+
+void *bench_readseq(void *arg) {
+    BenchThread *thread = arg;
+    thread->done = bench_run(thread->table, "select");
+    thread->found = thread->done;
+    return NULL;
+}
+
+void *bench_scan(void *arg) {
+    BenchThread *thread = arg;
+    Random random = {thread->options->seed + thread->thread_num * 7919 + 1};
+    uint32_t length = thread->options->scan_length;
+    char sql[96];
+    for (uint64_t i = 0; i < thread->num_ops; i++) {
+        uint32_t start_id = bench_pick_id(thread, &random);
+        snprintf(sql, sizeof(sql), "select where id between %u and %u", start_id, start_id + length - 1);
+        uint64_t start = now_nanos();
+        thread->found += bench_run(thread->table, sql);
+        thread->latencies[i] = now_nanos() - start;
+    }
+    thread->done = thread->num_ops;
+    return NULL;
+}
+
+void *bench_filter(void *arg) {
+    BenchThread *thread = arg;
+    Random random = {thread->options->seed + thread->thread_num * 7919 + 1};
+    char sql[64];
+    for (uint64_t i = 0; i < thread->num_ops; i++) {
+        snprintf(sql, sizeof(sql), "select id where username like '%%%02u'", (uint32_t) (random_next(&random) % 100));
+        uint64_t start = now_nanos();
+        thread->found += bench_run(thread->table, sql);
+        thread->latencies[i] = now_nanos() - start;
+    }
+    thread->done = thread->num_ops;
+    return NULL;
+}
+
+void *bench_mixed(void *arg) {
+    BenchThread *thread = arg;
+    Random random = {thread->options->seed + thread->thread_num * 7919 + 1};
+    char sql[64];
+    for (uint64_t i = 0; i < thread->num_ops; i++) {
+        bool read = random_next(&random) % 100 < thread->options->read_percent;
+        uint32_t id = read ? bench_pick_id(thread, &random) : __atomic_add_fetch(thread->next_insert_id, 1, __ATOMIC_RELAXED);
+        uint64_t start = now_nanos();
+        if (read) {
+            snprintf(sql, sizeof(sql), "select where id = %u", id);
+            thread->found += bench_run(thread->table, sql);
+        } else {
+            bench_insert(thread->table, id);
+        }
+        thread->latencies[i] = now_nanos() - start;
+    }
+    thread->done = thread->num_ops;
+    return NULL;
+}
+
+int compare_uint64(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *) a;
+    uint64_t right = *(const uint64_t *) b;
+    return (left > right) - (left < right);
+}
+
+double percentile_micros(uint64_t *sorted, uint64_t count, double fraction) {
+    uint64_t index = (uint64_t) (fraction * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+Table *bench_open(BenchOptions *options, bool fresh) {
+    if (fresh) {
+        char wal_path[4096];
+        snprintf(wal_path, sizeof(wal_path), "%s-wal", options->db_path);
+        unlink(options->db_path);
+        unlink(wal_path);
+    }
+    return db_open(options->db_path, &options->db_options);
+}
+
+// 运行一个负载并打印结果
+void bench_report(BenchOptions *options, Table *table, Zipfian *zipf, const char *name) {
+    void *(*function)(void *) = NULL;
+    uint32_t num_threads = options->threads;
+    uint64_t total_ops = options->reads;
+    if (strcmp(name, "fillseq") == 0 || strcmp(name, "fillrandom") == 0) {
+        function = strcmp(name, "fillseq") == 0 ? bench_fillseq : bench_fillrandom;
+        num_threads = 1;
+        total_ops = options->num;
+    } else if (strcmp(name, "readrandom") == 0) {
+        function = bench_readrandom;
+    } else if (strcmp(name, "readseq") == 0) {
+        function = bench_readseq;
+        num_threads = 1;
+        total_ops = 0;
+    } else if (strcmp(name, "scan") == 0) {
+        function = bench_scan;
+        total_ops = (options->reads + options->scan_length - 1) / options->scan_length;
+    } else if (strcmp(name, "mixed") == 0) {
+        function = bench_mixed;
+    } else if (strcmp(name, "filter") == 0) {
+        function = bench_filter;
+        num_threads = 1;
+        total_ops = (options->reads + options->num - 1) / options->num;
+    } else {
+        printf("unknown benchmark '%s'.\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t next_insert_id = function == bench_mixed ? bench_max_id(table, options->num) : options->num;
+    BenchThread *threads = calloc(num_threads, sizeof(BenchThread));
+    pthread_t *handles = malloc(sizeof(pthread_t) * num_threads);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        threads[i].options = options;
+        threads[i].table = table;
+        threads[i].zipf = zipf;
+        threads[i].thread_num = i;
+        threads[i].num_ops = total_ops / num_threads + (i < total_ops % num_threads);
+        threads[i].latencies = malloc(sizeof(uint64_t) * (threads[i].num_ops + 1));
+        threads[i].next_insert_id = &next_insert_id;
+    }
+    uint64_t start = now_nanos();
+    for (uint32_t i = 0; i < num_threads; i++) {
+        pthread_create(&handles[i], NULL, function, &threads[i]);
+    }
+    for (uint32_t i = 0; i < num_threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    double seconds = (now_nanos() - start) / 1e9;
+
+    uint64_t done = 0;
+    uint64_t found = 0;
+    uint64_t num_latencies = 0;
+    for (uint32_t i = 0; i < num_threads; i++) {
+        done += threads[i].done;
+        found += threads[i].found;
+        num_latencies += function == bench_readseq ? 0 : threads[i].done;
+    }
+    printf("%-11s: %10.3f micros/op %10.0f ops/sec", name, seconds * 1e6 / (done > 0 ? done : 1),
+           done / seconds);
+    if (num_latencies > 0) {
+        uint64_t *latencies = malloc(sizeof(uint64_t) * num_latencies);
+        uint64_t count = 0;
+        for (uint32_t i = 0; i < num_threads; i++) {
+            memcpy(latencies + count, threads[i].latencies, sizeof(uint64_t) * threads[i].done);
+            count += threads[i].done;
+        }
+        qsort(latencies, count, sizeof(uint64_t), compare_uint64);
+        printf("; p50 %.2f p99 %.2f p99.9 %.2f micros", percentile_micros(latencies, count, 0.5),
+               percentile_micros(latencies, count, 0.99), percentile_micros(latencies, count, 0.999));
+        free(latencies);
+    }
+    if (function == bench_readrandom || function == bench_mixed) {
+        printf(" (%llu of %llu found)", (unsigned long long) found, (unsigned long long) done);
+    } else if (function == bench_scan || function == bench_readseq || function == bench_filter) {
+        printf(" (%llu rows)", (unsigned long long) found);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    for (uint32_t i = 0; i < num_threads; i++) {
+        free(threads[i].latencies);
+    }
+    free(threads);
+    free(handles);
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options = {
+            .db_path = "/tmp/simple_db_bench.db",
+            .benchmarks = "fillseq,fillrandom,readrandom,readseq,scan,mixed",
+            .num = DEFAULT_BENCH_NUM,
+            .reads = 0,
+            .threads = 1,
+            .scan_length = DEFAULT_SCAN_LENGTH,
+            .read_percent = 90,
+            .distribution = DIST_UNIFORM,
+            .zipf_theta = DEFAULT_ZIPF_THETA,
+            .seed = 301,
+    };
+    db_default_options(&options.db_options);
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--db") == 0 && has_value) {
+            options.db_path = argv[++i];
+        } else if (strcmp(argv[i], "--benchmarks") == 0 && has_value) {
+            options.benchmarks = argv[++i];
+        } else if (strcmp(argv[i], "--num") == 0 && has_value) {
+            options.num = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--reads") == 0 && has_value) {
+            options.reads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            options.threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--scan-length") == 0 && has_value) {
+            options.scan_length = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--read-percent") == 0 && has_value) {
+            options.read_percent = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--distribution") == 0 && has_value) {
+            i++;
+            if (strcmp(argv[i], "uniform") == 0) {
+                options.distribution = DIST_UNIFORM;
+            } else if (strcmp(argv[i], "zipfian") == 0) {
+                options.distribution = DIST_ZIPFIAN;
+            } else {
+                printf("distribution must be uniform or zipfian.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--zipf-theta") == 0 && has_value) {
+            options.zipf_theta = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+            options.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cache-pages") == 0 && has_value) {
+            options.db_options.cache_pages = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--page-size") == 0 && has_value) {
+            options.db_options.page_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.db_options.compress = true;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.db_options.use_mmap = true;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            options.db_options.use_wal = true;
+        } else if (strcmp(argv[i], "--group-commit") == 0 && has_value) {
+            options.db_options.group_commit = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--scan-threads") == 0 && has_value) {
+            options.db_options.scan_threads = strtoul(argv[++i], NULL, 10);
+        } else {
+            printf("unknown option '%s'.\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.reads == 0) {
+        options.reads = options.num;
+    }
+    if (options.num == 0 || options.threads == 0 || options.scan_length == 0 || options.read_percent > 100 ||
+        options.zipf_theta <= 0 || options.zipf_theta >= 1 || options.seed == 0) {
+        printf("invalid options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Zipfian zipf;
+    if (options.distribution == DIST_ZIPFIAN) {
+        zipfian_init(&zipf, options.num, options.zipf_theta);
+    }
+    printf("rows: %u, reads: %u, threads: %u, distribution: %s, cache pages: %u, page size: %u%s%s%s\n",
+           options.num, options.reads, options.threads,
+           options.distribution == DIST_ZIPFIAN ? "zipfian" : "uniform",
+           options.db_options.cache_pages, options.db_options.page_size,
+           options.db_options.use_wal ? ", wal" : "", options.db_options.use_mmap ? ", mmap" : "",
+           options.db_options.compress ? ", compress" : "");
+
+    // 第一个负载不是 fill 时使用已有的数据库
+    Table *table = NULL;
+    char *benchmarks = strdup(options.benchmarks);
+    for (char *name = strtok(benchmarks, ","); name != NULL; name = strtok(NULL, ",")) {
+        bool fill = strncmp(name, "fill", 4) == 0;
+        if (table == NULL || fill) {
+            if (table != NULL) {
+                db_close(table);
+            }
+            table = bench_open(&options, fill);
+        }
+        bench_report(&options, table, &zipf, name);
+    }
+    if (table != NULL) {
+        db_close(table);
+    }
+    free(benchmarks);
+    return 0;
+}
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE // fallocate
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +8,26 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "simple_db.h"
 
 typedef struct {
     char *buffer;         // 保存一行内容的缓冲区
@@ -48,705 +70,7243 @@ typedef enum {
     META_COMMAND_UNRECOGNIZED_COMMAND
 } MetaCommandResult;
 
-typedef enum {
-    PREPARE_SUCCESS,
-    PREPARE_NEGATIVE_ID,
-    PREPARE_STRING_TOO_LONG,
-    PREPARE_SYNTAX_ERROR,
-    PREPARE_UNRECOGNIZED_STATEMENT
-} PrepareResult;
-
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_DELETE,
+    STATEMENT_CREATE_INDEX
 } StatementType;
 
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+
+const char *INDEX_COLUMN_NAMES[] = {"username", "email"};
+
+// select 可以输出的列
 typedef enum {
-    EXECUTE_SUCCESS,
-    EXECUTE_DUPLICATE_KEY,
-    EXECUTE_TABLE_FULL
+    ROW_ID,
+    ROW_USERNAME,
+    ROW_EMAIL,
+    NUM_ROW_COLUMNS
+} RowColumn;
 
-} ExecuteResult;
+const char *ROW_COLUMN_NAMES[] = {"id", "username", "email"};
 
-#define COLUMN_USERNAME_SIZE  32
-#define COLUMN_EMAIL_SIZE 255
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+// select 的聚合，结果作为只有 id 一列的一行返回
+typedef enum {
+    AGGREGATE_NONE,
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    NUM_AGGREGATES
+} Aggregate;
 
-typedef struct {
-    uint32_t id;
-    char username[COLUMN_USERNAME_SIZE + 1];
-    char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
+const char *AGGREGATE_NAMES[] = {"", "count(*)", "min(id)", "max(id)"};
 
 typedef struct {
     StatementType type;
-    Row row_to_insert;
+    Row *rows_to_insert;        // 多行 insert，缓冲区在语句之间复用
+    uint32_t num_rows_to_insert;
+    uint32_t rows_capacity;
+    uint32_t id_to_delete;
+    uint32_t select_min_id;     // select 的 id 范围 [min, max] 和最多返回的行数
+    uint32_t select_max_id;
+    uint32_t select_limit;
+    uint32_t select_offset;     // 跳过的行数，按 id 范围查询时用子树行数直接定位
+    Aggregate select_aggregate;
+    IndexColumn select_column;  // 按列值查询时的列，NUM_INDEXES 表示按 id 范围查询
+    char select_value[COLUMN_EMAIL_SIZE + 1];
+    uint32_t select_value_length;
+    bool select_like;           // select_value 是 like 的模式，% 匹配任意串，_ 匹配一个字符
+    RowColumn select_columns[NUM_ROW_COLUMNS]; // 输出的列，按输出顺序
+    uint32_t num_select_columns;
+    IndexColumn index_column;   // create index 的列
 } Statement;
 
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+// 行的存储格式：username 和 email 依次存为 1 字节长度前缀加不带结尾 0 的内容，
+// id 是叶子槽中的 key，不在行数据里重复存储
+const uint32_t FIELD_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t ROW_MAX_SIZE = FIELD_LENGTH_SIZE + COLUMN_USERNAME_SIZE + FIELD_LENGTH_SIZE + COLUMN_EMAIL_SIZE;
 
-void print_row(Row *row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+// 语句出错或结束时的提示，REPL 和服务端共用。PREPARE_UNRECOGNIZED_STATEMENT 的提示带一个 %s，填入原语句
+const char *prepare_result_message(PrepareResult result) {
+    switch (result) {
+        case PREPARE_SUCCESS:
+            return "";
+        case PREPARE_SYNTAX_ERROR:
+            return "syntax error. could not parse statement.";
+        case PREPARE_UNRECOGNIZED_STATEMENT:
+            return "unrecognized keyword at start of '%s'.";
+        case PREPARE_NEGATIVE_ID:
+            return "id must be positive.";
+        case PREPARE_STRING_TOO_LONG:
+            return "string is too long.";
+    }
+    return "";
 }
 
-void serialize_row(Row *src, void *dst) {
-    // 将 Row 结构体的数据紧凑放置到从 dest 开始的位置
-    memcpy(dst + ID_OFFSET, &src->id, ID_SIZE);
-    strncpy(dst + USERNAME_OFFSET, src->username, USERNAME_SIZE);
-    strncpy(dst + EMAIL_OFFSET, src->email, EMAIL_SIZE);
+const char *execute_result_message(ExecuteResult result) {
+    switch (result) {
+        case EXECUTE_ROW:
+        case EXECUTE_SUCCESS:
+            return "executed.";
+        case EXECUTE_TABLE_FULL:
+            return "error: table full.";
+        case EXECUTE_DUPLICATE_KEY:
+            return "error: duplicate key.";
+        case EXECUTE_KEY_NOT_FOUND:
+            return "error: key not found.";
+        case EXECUTE_INDEX_EXISTS:
+            return "error: index already exists.";
+        case EXECUTE_NOT_PREPARED:
+            return "error: statement was not prepared.";
+    }
+    return "";
 }
 
-void deserialize_row(void *src, Row *dst) {
-    memcpy(&dst->id, src + ID_OFFSET, ID_SIZE);
-    memcpy(dst->username, src + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(dst->email, src + EMAIL_OFFSET, EMAIL_SIZE);
-}
+//
+// Output
+//
+// select 结果的编码，只输出列清单中的列：
+//   tuple  默认格式 "(1, name, mail)"
+//   csv    按 RFC 4180，含逗号、引号或换行的字段加引号，引号写两次
+//   tsv    制表符、换行、回车和反斜杠分别转义为 \t、\n、\r 和 \\ 两个字符
+//   binary 每行是 2 字节长度加行内容，id 为 4 字节整数，字符串为 1 字节长度加内容（本机字节序），
+//          长度为 0 的行表示结果结束
+// 行直接从行视图编码进可复用的缓冲区，不经过 printf
+//
+#define OUTPUT_FLUSH_SIZE (256 * 1024) // REPL 攒够这么多字节才写一次标准输出
+#define OUTPUT_ROW_MAX (8 + NUM_ROW_COLUMNS * (2 * COLUMN_EMAIL_SIZE + 16)) // 编码一行最多需要的字节数
+
+typedef enum {
+    OUTPUT_TUPLE,
+    OUTPUT_CSV,
+    OUTPUT_TSV,
+    OUTPUT_BINARY,
+    NUM_OUTPUT_MODES
+} OutputMode;
+
+const char *OUTPUT_MODE_NAMES[] = {"tuple", "csv", "tsv", "binary"};
 
-#define TABLE_MAX_PAGES 100
-const uint32_t PAGE_SIZE = 4096;
+// REPL 当前的输出格式，服务端每个连接各有一个
+OutputMode output_mode = OUTPUT_TUPLE;
 
 typedef struct {
-    int file_descriptor;
-    uint32_t file_length;
-    uint32_t num_pages;
-    void *pages[TABLE_MAX_PAGES];
-} Pager;
+    char *data;
+    uint32_t length;
+    uint32_t capacity;
+} OutputBuffer;
 
-Pager *pager_open(const char *filename) {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-    if (fd == -1) {
-        printf("unable to open file.\n");
-        exit(EXIT_FAILURE);
+OutputMode parse_output_mode(const char *name) {
+    for (uint32_t i = 0; i < NUM_OUTPUT_MODES; i++) {
+        if (strcmp(name, OUTPUT_MODE_NAMES[i]) == 0) {
+            return i;
+        }
     }
+    return NUM_OUTPUT_MODES;
+}
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
-    Pager *pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = file_length / PAGE_SIZE;
-
-    if (file_length % PAGE_SIZE != 0) {
-        printf("db file is not a whole number of pages. corrupt file.\n");
-        exit(EXIT_FAILURE);
+void output_reserve(OutputBuffer *out, uint32_t size) {
+    if (out->length + size <= out->capacity) {
+        return;
+    }
+    uint32_t capacity = out->capacity == 0 ? 4096 : out->capacity;
+    while (capacity < out->length + size) {
+        capacity *= 2;
     }
+    out->data = realloc(out->data, capacity);
+    out->capacity = capacity;
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+void output_printf(OutputBuffer *out, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        uint32_t space = out->capacity - out->length;
+        int length = vsnprintf(out->data + out->length, space, format, args);
+        va_end(args);
+        if ((uint32_t) length < space) {
+            out->length += length;
+            return;
+        }
+        output_reserve(out, length + 1);
     }
+}
 
-    return pager;
+void output_flush(OutputBuffer *out, FILE *file) {
+    fwrite(out->data, 1, out->length, file);
+    out->length = 0;
 }
 
-void *get_page(Pager *pager, uint32_t page_num) {
-    if (page_num >= TABLE_MAX_PAGES) {
-        printf("tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+// 写十进制数，返回写入之后的位置
+char *output_uint(char *dst, uint32_t value) {
+    char digits[10];
+    uint32_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (count > 0) {
+        *dst++ = digits[--count];
     }
+    return dst;
+}
 
-    if (pager->pages[page_num] == NULL) {
-        // 在内存创建新页
-        void *page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
-        }
-
-        if (page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t byte_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (byte_read == -1) {
-                printf("error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
+char *output_field(char *dst, OutputMode mode, const char *field, uint8_t length) {
+    switch (mode) {
+        case OUTPUT_TUPLE:
+            memcpy(dst, field, length);
+            return dst + length;
+        case OUTPUT_CSV:
+            if (length == 0 || (memchr(field, ',', length) == NULL && memchr(field, '"', length) == NULL &&
+                                memchr(field, '\n', length) == NULL && memchr(field, '\r', length) == NULL)) {
+                memcpy(dst, field, length);
+                return dst + length;
             }
-        }
-
-        pager->pages[page_num] = page;
-
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
-        }
+            *dst++ = '"';
+            for (uint32_t i = 0; i < length; i++) {
+                if (field[i] == '"') {
+                    *dst++ = '"';
+                }
+                *dst++ = field[i];
+            }
+            *dst++ = '"';
+            return dst;
+        case OUTPUT_TSV:
+            for (uint32_t i = 0; i < length; i++) {
+                char c = field[i];
+                if (c == '\t' || c == '\n' || c == '\r' || c == '\\') {
+                    *dst++ = '\\';
+                    c = c == '\t' ? 't' : c == '\n' ? 'n' : c == '\r' ? 'r' : '\\';
+                }
+                *dst++ = c;
+            }
+            return dst;
+        default:
+            *dst++ = length;
+            memcpy(dst, field, length);
+            return dst + length;
     }
-
-    return pager->pages[page_num];
 }
 
-void pager_flush(Pager *pager, uint32_t page_num) {
-    if (pager->pages[page_num] == NULL) {
-        printf("tried to flush null page.\n");
-        exit(EXIT_FAILURE);
+void output_row(OutputBuffer *out, OutputMode mode, Statement *statement, RowView *row) {
+    static const char *separators[] = {", ", ",", "\t", ""};
+    output_reserve(out, OUTPUT_ROW_MAX);
+    char *start = out->data + out->length;
+    char *dst = start;
+    if (mode == OUTPUT_BINARY) {
+        dst += sizeof(uint16_t); // 行长度最后填
+    } else if (mode == OUTPUT_TUPLE) {
+        *dst++ = '(';
     }
-
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1) {
-        printf("error seeking: %d.\n", errno);
-        exit(EXIT_FAILURE);
+    for (uint32_t i = 0; i < statement->num_select_columns; i++) {
+        if (i > 0) {
+            for (const char *separator = separators[mode]; *separator != '\0'; separator++) {
+                *dst++ = *separator;
+            }
+        }
+        RowColumn column = statement->select_columns[i];
+        if (column == ROW_ID && mode == OUTPUT_BINARY) {
+            memcpy(dst, &row->id, sizeof(uint32_t));
+            dst += sizeof(uint32_t);
+        } else if (column == ROW_ID) {
+            dst = output_uint(dst, row->id);
+        } else {
+            IndexColumn field = column == ROW_USERNAME ? INDEX_USERNAME : INDEX_EMAIL;
+            dst = output_field(dst, mode, row->fields[field], row->lengths[field]);
+        }
     }
-
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    if (bytes_written == -1) {
-        printf("error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+    if (mode == OUTPUT_BINARY) {
+        uint16_t length = dst - start - sizeof(uint16_t);
+        memcpy(start, &length, sizeof(uint16_t));
+    } else {
+        if (mode == OUTPUT_TUPLE) {
+            *dst++ = ')';
+        }
+        *dst++ = '\n';
     }
+    out->length = dst - out->data;
 }
 
-typedef struct {
-    uint32_t root_page_num;
-    Pager *pager;
-} Table;
-
-typedef struct {
-    Table *table;
-    uint32_t page_num;
-    uint32_t cell_num;
-    bool end_of_table;
-} Cursor;
+// 一条 select 的结果结束
+void output_end(OutputBuffer *out, OutputMode mode) {
+    if (mode == OUTPUT_BINARY) {
+        uint16_t end = 0;
+        output_reserve(out, sizeof(end));
+        memcpy(out->data + out->length, &end, sizeof(end));
+        out->length += sizeof(end);
+    }
+}
 
-typedef enum {
-    NODE_INTERNAL,
-    NODE_LEAF
-} NodeType;
 //
-// Common Node Header Layout
-//
-const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
-const uint32_t NODE_TYPE_OFFSET = 0;
-const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
-const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
-
+// Statistics
 //
-// Leaf Node Header Layout
+// 运行统计：缓冲池命中、页读写的字节数、fdatasync、节点分裂与合并（包括索引树）、select 扫描的行数，
+// 以及各类语句、缺页读和 fdatasync 的耗时分布。每个线程只写自己的计数块，不用原子读改写，也不和其他
+// 线程争用缓存行；.stats 在 stats_lock 下汇总所有计数块。线程退出时计数并入 stats_retired。
+// 分布用 HDR 风格的对数直方图：按 2 的幂分段，每段再等分 HISTOGRAM_SUB_BUCKETS 个桶，相对误差不超过 1/16
 //
-const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
 
-//
-// Leaf Node Body Layout
-//
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+typedef enum {
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_PAGES_PREFETCHED,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_SYNCS,
+    STAT_LEAF_SPLITS,
+    STAT_INTERNAL_SPLITS,
+    STAT_ROOT_SPLITS,
+    STAT_LEAF_MERGES,
+    STAT_INTERNAL_MERGES,
+    STAT_SELECTS,
+    STAT_ROWS_SCANNED,
+    STAT_ROWS_RETURNED,
+    STAT_ROOT_DESCENTS,
+    STAT_PATH_HINTS,
+    STAT_LEAF_HINTS,
+    NUM_COUNTERS
+} Counter;
 
-//
-//  Internal Node Header Layout
-//
-const uint32_t INTERNAL_NODE_NUM_KEY_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_NUM_KEY_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEY_OFFSET + INTERNAL_NODE_NUM_KEY_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                           INTERNAL_NODE_NUM_KEY_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const char *COUNTER_NAMES[] = {
+        "cache_hits", "cache_misses", "pages_prefetched", "bytes_read", "bytes_written", "syncs",
+        "leaf_splits", "internal_splits", "root_splits", "leaf_merges", "internal_merges",
+        "selects", "rows_scanned", "rows_returned", "root_descents", "path_hints", "leaf_hints"
+};
 
-//
-// Internal Node Body Layout
-//
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE;
+// 前四个和 StatementType 一一对应。select_rows 记录每条 select 扫描的行数，其余记录耗时（纳秒）
+typedef enum {
+    HIST_INSERT,
+    HIST_SELECT,
+    HIST_DELETE,
+    HIST_CREATE_INDEX,
+    HIST_PAGE_READ,
+    HIST_SYNC,
+    HIST_SELECT_ROWS,
+    NUM_HISTOGRAMS
+} HistogramType;
 
+const char *HISTOGRAM_NAMES[] = {"insert", "select", "delete", "create_index", "page_read", "sync", "select_rows"};
 
-uint32_t *leaf_node_num_cells(void *node) {
-    return node + LEAF_NODE_NUM_CELLS_OFFSET;
-}
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
 
-void *leaf_node_cell(void *node, uint32_t cell_num) {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
-}
+typedef struct Stats {
+    uint64_t counters[NUM_COUNTERS];
+    Histogram histograms[NUM_HISTOGRAMS];
+    struct Stats *prev;
+    struct Stats *next;
+} Stats;
 
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET;
-}
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // 保护下面三项和计数块链表
+Stats *stats_threads;          // 活着的线程的计数块
+Stats stats_retired;           // 已退出线程的计数之和
+Stats stats_baseline;          // .stats reset 时的汇总值，之后的汇总减去它
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+pthread_key_t stats_key;       // 只用于在线程退出时回收计数块
+_Thread_local Stats *thread_stats;
 
-uint32_t *leaf_node_value(void *node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET;
+void stats_merge(Stats *dst, Stats *src) {
+    for (uint32_t i = 0; i < NUM_COUNTERS; i++) {
+        dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+    }
+    for (uint32_t i = 0; i < NUM_HISTOGRAMS; i++) {
+        Histogram *d = &dst->histograms[i];
+        Histogram *s = &src->histograms[i];
+        d->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        d->sum += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+        d->max = max > d->max ? max : d->max;
+        for (uint32_t j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            d->buckets[j] += __atomic_load_n(&s->buckets[j], __ATOMIC_RELAXED);
+        }
+    }
 }
 
-uint32_t *leaf_node_next_leaf(void *node) {
-    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+void stats_thread_exit(void *arg) {
+    Stats *stats = arg;
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(&stats_retired, stats);
+    if (stats->prev != NULL) {
+        stats->prev->next = stats->next;
+    } else {
+        stats_threads = stats->next;
+    }
+    if (stats->next != NULL) {
+        stats->next->prev = stats->prev;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    free(stats);
 }
 
-uint32_t *internal_node_num_keys(void *node) {
-    return node + INTERNAL_NODE_NUM_KEY_OFFSET;
+void stats_create_key() {
+    pthread_key_create(&stats_key, stats_thread_exit);
 }
 
-uint32_t *internal_node_right_child(void *node) {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+Stats *stats_local() {
+    if (thread_stats != NULL) {
+        return thread_stats;
+    }
+    pthread_once(&stats_once, stats_create_key);
+    thread_stats = calloc(1, sizeof(Stats));
+    pthread_setspecific(stats_key, thread_stats);
+    pthread_mutex_lock(&stats_lock);
+    thread_stats->next = stats_threads;
+    if (stats_threads != NULL) {
+        stats_threads->prev = thread_stats;
+    }
+    stats_threads = thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+    return thread_stats;
 }
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+// 只有所属线程写计数，用原子存储只是为了让汇总线程读到完整的值
+void stats_add(Counter counter, uint64_t value) {
+    uint64_t *count = &stats_local()->counters[counter];
+    __atomic_store_n(count, *count + value, __ATOMIC_RELAXED);
 }
 
-uint32_t *internal_node_child(void *node, uint32_t child_num) {
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys) {
-        printf("tried to access child_num %d > num_keys %d.\n", child_num, num_keys);
-        exit(EXIT_FAILURE);
-    } else if (child_num == num_keys) {
-        return internal_node_right_child(node);
-    } else {
-        return internal_node_cell(node, child_num);
+uint32_t histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
     }
+    uint32_t shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (uint32_t) (value >> shift) - HISTOGRAM_SUB_BUCKETS;
 }
 
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+// 桶中的最大值
+uint64_t histogram_bucket_max(uint32_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    uint32_t shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
 }
 
-NodeType get_node_type(void *node) {
-    uint8_t value = *((uint8_t *) (node + NODE_TYPE_OFFSET));
-    return (NodeType) value;
+void stats_record(HistogramType type, uint64_t value) {
+    Histogram *histogram = &stats_local()->histograms[type];
+    uint64_t *bucket = &histogram->buckets[histogram_bucket(value)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+    if (value > histogram->max) {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
 }
 
-void set_node_type(void *node, NodeType type) {
-    uint8_t value = type;
-    *((uint8_t *) (node + NODE_TYPE_OFFSET)) = value;
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void print_constants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+// fdatasync 并记录耗时，磁盘变慢首先体现在这里
+int stats_fdatasync(int fd) {
+    uint64_t start = stats_now();
+    int result = fdatasync(fd);
+    stats_add(STAT_SYNCS, 1);
+    stats_record(HIST_SYNC, stats_now() - start);
+    return result;
 }
 
-void indent(uint32_t level) {
-    for (uint32_t i = 0; i < level; i++) {
-        printf("  ");
+void stats_sum(Stats *total) {
+    memset(total, 0, sizeof(Stats));
+    stats_merge(total, &stats_retired);
+    for (Stats *stats = stats_threads; stats != NULL; stats = stats->next) {
+        stats_merge(total, stats);
     }
 }
 
-void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
-    void *node = get_page(pager, page_num);
-    uint32_t num_keys, child;
-
-    switch (get_node_type(node)) {
-        case NODE_LEAF:
-            num_keys = *leaf_node_num_cells(node);
-            indent(indentation_level);
-            printf("- leaf (size %d) \n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-                indent(indentation_level + 1);
-                printf("- %d\n", *leaf_node_key(node, i));
-            }
-            break;
-        case NODE_INTERNAL:
-            num_keys = *internal_node_num_keys(node);
-            indent(indentation_level);
-            printf("- internal (size %d) \n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-                child = *internal_node_child(node, i);
-                print_tree(pager, child, indentation_level + 1);
-
-                indent(indentation_level + 1);
-                printf("- key %d \n", *internal_node_key(node, i));
+// 汇总上次 reset 以来的统计。最大值不能相减，reset 之后用仍有计数的最高桶限制
+void stats_collect(Stats *total) {
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(total);
+    for (uint32_t i = 0; i < NUM_COUNTERS; i++) {
+        total->counters[i] -= stats_baseline.counters[i];
+    }
+    for (uint32_t i = 0; i < NUM_HISTOGRAMS; i++) {
+        Histogram *histogram = &total->histograms[i];
+        Histogram *baseline = &stats_baseline.histograms[i];
+        histogram->count -= baseline->count;
+        histogram->sum -= baseline->sum;
+        uint64_t max = 0;
+        for (uint32_t j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            histogram->buckets[j] -= baseline->buckets[j];
+            if (histogram->buckets[j] > 0) {
+                max = histogram_bucket_max(j);
             }
-            child = *internal_node_right_child(node);
-            print_tree(pager, child, indentation_level + 1);
-            break;
+        }
+        histogram->max = max < histogram->max ? max : histogram->max;
     }
+    pthread_mutex_unlock(&stats_lock);
 }
 
-// 返回给定 key 的位置
-// 如果 key 不存在，则返回它应当插入的位置
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
-    void *node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
-    Cursor *cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
+void stats_reset() {
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(&stats_baseline);
+    pthread_mutex_unlock(&stats_lock);
+}
 
-    // 二分查找
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-    while (min_index < one_past_max_index) {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            cursor->end_of_table = (cursor->cell_num == num_cells);
-            return cursor;
-        } else if (key < key_at_index) {
-            one_past_max_index = index;
-        } else {
-            min_index = index + 1;
+// 第 fraction 分位所在桶的最大值，不超过记录到的最大值
+uint64_t histogram_percentile(Histogram *histogram, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * histogram->count + 0.5);
+    rank = rank == 0 ? 1 : rank;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_max(i);
+            return value < histogram->max ? value : histogram->max;
         }
     }
+    return histogram->max;
+}
 
-    cursor->cell_num = min_index;
-    cursor->end_of_table = (cursor->cell_num == num_cells);
-    return cursor;
+uint32_t serialize_field(const char *src, void *dst) {
+    uint8_t length = strlen(src);
+    memcpy(dst, &length, FIELD_LENGTH_SIZE);
+    memcpy(dst + FIELD_LENGTH_SIZE, src, length);
+    return FIELD_LENGTH_SIZE + length;
 }
 
-// 对中间节点进行递归查询
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
-    void *node = get_page(table->pager, page_num);
-    uint32_t num_keys = *internal_node_num_keys(node);
+uint32_t deserialize_field(void *src, char *dst) {
+    uint8_t length;
+    memcpy(&length, src, FIELD_LENGTH_SIZE);
+    memcpy(dst, src + FIELD_LENGTH_SIZE, length);
+    dst[length] = '\0';
+    return FIELD_LENGTH_SIZE + length;
+}
 
-    // 对中间节点进行二分查找
-    uint32_t min_idx = 0, max_idx = num_keys; // [0, num_keys]
-    while (min_idx < max_idx) {
-        uint32_t idx = (min_idx + max_idx) / 2;
-        uint32_t key_to_right = *internal_node_key(node, idx);
-        // [min_idx, idx] [idx + 1, max_idx]
-        if (key_to_right <= key) {
-            min_idx = idx + 1;
-        } else {
-            max_idx = idx;
-        }
-    }
+// 将 Row 结构体的数据紧凑放置到从 dst 开始的位置，返回占用的字节数（不超过 ROW_MAX_SIZE）
+uint32_t serialize_row(Row *src, void *dst) {
+    uint32_t size = serialize_field(src->username, dst);
+    size += serialize_field(src->email, dst + size);
+    return size;
+}
 
-    // 递归查找
-    uint32_t child_num = *internal_node_child(node, min_idx);
-    void *child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-        case NODE_LEAF:
-            return leaf_node_find(table, child_num, key);
-        case NODE_INTERNAL:
-            return internal_node_find(table, child_num, key);
+// 不读取 id，id 由调用者从 key 中取得
+void deserialize_row(void *src, Row *dst) {
+    uint32_t size = deserialize_field(src, dst->username);
+    deserialize_field(src + size, dst->email);
+}
+
+// 同 deserialize_row，但不复制字符串
+void row_view_deserialize(void *src, RowView *view) {
+    uint8_t *field = src;
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        view->lengths[i] = field[0];
+        view->fields[i] = (const char *) field + FIELD_LENGTH_SIZE;
+        field += FIELD_LENGTH_SIZE + field[0];
     }
 }
 
-bool is_node_root(void *node) {
-    uint8_t value = *((uint8_t *) (node + IS_ROOT_OFFSET));
-    return (bool) value;
+void row_view_from_row(Row *row, RowView *view) {
+    view->id = row->id;
+    view->fields[INDEX_USERNAME] = row->username;
+    view->lengths[INDEX_USERNAME] = strlen(row->username);
+    view->fields[INDEX_EMAIL] = row->email;
+    view->lengths[INDEX_EMAIL] = strlen(row->email);
 }
 
-void set_node_root(void *node, bool is_root) {
-    uint8_t value = is_root;
-    *((uint8_t *) (node + IS_ROOT_OFFSET)) = value;
+void row_from_view(RowView *view, Row *row) {
+    row->id = view->id;
+    memcpy(row->username, view->fields[INDEX_USERNAME], view->lengths[INDEX_USERNAME]);
+    row->username[view->lengths[INDEX_USERNAME]] = '\0';
+    memcpy(row->email, view->fields[INDEX_EMAIL], view->lengths[INDEX_EMAIL]);
+    row->email[view->lengths[INDEX_EMAIL]] = '\0';
 }
 
-void initialize_leaf_node(void *node) {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
-    *leaf_node_next_leaf(node) = 0;
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536 // 叶子槽中的行偏移是 16 位的
+// 页大小在创建数据库时选定并记录在文件头中，打开数据库时由 set_page_size 设置，之后不再改变
+uint32_t PAGE_SIZE = DEFAULT_PAGE_SIZE;
+// 页大小和压缩模式是进程内共享的，同时打开的数据库必须一致。open_databases 记录已经打开的数量，由 page_layout_lock 保护
+pthread_mutex_t page_layout_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t open_databases = 0;
+
+//
+// Database Header Layout（第 0 页，B+ 树的根固定在第 1 页）
+//
+#define HEADER_PAGE_NUM 0
+#define ROOT_PAGE_NUM 1
+const char DB_HEADER_MAGIC[] = "simple_db format";
+const uint32_t HEADER_MAGIC_SIZE = 16;
+const uint32_t HEADER_MAGIC_OFFSET = 0;
+const uint32_t HEADER_FREE_LIST_HEAD_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_FREE_LIST_HEAD_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+const uint32_t HEADER_NUM_FREE_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_FREE_PAGES_OFFSET = HEADER_FREE_LIST_HEAD_OFFSET + HEADER_FREE_LIST_HEAD_SIZE;
+const uint32_t HEADER_FORMAT_VERSION_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_FORMAT_VERSION_OFFSET = HEADER_NUM_FREE_PAGES_OFFSET + HEADER_NUM_FREE_PAGES_SIZE;
+const uint32_t HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_PAGE_SIZE_OFFSET = HEADER_FORMAT_VERSION_OFFSET + HEADER_FORMAT_VERSION_SIZE;
+const uint32_t HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_ROOT_PAGE_OFFSET = HEADER_PAGE_SIZE_OFFSET + HEADER_PAGE_SIZE_SIZE;
+const uint32_t HEADER_NUM_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_PAGES_OFFSET = HEADER_ROOT_PAGE_OFFSET + HEADER_ROOT_PAGE_SIZE;
+const uint32_t HEADER_INDEX_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_INDEX_ROOTS_OFFSET = HEADER_NUM_PAGES_OFFSET + HEADER_NUM_PAGES_SIZE;
+const uint32_t HEADER_COMPRESSION_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_COMPRESSION_OFFSET = HEADER_INDEX_ROOTS_OFFSET + NUM_INDEXES * HEADER_INDEX_ROOT_SIZE;
+const uint32_t HEADER_SIZE = HEADER_COMPRESSION_OFFSET + HEADER_COMPRESSION_SIZE;
+// 页格式版本：1 是 key 和行数据交错存放的旧格式（没有这个字段，读出来是 0），2 是 key 数组和行数据分开存放，
+// 3 是变长行的 slotted page 叶子格式，4 在文件头中加入页大小、根页号和总页数，5 加入二级索引的根页号，
+// 6 加入页压缩标志，7 在中间节点中记录每个子树的行数
+const uint32_t DB_FORMAT_VERSION = 7;
+
+uint32_t *header_free_list_head(void *header) {
+    return header + HEADER_FREE_LIST_HEAD_OFFSET;
 }
 
-void initialize_internal_node(void *node) {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+uint32_t *header_num_free_pages(void *header) {
+    return header + HEADER_NUM_FREE_PAGES_OFFSET;
 }
 
-Cursor *table_find(Table *table, uint32_t key) {
-    uint32_t root_page_num = table->root_page_num;
-    void *root_node = get_page(table->pager, root_page_num);
-    if (get_node_type(root_node) == NODE_LEAF) {
-        return leaf_node_find(table, root_page_num, key);
-    } else {
-        return internal_node_find(table, root_page_num, key);
-    }
+uint32_t *header_format_version(void *header) {
+    return header + HEADER_FORMAT_VERSION_OFFSET;
 }
 
-uint32_t get_node_max_key(void *node) {
-    switch (get_node_type(node)) {
-        case NODE_INTERNAL:
-            return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-        case NODE_LEAF:
-            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-    }
+uint32_t *header_page_size(void *header) {
+    return header + HEADER_PAGE_SIZE_OFFSET;
 }
 
-Cursor *table_start(Table *table) {
-    Cursor *cursor = table_find(table, 0);
-    void *node = get_page(table->pager, cursor->page_num);
-    uint32_t num_cell = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cell == 0);
-    return cursor;
+uint32_t *header_root_page(void *header) {
+    return header + HEADER_ROOT_PAGE_OFFSET;
 }
 
-Table *db_open(const char *filename) {
-    Pager *pager = pager_open(filename);
-    Table *table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
+uint32_t *header_num_pages(void *header) {
+    return header + HEADER_NUM_PAGES_OFFSET;
+}
 
-    if (pager->num_pages == 0) {
-        void *root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
-    }
+// 列上索引的根页号，0 表示没有建索引
+uint32_t *header_index_root(void *header, IndexColumn column) {
+    return header + HEADER_INDEX_ROOTS_OFFSET + column * HEADER_INDEX_ROOT_SIZE;
+}
 
-    return table;
+// 非 0 表示除文件头以外的页都压缩存储
+uint32_t *header_compression(void *header) {
+    return header + HEADER_COMPRESSION_OFFSET;
 }
 
-void db_close(Table *table) {
-    Pager *pager = table->pager;
+void set_page_size(uint32_t page_size);
 
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
+bool is_valid_page_size(uint32_t page_size) {
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
+}
+
+//
+// Page Compression
+//
+// 每页仍占据文件中自己的 PAGE_SIZE 页槽，页号到文件位置的映射不变。压缩后的数据连同
+// 4 字节页槽头写在页槽开头，按文件系统块对齐，页槽剩下的部分打洞归还给文件系统。
+// 省不下一个块的页原样存储，原样存储的页第一个字节是节点类型，不会等于压缩标记。
+// 文件头所在的第 0 页总是原样存储，打开数据库时才能直接读出页大小和压缩标志
+//
+#define COMPRESSED_PAGE_MARK 0xC5
+#define FS_BLOCK_SIZE 4096          // 打洞和对齐的粒度
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+const uint32_t COMPRESSED_PAGE_HEADER_SIZE = 4; // 标记 1 字节，保留 1 字节，压缩后长度 2 字节
+// 压缩模式在打开数据库时由文件头设置，之后不再改变
+bool PAGE_COMPRESSION = false;
+
+void page_clear_unused(void *page);
+
+uint32_t lz_read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// 写出 LZ4 风格的变长长度：超过 15 的部分用若干个 255 加一个余数字节表示
+uint8_t *lz_write_length(uint8_t *out, uint32_t length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+// LZ4 风格的块压缩：每个序列是一个 token（高 4 位字面量长度，低 4 位匹配长度减 4）、
+// 字面量和 2 字节匹配距离，最后一个序列只有字面量。输出超过 capacity 时返回 0
+uint32_t lz_compress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint8_t *out = dst;
+    uint8_t *out_end = dst + capacity;
+    uint32_t anchor = 0;
+    uint32_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t sequence = lz_read32(src + pos);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = pos;
+        if (candidate >= pos || pos - candidate > UINT16_MAX || lz_read32(src + candidate) != sequence) {
+            pos++;
+            continue;
+        }
+
+        uint32_t match_length = LZ_MIN_MATCH;
+        while (pos + match_length < size && src[candidate + match_length] == src[pos + match_length]) {
+            match_length++;
+        }
+        uint32_t literal_length = pos - anchor;
+        // token、两个长度扩展、字面量和距离的最大长度
+        if (out + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > out_end) {
+            return 0;
+        }
+        uint8_t *token = out++;
+        *token = (literal_length < 15 ? literal_length : 15) << 4;
+        if (literal_length >= 15) {
+            out = lz_write_length(out, literal_length - 15);
+        }
+        memcpy(out, src + anchor, literal_length);
+        out += literal_length;
+        uint16_t distance = pos - candidate;
+        memcpy(out, &distance, sizeof(distance));
+        out += sizeof(distance);
+        uint32_t extra = match_length - LZ_MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15) {
+            out = lz_write_length(out, extra - 15);
+        }
+        pos += match_length;
+        anchor = pos;
+    }
+
+    uint32_t literal_length = size - anchor;
+    if (out + 1 + literal_length / 255 + 1 + literal_length > out_end) {
+        return 0;
+    }
+    *out++ = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15) {
+        out = lz_write_length(out, literal_length - 15);
+    }
+    memcpy(out, src + anchor, literal_length);
+    out += literal_length;
+    return out - dst;
+}
+
+// 解压到恰好 size 字节，数据损坏（越界、距离非法、长度不符）时返回 false
+bool lz_decompress(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t size) {
+    const uint8_t *in = src;
+    const uint8_t *in_end = src + src_size;
+    uint32_t out = 0;
+    while (in < in_end) {
+        uint8_t token = *in++;
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15) {
+            uint8_t byte;
+            do {
+                if (in == in_end) {
+                    return false;
+                }
+                byte = *in++;
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > (uint32_t) (in_end - in) || literal_length > size - out) {
+            return false;
+        }
+        memcpy(dst + out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == in_end) {
+            break; // 最后一个序列只有字面量
+        }
+
+        uint16_t distance;
+        if (in_end - in < (ptrdiff_t) sizeof(distance)) {
+            return false;
+        }
+        memcpy(&distance, in, sizeof(distance));
+        in += sizeof(distance);
+        uint32_t match_length = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            uint8_t byte;
+            do {
+                if (in == in_end) {
+                    return false;
+                }
+                byte = *in++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        if (distance == 0 || distance > out || match_length > size - out) {
+            return false;
+        }
+        // 匹配可以和输出重叠（距离小于长度），只能逐字节复制
+        for (uint32_t i = 0; i < match_length; i++, out++) {
+            dst[out] = dst[out - distance];
+        }
+    }
+    return out == size;
+}
+
+// 把一页写到主文件的页槽中。buffer 是调用者提供的 2 * PAGE_SIZE 字节暂存区，不压缩时可以为 NULL
+void page_write(int fd, uint32_t page_num, void *page, uint8_t *buffer) {
+    off_t offset = (off_t) page_num * PAGE_SIZE;
+    if (PAGE_COMPRESSION && page_num != HEADER_PAGE_NUM) {
+        // 先清掉页内空闲区域里的旧数据，它们不影响页的内容，却会降低压缩率
+        uint8_t *clean = buffer;
+        uint8_t *out = buffer + PAGE_SIZE;
+        memcpy(clean, page, PAGE_SIZE);
+        page_clear_unused(clean);
+        uint32_t capacity = PAGE_SIZE - FS_BLOCK_SIZE - COMPRESSED_PAGE_HEADER_SIZE;
+        uint32_t size = lz_compress(clean, PAGE_SIZE, out + COMPRESSED_PAGE_HEADER_SIZE, capacity);
+        if (size > 0) {
+            uint32_t stored = (COMPRESSED_PAGE_HEADER_SIZE + size + FS_BLOCK_SIZE - 1) & ~(FS_BLOCK_SIZE - 1);
+            out[0] = COMPRESSED_PAGE_MARK;
+            out[1] = 0;
+            uint16_t length = size;
+            memcpy(out + 2, &length, sizeof(length));
+            memset(out + COMPRESSED_PAGE_HEADER_SIZE + size, 0, stored - COMPRESSED_PAGE_HEADER_SIZE - size);
+            if (pwrite(fd, out, stored, offset) != stored) {
+                printf("error writing: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            stats_add(STAT_BYTES_WRITTEN, stored);
+            // 文件系统不支持打洞时页槽尾部仍然占用空间，但内容不受影响
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset + stored, PAGE_SIZE - stored);
+            return;
+        }
+    }
+    if (pwrite(fd, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+        printf("error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(STAT_BYTES_WRITTEN, PAGE_SIZE);
+}
+
+// 处理从主文件页槽读到的 bytes_read 字节：文件末尾之后的部分补 0，压缩页就地解压。buffer 同 page_write
+void page_decode(uint32_t page_num, void *page, ssize_t bytes_read, uint8_t *buffer) {
+    if (bytes_read < PAGE_SIZE) {
+        memset(page + bytes_read, 0, PAGE_SIZE - bytes_read);
+    }
+    if (!PAGE_COMPRESSION || page_num == HEADER_PAGE_NUM || *(uint8_t *) page != COMPRESSED_PAGE_MARK) {
+        return;
+    }
+
+    uint16_t length;
+    memcpy(&length, page + 2, sizeof(length));
+    bool ok = COMPRESSED_PAGE_HEADER_SIZE + length <= (uint32_t) bytes_read;
+    if (ok) {
+        memcpy(buffer, page + COMPRESSED_PAGE_HEADER_SIZE, length);
+        ok = lz_decompress(buffer, length, page, PAGE_SIZE);
+    }
+    if (!ok) {
+        printf("page %d has corrupt compressed data.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// 压缩模式下第一次只读页槽开头的一个块：压缩页通常就在这个块里，否则从页槽头得知还要读多少
+uint32_t page_first_read_size(uint32_t page_num) {
+    return PAGE_COMPRESSION && page_num != HEADER_PAGE_NUM ? FS_BLOCK_SIZE : PAGE_SIZE;
+}
+
+// 第一次读到 bytes_read 字节后补读页槽中剩下的有效部分：压缩页读到页槽头记录的长度为止，原样存储的页读满一页。
+// 返回总共读到的字节数
+ssize_t page_read_rest(int fd, uint32_t page_num, void *page, ssize_t bytes_read) {
+    if (page_first_read_size(page_num) == PAGE_SIZE || bytes_read < FS_BLOCK_SIZE) {
+        return bytes_read;
+    }
+    uint32_t wanted = PAGE_SIZE;
+    if (*(uint8_t *) page == COMPRESSED_PAGE_MARK) {
+        uint16_t length;
+        memcpy(&length, page + 2, sizeof(length));
+        // 长度不对时 page_decode 会报告损坏
+        wanted = COMPRESSED_PAGE_HEADER_SIZE + length < PAGE_SIZE ? COMPRESSED_PAGE_HEADER_SIZE + length : PAGE_SIZE;
+    }
+    off_t offset = (off_t) page_num * PAGE_SIZE;
+    while (bytes_read < wanted) {
+        ssize_t more = pread(fd, page + bytes_read, wanted - bytes_read, offset + bytes_read);
+        if (more == -1) {
+            printf("error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if (more == 0) {
+            break;
+        }
+        bytes_read += more;
+    }
+    return bytes_read;
+}
+
+// 从主文件的页槽读出一页，只读有效的部分
+void page_read(int fd, uint32_t page_num, void *page, uint8_t *buffer) {
+    ssize_t bytes_read = pread(fd, page, page_first_read_size(page_num), (off_t) page_num * PAGE_SIZE);
+    if (bytes_read == -1) {
+        printf("error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    bytes_read = page_read_rest(fd, page_num, page, bytes_read);
+    stats_add(STAT_BYTES_READ, bytes_read);
+    page_decode(page_num, page, bytes_read, buffer);
+}
+
+#define DEFAULT_CACHE_PAGES 1024
+#define MIN_CACHE_PAGES 8
+#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME UINT32_MAX
+#define MAX_WRITE_RUN 256 // 一次 pwritev 合并的最大页数，小于 IOV_MAX
+#define MMAP_CHUNK_PAGES 1024 // mmap 模式下文件每次扩展的页数
+#define MMAP_RESERVE_BYTES (1ULL << 40) // mmap 模式预留的虚拟地址空间，映射扩展时地址不变
+
+// 缓冲池中的一个页帧
+typedef struct {
+    uint32_t page_num;   // 当前装载的页号，空闲时为 INVALID_PAGE_NUM
+    uint32_t pin_count;  // 被引用的次数，大于 0 时不可被淘汰
+    bool referenced;     // CLOCK 算法的访问位
+    bool dirty;          // 装入后是否被修改过
+    bool loading;        // 正在从文件读入，读入在 pager->lock 之外进行
+    void *data;
+} Frame;
+
+//
+// Write-Ahead Log
+//
+// 提交时把脏页的完整镜像顺序追加到 <db>-wal，多个提交共用一次 fdatasync，语句在 fdatasync 覆盖它的提交帧之后才返回；
+// 后台线程把已持久化的帧写回主文件，全部写回后从头复用日志文件。
+// 打开数据库时重放日志中最后一个提交帧之前的所有帧。
+//
+#define WAL_CHECKPOINT_FRAMES 1000  // 未写回的帧超过这个数时后台开始 checkpoint
+#define WAL_MAX_FRAMES 8000         // 后台追不上时由前台阻塞 checkpoint，限制日志长度
+#define GROUP_COMMIT_WINDOW_MS 10   // 组提交时最长等待多久做一次 fdatasync
+
+const char WAL_MAGIC[] = "simple_db wal v1";
+const uint32_t WAL_MAGIC_SIZE = 16;
+const uint32_t WAL_HEADER_PAGE_SIZE_OFFSET = 16;
+const uint32_t WAL_HEADER_SALT_OFFSET = 20;
+const uint32_t WAL_HEADER_SIZE = 32;
+
+const uint32_t WAL_FRAME_PAGE_NUM_OFFSET = 0;
+const uint32_t WAL_FRAME_DB_SIZE_OFFSET = 4;  // 提交帧记录提交后的总页数，其余帧为 0
+const uint32_t WAL_FRAME_SALT_OFFSET = 8;
+const uint32_t WAL_FRAME_CHECKSUM_OFFSET = 16;
+const uint32_t WAL_FRAME_HEADER_SIZE = 24;
+
+typedef struct {
+    uint32_t *keys;
+    uint32_t *values;
+    uint32_t capacity;
+    uint32_t count;
+} PageMap;
+
+void page_map_init(PageMap *map, uint32_t capacity) {
+    map->capacity = capacity;
+    map->count = 0;
+    map->keys = malloc(sizeof(uint32_t) * capacity);
+    map->values = malloc(sizeof(uint32_t) * capacity);
+    for (uint32_t i = 0; i < capacity; i++) {
+        map->keys[i] = INVALID_PAGE_NUM;
+    }
+}
+
+void page_map_free(PageMap *map) {
+    free(map->keys);
+    free(map->values);
+}
+
+uint32_t page_map_get(PageMap *map, uint32_t key) {
+    uint32_t slot = (key * 2654435761u) & (map->capacity - 1);
+    while (map->keys[slot] != INVALID_PAGE_NUM) {
+        if (map->keys[slot] == key) {
+            return map->values[slot];
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return UINT32_MAX;
+}
+
+void page_map_put(PageMap *map, uint32_t key, uint32_t value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        // 装载因子超过 0.5 时扩容一倍
+        PageMap bigger;
+        page_map_init(&bigger, map->capacity * 2);
+        for (uint32_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i] != INVALID_PAGE_NUM) {
+                page_map_put(&bigger, map->keys[i], map->values[i]);
+            }
+        }
+        page_map_free(map);
+        *map = bigger;
+    }
+
+    uint32_t slot = (key * 2654435761u) & (map->capacity - 1);
+    while (map->keys[slot] != INVALID_PAGE_NUM && map->keys[slot] != key) {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    if (map->keys[slot] == INVALID_PAGE_NUM) {
+        map->count++;
+    }
+    map->keys[slot] = key;
+    map->values[slot] = value;
+}
+
+void page_map_clear(PageMap *map) {
+    for (uint32_t i = 0; i < map->capacity; i++) {
+        map->keys[i] = INVALID_PAGE_NUM;
+    }
+    map->count = 0;
+}
+
+typedef struct {
+    int file_descriptor;
+    int db_file_descriptor;
+    char *filename;
+    uint32_t salt;
+    uint32_t num_frames;        // 已经写入的帧数
+    uint32_t num_committed;     // 最后一个提交帧之前（含）的帧数
+    uint32_t num_synced;        // 已经 fdatasync 过的已提交帧数
+    uint32_t num_backfilled;    // 这之前的帧都已写回主文件
+    uint64_t commit_seq;        // 已经写入日志的提交数，复用日志时不清零
+    uint64_t synced_seq;        // 其中已经 fdatasync 过的提交数
+    bool syncing;               // 有线程正在 fdatasync，其他线程等它结束
+    uint32_t num_readers;       // 按索引查到的偏移读帧还没读完的次数，大于 0 时不能从头复用日志
+    uint32_t group_commit;      // 每攒够多少个提交做一次 fdatasync
+    PageMap index;              // 页号 -> 该页最新的帧号
+    pthread_mutex_t append_lock; // 串行化追加和复用日志：写语句提交和其他线程淘汰脏页都会追加
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t synced;      // 一次 fdatasync 结束
+    pthread_t worker;
+    bool checkpointing;
+    bool shutting_down;
+} Wal;
+
+uint64_t wal_checksum(void *frame_header, void *page) {
+    // FNV-1a，覆盖帧头中校验和之前的部分和整页内容
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint32_t i = 0; i < WAL_FRAME_CHECKSUM_OFFSET; i++) {
+        hash = (hash ^ ((uint8_t *) frame_header)[i]) * 1099511628211ULL;
+    }
+    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+        hash = (hash ^ ((uint8_t *) page)[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+off_t wal_frame_offset(uint32_t frame_num) {
+    return WAL_HEADER_SIZE + (off_t) frame_num * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+}
+
+void wal_write_header(Wal *wal) {
+    uint8_t header[WAL_HEADER_SIZE];
+    memset(header, 0, WAL_HEADER_SIZE);
+    memcpy(header, WAL_MAGIC, WAL_MAGIC_SIZE);
+    *(uint32_t *) (header + WAL_HEADER_PAGE_SIZE_OFFSET) = PAGE_SIZE;
+    *(uint32_t *) (header + WAL_HEADER_SALT_OFFSET) = wal->salt;
+    if (pwrite(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE) {
+        printf("error writing wal header: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// 把 num_pages 个页镜像追加为连续的帧，db_size 非 0 表示最后一帧是提交帧，这时返回它的提交序号，否则返回 0
+uint64_t wal_append(Wal *wal, uint32_t *page_nums, void **pages, uint32_t num_pages, uint32_t db_size) {
+    uint8_t headers[num_pages][WAL_FRAME_HEADER_SIZE];
+    struct iovec iov[num_pages * 2];
+    for (uint32_t i = 0; i < num_pages; i++) {
+        memset(headers[i], 0, WAL_FRAME_HEADER_SIZE);
+        *(uint32_t *) (headers[i] + WAL_FRAME_PAGE_NUM_OFFSET) = page_nums[i];
+        *(uint32_t *) (headers[i] + WAL_FRAME_DB_SIZE_OFFSET) = (i == num_pages - 1) ? db_size : 0;
+        *(uint32_t *) (headers[i] + WAL_FRAME_SALT_OFFSET) = wal->salt;
+        *(uint64_t *) (headers[i] + WAL_FRAME_CHECKSUM_OFFSET) = wal_checksum(headers[i], pages[i]);
+        iov[i * 2].iov_base = headers[i];
+        iov[i * 2].iov_len = WAL_FRAME_HEADER_SIZE;
+        iov[i * 2 + 1].iov_base = pages[i];
+        iov[i * 2 + 1].iov_len = PAGE_SIZE;
+    }
+
+    pthread_mutex_lock(&wal->append_lock);
+    pthread_mutex_lock(&wal->lock);
+    uint32_t first_frame = wal->num_frames;
+    pthread_mutex_unlock(&wal->lock);
+
+    // 追加由 append_lock 串行化，写文件时不需要持有 wal->lock
+    for (uint32_t done = 0; done < num_pages;) {
+        uint32_t batch = num_pages - done < MAX_WRITE_RUN ? num_pages - done : MAX_WRITE_RUN;
+        ssize_t expected = (ssize_t) batch * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+        if (pwritev(wal->file_descriptor, iov + done * 2, (int) batch * 2,
+                    wal_frame_offset(first_frame + done)) != expected) {
+            printf("error writing wal: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        done += batch;
+    }
+    stats_add(STAT_BYTES_WRITTEN, (uint64_t) num_pages * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE));
+
+    pthread_mutex_lock(&wal->lock);
+    for (uint32_t i = 0; i < num_pages; i++) {
+        page_map_put(&wal->index, page_nums[i], first_frame + i);
+    }
+    wal->num_frames = first_frame + num_pages;
+    uint64_t seq = 0;
+    if (db_size != 0) {
+        wal->num_committed = wal->num_frames;
+        seq = ++wal->commit_seq;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    pthread_mutex_unlock(&wal->append_lock);
+    return seq;
+}
+
+uint32_t wal_num_frames(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    uint32_t num_frames = wal->num_frames;
+    pthread_mutex_unlock(&wal->lock);
+    return num_frames;
+}
+
+// 页在日志中最新镜像的文件偏移，不在日志中时返回 -1。找到时占住日志，读完之后调用 wal_end_read，
+// 在此之前日志不会从头复用，偏移处的帧不会被覆盖
+off_t wal_begin_read(Wal *wal, uint32_t page_num) {
+    pthread_mutex_lock(&wal->lock);
+    uint32_t frame_num = page_map_get(&wal->index, page_num);
+    if (frame_num != UINT32_MAX) {
+        wal->num_readers++;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    if (frame_num == UINT32_MAX) {
+        return -1;
+    }
+    return wal_frame_offset(frame_num) + WAL_FRAME_HEADER_SIZE;
+}
+
+void wal_end_read(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    wal->num_readers--;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// 页在日志中有镜像时从日志读取，返回是否找到
+bool wal_read_page(Wal *wal, uint32_t page_num, void *page) {
+    off_t offset = wal_begin_read(wal, page_num);
+    if (offset == -1) {
+        return false;
+    }
+
+    if (pread(wal->file_descriptor, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+        printf("error reading wal: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal_end_read(wal);
+    stats_add(STAT_BYTES_READ, PAGE_SIZE);
+    return true;
+}
+
+// fdatasync 日志，覆盖开始时已经写入的所有提交。调用者持锁且没有别的线程在同步，执行期间释放锁
+void wal_sync_locked(Wal *wal) {
+    wal->syncing = true;
+    uint32_t target = wal->num_committed;
+    uint64_t target_seq = wal->commit_seq;
+    pthread_mutex_unlock(&wal->lock);
+
+    if (stats_fdatasync(wal->file_descriptor) == -1) {
+        printf("error syncing wal: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    // 同步期间不会从头复用日志，帧号仍然有效
+    if (target > wal->num_synced) {
+        wal->num_synced = target;
+    }
+    wal->synced_seq = target_seq;
+    wal->syncing = false;
+    pthread_cond_broadcast(&wal->synced);
+}
+
+// 同步调用时已经写入的所有提交。别的线程正在同步时先等它结束，它没有覆盖到的提交再同步一次
+void wal_sync(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    uint64_t target_seq = wal->commit_seq;
+    while (wal->syncing) {
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+    if (wal->synced_seq < target_seq) {
+        wal_sync_locked(wal);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// 把 [num_backfilled, num_synced) 中每页最新的帧写回主文件，调用前需持锁并置 checkpointing
+// 执行期间会释放锁，返回时重新持锁
+uint32_t wal_backfill(Wal *wal) {
+    uint32_t start = wal->num_backfilled;
+    uint32_t limit = wal->num_synced;
+    uint32_t *work = malloc(sizeof(uint32_t) * 2 * (wal->index.count + 1));
+    uint32_t num_work = 0;
+    for (uint32_t i = 0; i < wal->index.capacity; i++) {
+        uint32_t frame_num = wal->index.values[i];
+        // 最新帧在 limit 之后的页留给下一次 checkpoint
+        if (wal->index.keys[i] != INVALID_PAGE_NUM && frame_num >= start && frame_num < limit) {
+            work[num_work * 2] = wal->index.keys[i];
+            work[num_work * 2 + 1] = frame_num;
+            num_work++;
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    void *page = malloc(PAGE_SIZE);
+    uint8_t *buffer = PAGE_COMPRESSION ? malloc(2 * PAGE_SIZE) : NULL;
+    for (uint32_t i = 0; i < num_work; i++) {
+        off_t offset = wal_frame_offset(work[i * 2 + 1]) + WAL_FRAME_HEADER_SIZE;
+        if (pread(wal->file_descriptor, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+            printf("error during checkpoint: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(STAT_BYTES_READ, PAGE_SIZE);
+        page_write(wal->db_file_descriptor, work[i * 2], page, buffer);
+    }
+    free(buffer);
+    free(page);
+    free(work);
+    if (num_work > 0 && stats_fdatasync(wal->db_file_descriptor) == -1) {
+        printf("error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    wal->num_backfilled = limit;
+    return num_work;
+}
+
+// 日志中的帧已经全部写回主文件时，换一个 salt 从头复用日志文件。还有线程在读帧时留到下一次提交再试
+void wal_restart_if_backfilled(Wal *wal) {
+    pthread_mutex_lock(&wal->append_lock);
+    pthread_mutex_lock(&wal->lock);
+    bool restart = !wal->checkpointing && !wal->syncing && wal->num_readers == 0 && wal->num_frames > 0 &&
+                   wal->num_backfilled == wal->num_frames;
+    if (restart) {
+        wal->salt += 1;
+        wal->num_frames = 0;
+        wal->num_committed = 0;
+        wal->num_synced = 0;
+        wal->num_backfilled = 0;
+        page_map_clear(&wal->index);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    if (restart) {
+        wal_write_header(wal);
+    }
+    pthread_mutex_unlock(&wal->append_lock);
+}
+
+// 后台线程：组提交窗口到期时 fdatasync，积压的帧足够多时 checkpoint
+void *wal_worker(void *arg) {
+    Wal *wal = arg;
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->shutting_down) {
+        if (!wal->checkpointing && wal->num_synced - wal->num_backfilled >= WAL_CHECKPOINT_FRAMES) {
+            wal->checkpointing = true;
+            wal_backfill(wal);
+            wal->checkpointing = false;
+            pthread_cond_broadcast(&wal->wakeup);
+            continue;
+        }
+        if (wal->synced_seq == wal->commit_seq) {
+            pthread_cond_wait(&wal->wakeup, &wal->lock);
+            continue;
+        }
+
+        // 组提交窗口：等一小段时间，让后续提交和已有提交共用一次 fdatasync
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += GROUP_COMMIT_WINDOW_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wal->wakeup, &wal->lock, &deadline);
+        if (!wal->syncing && wal->synced_seq < wal->commit_seq) {
+            wal_sync_locked(wal);
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+// 一次提交写完日志之后调用，等到 fdatasync 覆盖提交序号 seq 才返回。未同步的提交攒够 group_commit 个时
+// 由当前线程同步，一次覆盖所有已经写入的提交；否则等后台线程在组提交窗口结束时同步。
+// 调用者不能持有 write_lock，否则等待期间后续的提交进不来，凑不成一组
+void wal_commit_done(Wal *wal, uint64_t seq) {
+    pthread_mutex_lock(&wal->lock);
+    // 第一个未同步的提交开启组提交窗口，积压过多时唤醒后台 checkpoint
+    if (wal->commit_seq - wal->synced_seq == 1 || wal->num_synced - wal->num_backfilled >= WAL_CHECKPOINT_FRAMES) {
+        pthread_cond_signal(&wal->wakeup);
+    }
+    while (wal->synced_seq < seq) {
+        if (!wal->syncing && wal->commit_seq - wal->synced_seq >= wal->group_commit) {
+            wal_sync_locked(wal);
+        } else {
+            pthread_cond_wait(&wal->synced, &wal->lock);
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// 前台执行完整 checkpoint：同步日志，等后台 checkpoint 结束后把剩余帧全部写回
+uint32_t wal_checkpoint(Wal *wal) {
+    wal_sync(wal);
+    pthread_mutex_lock(&wal->lock);
+    while (wal->checkpointing) {
+        pthread_cond_wait(&wal->wakeup, &wal->lock);
+    }
+    wal->checkpointing = true;
+    uint32_t num_written = wal_backfill(wal);
+    wal->checkpointing = false;
+    pthread_mutex_unlock(&wal->lock);
+    wal_restart_if_backfilled(wal);
+    return num_written;
+}
+
+// 扫描日志，把最后一个合法提交帧之前的帧写回主文件，返回提交后的总页数（没有提交时为 0）
+uint32_t wal_recover(Wal *wal) {
+    uint8_t header[WAL_HEADER_SIZE];
+    if (pread(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE ||
+        memcmp(header, WAL_MAGIC, WAL_MAGIC_SIZE) != 0 ||
+        *(uint32_t *) (header + WAL_HEADER_PAGE_SIZE_OFFSET) != PAGE_SIZE) {
+        return 0;
+    }
+    wal->salt = *(uint32_t *) (header + WAL_HEADER_SALT_OFFSET);
+
+    uint8_t frame_header[WAL_FRAME_HEADER_SIZE];
+    void *page = malloc(PAGE_SIZE);
+    uint32_t db_size = 0;
+    for (uint32_t frame_num = 0;; frame_num++) {
+        off_t offset = wal_frame_offset(frame_num);
+        if (pread(wal->file_descriptor, frame_header, WAL_FRAME_HEADER_SIZE, offset) != WAL_FRAME_HEADER_SIZE ||
+            pread(wal->file_descriptor, page, PAGE_SIZE, offset + WAL_FRAME_HEADER_SIZE) != PAGE_SIZE ||
+            *(uint32_t *) (frame_header + WAL_FRAME_SALT_OFFSET) != wal->salt ||
+            *(uint64_t *) (frame_header + WAL_FRAME_CHECKSUM_OFFSET) != wal_checksum(frame_header, page)) {
+            break; // 日志尾部：文件结束、上一轮的旧帧或者写了一半的帧
+        }
+        page_map_put(&wal->index, *(uint32_t *) (frame_header + WAL_FRAME_PAGE_NUM_OFFSET), frame_num);
+        wal->num_frames = frame_num + 1;
+        uint32_t frame_db_size = *(uint32_t *) (frame_header + WAL_FRAME_DB_SIZE_OFFSET);
+        if (frame_db_size != 0) {
+            wal->num_committed = wal->num_frames;
+            db_size = frame_db_size;
+        }
+    }
+    free(page);
+
+    // 丢弃最后一个提交帧之后未提交的帧
+    if (wal->num_committed < wal->num_frames) {
+        page_map_clear(&wal->index);
+        for (uint32_t frame_num = 0; frame_num < wal->num_committed; frame_num++) {
+            pread(wal->file_descriptor, frame_header, WAL_FRAME_HEADER_SIZE, wal_frame_offset(frame_num));
+            page_map_put(&wal->index, *(uint32_t *) (frame_header + WAL_FRAME_PAGE_NUM_OFFSET), frame_num);
+        }
+        wal->num_frames = wal->num_committed;
+    }
+    wal->num_synced = wal->num_committed;
+    return db_size;
+}
+
+Wal *wal_open(const char *db_filename, int db_file_descriptor, uint32_t group_commit, uint32_t *num_pages) {
+    Wal *wal = malloc(sizeof(Wal));
+    wal->filename = malloc(strlen(db_filename) + 5);
+    sprintf(wal->filename, "%s-wal", db_filename);
+    wal->file_descriptor = open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (wal->file_descriptor == -1) {
+        printf("unable to open wal file.\n");
+        exit(EXIT_FAILURE);
+    }
+    wal->db_file_descriptor = db_file_descriptor;
+    wal->salt = 0;
+    wal->num_frames = 0;
+    wal->num_committed = 0;
+    wal->num_synced = 0;
+    wal->num_backfilled = 0;
+    wal->commit_seq = 0;
+    wal->synced_seq = 0;
+    wal->syncing = false;
+    wal->num_readers = 0;
+    wal->group_commit = group_commit > 0 ? group_commit : 1;
+    wal->checkpointing = false;
+    wal->shutting_down = false;
+    page_map_init(&wal->index, 1024);
+    pthread_mutex_init(&wal->append_lock, NULL);
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->wakeup, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+
+    // 上次没有正常关闭：重放已提交的帧
+    uint32_t db_size = wal_recover(wal);
+    if (db_size > *num_pages) {
+        *num_pages = db_size;
+    }
+    pthread_mutex_lock(&wal->lock);
+    wal_backfill(wal);
+    pthread_mutex_unlock(&wal->lock);
+    wal_restart_if_backfilled(wal);
+    if (wal->num_frames == 0) {
+        wal->salt += 1;
+        wal_write_header(wal);
+    }
+
+    pthread_create(&wal->worker, NULL, wal_worker, wal);
+    return wal;
+}
+
+// 正常关闭：写回所有帧后删除日志文件
+void wal_close(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    wal->shutting_down = true;
+    pthread_cond_broadcast(&wal->wakeup);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->worker, NULL);
+
+    wal_checkpoint(wal);
+    close(wal->file_descriptor);
+    unlink(wal->filename);
+
+    page_map_free(&wal->index);
+    pthread_mutex_destroy(&wal->append_lock);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->wakeup);
+    pthread_cond_destroy(&wal->synced);
+    free(wal->filename);
+    free(wal);
+}
+
+//
+// Page Latches
+//
+// 页锁按页号分成 LATCH_STRIPES 个读写锁分片，和缓冲池的页帧无关，页被淘汰再读入也不影响，
+// mmap 模式同样适用。每个分片带一个版本号，加写锁和解写锁时各加一，奇数表示正在被修改。
+// 写语句之间由 Table 的 write_lock 串行；读者同一时刻最多持有一个页锁，并且持有时不会
+// 阻塞等待别的页锁，所以唯一的写者以任意顺序加锁都不会死锁
+//
+#define LATCH_STRIPES 1024
+#define MAX_TREE_DEPTH 32
+
+typedef struct {
+    pthread_rwlock_t lock;
+    uint64_t version;
+} PageLatch;
+
+typedef enum {
+    LATCH_MODE_READ,      // 读语句：中间节点乐观读，只给叶子加共享锁
+    LATCH_MODE_WRITE,     // 写语句：get_page 给访问的页加写锁，保持到语句结束
+    LATCH_MODE_EXCLUSIVE  // 已经独占整个数据库（导入、建索引、系统指令），不加页锁
+} LatchMode;
+
+// 当前线程正在执行的语句类型
+_Thread_local LatchMode latch_mode = LATCH_MODE_READ;
+
+//
+// Page Versions (MVCC)
+//
+// 跨多个叶子的 select 在快照上读：开始时取最近的提交时间戳作为快照，只看到在此之前提交的修改。
+// 写语句（以及独占操作）第一次访问一页时，如果还有活跃快照能看到这一页的当前内容，就把修改前的页
+// 复制一份挂到这一页的版本链上，标上本语句的提交时间戳 end_ts。快照 s 读页时使用 end_ts > s 的
+// 最早版本，没有这样的版本就读当前页。没有活跃快照时写语句不复制任何页，快照结束时回收不再需要的版本。
+// 快照只在没有写语句执行时开始，保证写语句执行期间活跃快照的集合不会增加
+//
+#define VERSION_BUCKETS 4096
+
+typedef struct PageVersion {
+    uint64_t end_ts;            // 被这个时间戳提交的写语句覆盖
+    struct PageVersion *next;   // 更早的版本
+    uint8_t data[];
+} PageVersion;
+
+typedef struct PageHistory {
+    uint32_t page_num;
+    uint64_t modified_ts;       // 最近一次访问这一页的写语句的提交时间戳
+    PageVersion *versions;      // 从新到旧，end_ts 递减
+    struct PageHistory *next;
+} PageHistory;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint64_t commit_ts;         // 最近提交的写语句的时间戳
+    uint64_t writer_ts;         // 正在执行的写语句提交时将使用的时间戳，没有时为 0
+    uint32_t snapshots_waiting; // 等当前写语句结束后开始快照的读者数，写语句开始前让它们先走
+    uint64_t *snapshots;        // 活跃快照（允许重复）
+    uint32_t num_snapshots;
+    uint32_t snapshots_capacity;
+    uint64_t num_versions;      // 当前保留的页版本数
+    PageHistory *buckets[VERSION_BUCKETS];
+} VersionStore;
+
+typedef struct {
+    int file_descriptor;
+    off_t file_length;
+    uint32_t num_pages;
+    uint32_t num_frames;      // 缓冲池容量（页帧数）
+    uint32_t num_used_frames; // 已经分配出去的页帧数
+    uint32_t clock_hand;
+    Frame *frames;
+    void *frame_data;
+    uint32_t *page_table;     // 页号 -> 页帧下标，开放寻址哈希表
+    uint32_t page_table_mask;
+    bool use_mmap;            // 直接返回映射区中的页，不经过缓冲池
+    void *map;
+    off_t map_length;         // 已经映射到文件的字节数
+    Wal *wal;                 // 未开启 WAL 时为 NULL，脏页直接写回主文件
+    uint8_t *compress_buffer; // 开启页压缩时读写页用的暂存区
+    // 保护缓冲池（页表、页帧状态、CLOCK 指针）、num_pages 和 compress_buffer，读文件时不持有。
+    // mmap 模式下只在扩展文件时持有，num_pages 用原子操作读
+    pthread_mutex_t lock;
+    pthread_cond_t unpinned;  // 所有页帧都被 pin 住时等待其他线程放开
+    pthread_cond_t loaded;    // 等待别的线程把页读入完毕，或者把淘汰的脏页写完
+    uint32_t num_evicting;    // 放开锁写回中的被淘汰脏页数，收集脏页之前要等它们写完
+    PageLatch *latches;
+    PageMap write_latched;    // 当前写语句持有写锁的页（值为 1），只由持有 write_lock 的线程访问
+    uint32_t *stripe_holds;   // 每个分片被当前写语句中的多少个页持有
+    VersionStore versions;
+    struct Readahead *readahead; // 异步预读，mmap 模式下为 NULL
+    uint32_t vacuum_next_page; // 非 0 时 get_unused_page_num 不用空闲链表，从这一页起按页号顺序分配（.vacuum 重建时）
+} Pager;
+
+struct Readahead *readahead_open(Pager *pager);
+
+// 把文件扩展到至少 num_pages 页，并把新增部分映射到预留地址空间的对应位置
+void pager_grow_map(Pager *pager, uint32_t num_pages) {
+    off_t new_length = ((off_t) num_pages + MMAP_CHUNK_PAGES - 1) / MMAP_CHUNK_PAGES * MMAP_CHUNK_PAGES * PAGE_SIZE;
+    if ((uint64_t) new_length > MMAP_RESERVE_BYTES) {
+        printf("db file exceeds the mmap address reservation.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (new_length > pager->file_length && ftruncate(pager->file_descriptor, new_length) == -1) {
+        printf("error extending db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (new_length > pager->file_length) {
+        pager->file_length = new_length;
+    }
+
+    void *addr = mmap(pager->map + pager->map_length, new_length - pager->map_length,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pager->file_descriptor, pager->map_length);
+    if (addr == MAP_FAILED) {
+        printf("error mapping db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->map_length = new_length;
+}
+
+void version_store_init(VersionStore *store) {
+    memset(store, 0, sizeof(VersionStore));
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->changed, NULL);
+}
+
+void page_history_free(PageHistory *history) {
+    while (history->versions != NULL) {
+        PageVersion *version = history->versions;
+        history->versions = version->next;
+        free(version);
+    }
+    free(history);
+}
+
+void version_store_free(VersionStore *store) {
+    for (uint32_t i = 0; i < VERSION_BUCKETS; i++) {
+        while (store->buckets[i] != NULL) {
+            PageHistory *history = store->buckets[i];
+            store->buckets[i] = history->next;
+            page_history_free(history);
+        }
+    }
+    free(store->snapshots);
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->changed);
+}
+
+PageHistory **version_bucket(VersionStore *store, uint32_t page_num) {
+    return &store->buckets[page_num & (VERSION_BUCKETS - 1)];
+}
+
+// 回收所有快照都不再需要的版本：end_ts 不大于最老快照的版本对谁都不可见。调用者持有 store->lock
+void version_gc(VersionStore *store) {
+    uint64_t oldest = UINT64_MAX;
+    for (uint32_t i = 0; i < store->num_snapshots; i++) {
+        if (store->snapshots[i] < oldest) {
+            oldest = store->snapshots[i];
+        }
+    }
+    for (uint32_t i = 0; i < VERSION_BUCKETS; i++) {
+        PageHistory **link = &store->buckets[i];
+        while (*link != NULL) {
+            PageHistory *history = *link;
+            PageVersion **version = &history->versions;
+            while (*version != NULL && (*version)->end_ts > oldest) {
+                version = &(*version)->next;
+            }
+            while (*version != NULL) {
+                PageVersion *dead = *version;
+                *version = dead->next;
+                free(dead);
+                store->num_versions--;
+            }
+            // 没有版本的记录只用来避免重复复制，丢掉最多多复制一次
+            if (history->versions == NULL) {
+                *link = history->next;
+                free(history);
+            } else {
+                link = &history->next;
+            }
+        }
+    }
+}
+
+// 写语句或独占操作开始，分配提交时间戳
+void version_begin_write(VersionStore *store) {
+    pthread_mutex_lock(&store->lock);
+    while (store->snapshots_waiting > 0) {
+        pthread_cond_wait(&store->changed, &store->lock);
+    }
+    store->writer_ts = store->commit_ts + 1;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// 写语句的修改全部完成，之后开始的快照可以看到它们
+void version_end_write(VersionStore *store) {
+    pthread_mutex_lock(&store->lock);
+    store->commit_ts = store->writer_ts;
+    store->writer_ts = 0;
+    pthread_cond_broadcast(&store->changed);
+    pthread_mutex_unlock(&store->lock);
+}
+
+uint64_t version_begin_snapshot(VersionStore *store) {
+    pthread_mutex_lock(&store->lock);
+    store->snapshots_waiting++;
+    while (store->writer_ts != 0) {
+        pthread_cond_wait(&store->changed, &store->lock);
+    }
+    store->snapshots_waiting--;
+    if (store->snapshots_waiting == 0) {
+        pthread_cond_broadcast(&store->changed);
+    }
+    if (store->num_snapshots == store->snapshots_capacity) {
+        store->snapshots_capacity = store->snapshots_capacity == 0 ? 8 : store->snapshots_capacity * 2;
+        store->snapshots = realloc(store->snapshots, sizeof(uint64_t) * store->snapshots_capacity);
+    }
+    uint64_t snapshot = store->commit_ts;
+    store->snapshots[store->num_snapshots++] = snapshot;
+    pthread_mutex_unlock(&store->lock);
+    return snapshot;
+}
+
+void version_end_snapshot(VersionStore *store, uint64_t snapshot) {
+    pthread_mutex_lock(&store->lock);
+    for (uint32_t i = 0; i < store->num_snapshots; i++) {
+        if (store->snapshots[i] == snapshot) {
+            store->snapshots[i] = store->snapshots[--store->num_snapshots];
+            break;
+        }
+    }
+    version_gc(store);
+    pthread_mutex_unlock(&store->lock);
+}
+
+// 写语句访问已有的页、修改它之前调用：有快照还能看到当前内容时保存一个版本
+void version_save(VersionStore *store, uint32_t page_num, void *page) {
+    pthread_mutex_lock(&store->lock);
+    if (store->num_snapshots == 0 || store->writer_ts == 0) {
+        pthread_mutex_unlock(&store->lock);
+        return;
+    }
+    PageHistory **bucket = version_bucket(store, page_num);
+    PageHistory *history = *bucket;
+    while (history != NULL && history->page_num != page_num) {
+        history = history->next;
+    }
+    if (history == NULL) {
+        history = calloc(1, sizeof(PageHistory));
+        history->page_num = page_num;
+        history->next = *bucket;
+        *bucket = history;
+    }
+    if (history->modified_ts != store->writer_ts) {
+        // 当前内容从 modified_ts 开始可见，比它新的快照才需要旧内容
+        uint64_t newest = 0;
+        for (uint32_t i = 0; i < store->num_snapshots; i++) {
+            if (store->snapshots[i] > newest) {
+                newest = store->snapshots[i];
+            }
+        }
+        if (newest >= history->modified_ts) {
+            PageVersion *version = malloc(sizeof(PageVersion) + PAGE_SIZE);
+            version->end_ts = store->writer_ts;
+            memcpy(version->data, page, PAGE_SIZE);
+            version->next = history->versions;
+            history->versions = version;
+            store->num_versions++;
+        }
+        history->modified_ts = store->writer_ts;
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+// 快照 snapshot 需要的旧版本存在时复制到 buffer 并返回 true
+bool version_read(VersionStore *store, uint32_t page_num, uint64_t snapshot, void *buffer) {
+    pthread_mutex_lock(&store->lock);
+    PageHistory *history = *version_bucket(store, page_num);
+    while (history != NULL && history->page_num != page_num) {
+        history = history->next;
+    }
+    PageVersion *visible = NULL;
+    for (PageVersion *version = history != NULL ? history->versions : NULL;
+         version != NULL && version->end_ts > snapshot; version = version->next) {
+        visible = version;
+    }
+    if (visible != NULL) {
+        memcpy(buffer, visible->data, PAGE_SIZE);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return visible != NULL;
+}
+
+// 获取页并 pin 住，使用完毕后需要调用 pager_unpin
+void pager_open_map(Pager *pager) {
+    // 先占住一大段地址空间，之后按块把文件映射进来，已经返回的页指针始终有效
+    pager->map = mmap(NULL, MMAP_RESERVE_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pager->map == MAP_FAILED) {
+        printf("error reserving address space: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->map_length = 0;
+    if (pager->num_pages > 0) {
+        pager_grow_map(pager, pager->num_pages);
+    }
+}
+
+Pager *pager_open(const char *filename, DbOptions *options) {
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        printf("unable to open file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    Pager *pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->num_pages = 0;
+
+    // 已有数据库先读文件头，按其中的页大小设置页布局，页数也以文件头为准
+    uint32_t page_size = options->page_size;
+    bool compression = options->compress;
+    if (file_length > 0) {
+        uint8_t header[HEADER_SIZE];
+        if (pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE ||
+            memcmp(header + HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC, HEADER_MAGIC_SIZE) != 0) {
+            printf("db file has no valid header. corrupt file.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (*header_format_version(header) != DB_FORMAT_VERSION) {
+            printf("unsupported page format version %d, expected %d.\n",
+                   *header_format_version(header), DB_FORMAT_VERSION);
+            exit(EXIT_FAILURE);
+        }
+        page_size = *header_page_size(header);
+        pager->num_pages = *header_num_pages(header);
+        compression = *header_compression(header) != 0;
+    }
+    if (!is_valid_page_size(page_size)) {
+        printf("page size must be a power of two between %d and %d.\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (compression && page_size <= FS_BLOCK_SIZE) {
+        // 页槽只有一个块时压缩省不下任何空间
+        printf("page compression needs a page size larger than %d.\n", FS_BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&page_layout_lock);
+    if (open_databases > 0 && (page_size != PAGE_SIZE || compression != PAGE_COMPRESSION)) {
+        printf("page size and compression must match the databases already open.\n");
+        exit(EXIT_FAILURE);
+    }
+    open_databases++;
+    set_page_size(page_size);
+    PAGE_COMPRESSION = compression;
+    pthread_mutex_unlock(&page_layout_lock);
+
+    // 压缩页的页槽尾部是空洞，最后一页可能只写了开头
+    if (!PAGE_COMPRESSION && file_length % PAGE_SIZE != 0) {
+        printf("db file is not a whole number of pages. corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager->use_mmap = options->use_mmap;
+    pager->num_frames = 0;
+    pager->num_used_frames = 0;
+    pager->frames = NULL;
+    pager->frame_data = NULL;
+    pager->page_table = NULL;
+    pager->wal = NULL;
+    pager->readahead = NULL;
+    pager->vacuum_next_page = 0;
+    pager->compress_buffer = PAGE_COMPRESSION ? malloc(2 * PAGE_SIZE) : NULL;
+    pthread_mutex_init(&pager->lock, NULL);
+    pthread_cond_init(&pager->unpinned, NULL);
+    pthread_cond_init(&pager->loaded, NULL);
+    pager->num_evicting = 0;
+    // 偏向写者，避免持续的读请求让写语句一直拿不到写锁
+    pthread_rwlockattr_t latch_attr;
+    pthread_rwlockattr_init(&latch_attr);
+    pthread_rwlockattr_setkind_np(&latch_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pager->latches = malloc(sizeof(PageLatch) * LATCH_STRIPES);
+    for (uint32_t i = 0; i < LATCH_STRIPES; i++) {
+        pthread_rwlock_init(&pager->latches[i].lock, &latch_attr);
+        pager->latches[i].version = 0;
+    }
+    pthread_rwlockattr_destroy(&latch_attr);
+    page_map_init(&pager->write_latched, 64);
+    pager->stripe_holds = calloc(LATCH_STRIPES, sizeof(uint32_t));
+    version_store_init(&pager->versions);
+    if (pager->use_mmap) {
+        // 共享映射中的修改随时可能被内核写回主文件，绕过了日志
+        if (options->use_wal) {
+            printf("--mmap cannot be combined with --wal.\n");
+            exit(EXIT_FAILURE);
+        }
+        // 映射区直接对应文件中的页，无法插入压缩和解压
+        if (PAGE_COMPRESSION) {
+            printf("--mmap cannot be used with a compressed database.\n");
+            exit(EXIT_FAILURE);
+        }
+        pager_open_map(pager);
+        return pager;
+    }
+    if (options->use_wal) {
+        pager->wal = wal_open(filename, fd, options->group_commit, &pager->num_pages);
+    }
+
+    uint32_t cache_pages = options->cache_pages;
+    if (cache_pages < MIN_CACHE_PAGES) {
+        cache_pages = MIN_CACHE_PAGES;
+    }
+    pager->num_frames = cache_pages;
+    pager->num_used_frames = 0;
+    pager->clock_hand = 0;
+    pager->frames = malloc(sizeof(Frame) * cache_pages);
+    pager->frame_data = malloc((size_t) cache_pages * PAGE_SIZE);
+    if (pager->frames == NULL || pager->frame_data == NULL) {
+        printf("unable to allocate %d cache pages.\n", cache_pages);
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < cache_pages; i++) {
+        pager->frames[i].page_num = INVALID_PAGE_NUM;
+        pager->frames[i].pin_count = 0;
+        pager->frames[i].referenced = false;
+        pager->frames[i].dirty = false;
+        pager->frames[i].loading = false;
+        pager->frames[i].data = pager->frame_data + (size_t) i * PAGE_SIZE;
+    }
+
+    // 哈希表容量取不小于两倍页帧数的 2 的幂，保证装载因子不超过 0.5
+    uint32_t table_size = 1;
+    while (table_size < cache_pages * 2) {
+        table_size <<= 1;
+    }
+    pager->page_table = malloc(sizeof(uint32_t) * table_size);
+    pager->page_table_mask = table_size - 1;
+    for (uint32_t i = 0; i < table_size; i++) {
+        pager->page_table[i] = INVALID_FRAME;
+    }
+    pager->readahead = readahead_open(pager);
+
+    return pager;
+}
+
+uint32_t page_table_hash(Pager *pager, uint32_t page_num) {
+    return (page_num * 2654435761u) & pager->page_table_mask;
+}
+
+uint32_t page_table_lookup(Pager *pager, uint32_t page_num) {
+    uint32_t slot = page_table_hash(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        uint32_t frame_idx = pager->page_table[slot];
+        if (pager->frames[frame_idx].page_num == page_num) {
+            return frame_idx;
+        }
+        slot = (slot + 1) & pager->page_table_mask;
+    }
+    return INVALID_FRAME;
+}
+
+void page_table_insert(Pager *pager, uint32_t page_num, uint32_t frame_idx) {
+    uint32_t slot = page_table_hash(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        slot = (slot + 1) & pager->page_table_mask;
+    }
+    pager->page_table[slot] = frame_idx;
+}
+
+// 线性探测表的删除：把后面的元素往前挪，避免留下墓碑
+void page_table_remove(Pager *pager, uint32_t page_num) {
+    uint32_t mask = pager->page_table_mask;
+    uint32_t slot = page_table_hash(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        if (pager->frames[pager->page_table[slot]].page_num == page_num) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (pager->page_table[slot] == INVALID_FRAME) {
+        return;
+    }
+
+    uint32_t hole = slot;
+    uint32_t next = (hole + 1) & mask;
+    while (pager->page_table[next] != INVALID_FRAME) {
+        uint32_t home = page_table_hash(pager, pager->frames[pager->page_table[next]].page_num);
+        // home 不在 (hole, next] 区间内时，元素可以移到 hole
+        bool movable = (hole <= next) ? (home <= hole || home > next) : (home <= hole && home > next);
+        if (movable) {
+            pager->page_table[hole] = pager->page_table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    pager->page_table[hole] = INVALID_FRAME;
+}
+
+// 把 run 中 count 个页号连续的页帧用一次 pwritev 写回，压缩模式下逐页压缩写回
+void pager_write_run(Pager *pager, Frame **run, uint32_t count) {
+    if (PAGE_COMPRESSION) {
+        for (uint32_t i = 0; i < count; i++) {
+            page_write(pager->file_descriptor, run[i]->page_num, run[i]->data, pager->compress_buffer);
+            run[i]->dirty = false;
+        }
+        return;
+    }
+
+    struct iovec iov[count];
+    for (uint32_t i = 0; i < count; i++) {
+        iov[i].iov_base = run[i]->data;
+        iov[i].iov_len = PAGE_SIZE;
+    }
+
+    off_t offset = (off_t) run[0]->page_num * PAGE_SIZE;
+    ssize_t expected = (ssize_t) count * PAGE_SIZE;
+    ssize_t bytes_written = pwritev(pager->file_descriptor, iov, (int) count, offset);
+    if (bytes_written != expected) {
+        printf("error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(STAT_BYTES_WRITTEN, expected);
+    if (offset + expected > pager->file_length) {
+        pager->file_length = offset + expected;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        run[i]->dirty = false;
+    }
+}
+
+void pager_write_frame(Pager *pager, Frame *frame) {
+    pager_write_run(pager, &frame, 1);
+}
+
+void pager_mark_dirty(Pager *pager, uint32_t page_num) {
+    if (pager->use_mmap) {
+        return; // 共享映射的脏页由内核负责写回
+    }
+    pthread_mutex_lock(&pager->lock);
+    uint32_t frame_idx = page_table_lookup(pager, page_num);
+    if (frame_idx == INVALID_FRAME) {
+        printf("tried to mark page %d dirty which is not in cache.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_idx].dirty = true;
+    pthread_mutex_unlock(&pager->lock);
+}
+
+PageLatch *page_latch(Pager *pager, uint32_t page_num) {
+    return &pager->latches[page_num & (LATCH_STRIPES - 1)];
+}
+
+// 乐观读开始时取版本号
+uint64_t page_version(Pager *pager, uint32_t page_num) {
+    return __atomic_load_n(&page_latch(pager, page_num)->version, __ATOMIC_ACQUIRE);
+}
+
+// 乐观读结束时确认期间没有写者修改过这个分片
+bool page_version_unchanged(Pager *pager, uint32_t page_num, uint64_t version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&page_latch(pager, page_num)->version, __ATOMIC_RELAXED) == version;
+}
+
+void page_latch_shared(Pager *pager, uint32_t page_num) {
+    pthread_rwlock_rdlock(&page_latch(pager, page_num)->lock);
+}
+
+void page_unlatch_shared(Pager *pager, uint32_t page_num) {
+    pthread_rwlock_unlock(&page_latch(pager, page_num)->lock);
+}
+
+bool page_is_write_latched(Pager *pager, uint32_t page_num) {
+    return page_map_get(&pager->write_latched, page_num) == 1;
+}
+
+// 写语句第一次访问一个页时加写锁，分片已经被本语句的其他页持有时只增加计数
+void page_latch_exclusive(Pager *pager, uint32_t page_num) {
+    if (page_is_write_latched(pager, page_num)) {
+        return;
+    }
+    uint32_t stripe = page_num & (LATCH_STRIPES - 1);
+    if (pager->stripe_holds[stripe]++ == 0) {
+        PageLatch *latch = &pager->latches[stripe];
+        pthread_rwlock_wrlock(&latch->lock);
+        // 版本号变成奇数之后才能开始修改页
+        __atomic_add_fetch(&latch->version, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    page_map_put(&pager->write_latched, page_num, 1);
+}
+
+void page_unlatch_exclusive(Pager *pager, uint32_t page_num) {
+    if (!page_is_write_latched(pager, page_num)) {
+        return;
+    }
+    page_map_put(&pager->write_latched, page_num, 0);
+    uint32_t stripe = page_num & (LATCH_STRIPES - 1);
+    if (--pager->stripe_holds[stripe] == 0) {
+        PageLatch *latch = &pager->latches[stripe];
+        __atomic_add_fetch(&latch->version, 1, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&latch->lock);
+    }
+}
+
+// 写语句结束时释放它持有的所有写锁
+void pager_release_latches(Pager *pager) {
+    PageMap *map = &pager->write_latched;
+    for (uint32_t i = 0; i < map->capacity; i++) {
+        if (map->keys[i] != INVALID_PAGE_NUM && map->values[i] == 1) {
+            page_unlatch_exclusive(pager, map->keys[i]);
+        }
+    }
+    page_map_clear(map);
+}
+
+// 写回被淘汰的脏页，调用者没有持有 pager->lock，页帧由调用者 pin 住
+void pager_write_victim(Pager *pager, Frame *frame) {
+    if (pager->wal != NULL) {
+        // 语句执行中途被淘汰的脏页作为未提交帧写入日志
+        wal_append(pager->wal, &frame->page_num, &frame->data, 1, 0);
+        return;
+    }
+    // compress_buffer 由 pager->lock 保护，这里用自己的暂存区
+    uint8_t *buffer = PAGE_COMPRESSION ? malloc(2 * PAGE_SIZE) : NULL;
+    page_write(pager->file_descriptor, frame->page_num, frame->data, buffer);
+    free(buffer);
+}
+
+// 用 CLOCK 算法挑选一个可用页帧，调用者持有 pager->lock。所有页帧都被 pin 住时返回 INVALID_FRAME。
+// 被淘汰的页是脏页时先 pin 住它，放开锁写回，再加锁确认写回期间没有人用过或改过它，否则接着找。
+// 调用者要注意锁可能被放开过，返回后重新检查页表
+uint32_t pager_evict(Pager *pager) {
+    if (pager->num_used_frames < pager->num_frames) {
+        return pager->num_used_frames++;
+    }
+
+    // 转两圈：第一圈清访问位，第二圈一定能找到未被 pin 的页帧
+    for (uint32_t i = 0; i < pager->num_frames * 2; i++) {
+        uint32_t frame_idx = pager->clock_hand;
+        Frame *frame = &pager->frames[frame_idx];
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        if (frame->pin_count > 0) {
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+
+        if (frame->dirty) {
+            // 写回期间被修改的页会重新标脏，下面的检查让它留在缓冲池中
+            frame->dirty = false;
+            frame->pin_count = 1;
+            pager->num_evicting++;
+            pthread_mutex_unlock(&pager->lock);
+            pager_write_victim(pager, frame);
+            pthread_mutex_lock(&pager->lock);
+            off_t end = (off_t) (frame->page_num + 1) * PAGE_SIZE;
+            if (pager->wal == NULL && !PAGE_COMPRESSION && end > pager->file_length) {
+                pager->file_length = end;
+            }
+            frame->pin_count -= 1;
+            pager->num_evicting--;
+            pthread_cond_broadcast(&pager->loaded);
+            if (frame->pin_count > 0 || frame->referenced || frame->dirty) {
+                if (frame->pin_count == 0) {
+                    pthread_cond_signal(&pager->unpinned);
+                }
+                // 页帧状态变过，重新转两圈
+                i = 0;
+                continue;
+            }
+        }
+        page_table_remove(pager, frame->page_num);
+        frame->page_num = INVALID_PAGE_NUM;
+        return frame_idx;
+    }
+
+    return INVALID_FRAME;
+}
+
+void *get_page(Pager *pager, uint32_t page_num) {
+    if (page_num == INVALID_PAGE_NUM) {
+        printf("tried to fetch invalid page number %u.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+
+    if (latch_mode == LATCH_MODE_WRITE) {
+        page_latch_exclusive(pager, page_num);
+    }
+
+    if (pager->use_mmap) {
+        // 映射区总是覆盖前 num_pages 页，访问已有的页不加锁，只有扩展文件时才加锁
+        bool exists = page_num < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE);
+        bool save_version = latch_mode != LATCH_MODE_READ && exists;
+        if (!exists) {
+            pthread_mutex_lock(&pager->lock);
+            if ((off_t) (page_num + 1) * PAGE_SIZE > pager->map_length) {
+                pager_grow_map(pager, page_num + 1);
+            }
+            if (page_num >= pager->num_pages) {
+                __atomic_store_n(&pager->num_pages, page_num + 1, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&pager->lock);
+        }
+        void *page = pager->map + (size_t) page_num * PAGE_SIZE;
+        if (save_version) {
+            version_save(&pager->versions, page_num, page);
+        }
+        return page;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    // 写语句修改已有的页之前保存旧版本，新分配的页对快照不可见
+    bool save_version = latch_mode != LATCH_MODE_READ && page_num < pager->num_pages;
+    uint32_t frame_idx = page_table_lookup(pager, page_num);
+    if (frame_idx != INVALID_FRAME) {
+        stats_add(STAT_CACHE_HITS, 1);
+    } else {
+        // 缓存未命中，从文件读入
+        while (true) {
+            uint32_t victim = pager_evict(pager);
+            // 等待或写回被淘汰的脏页时锁被放开过，别的线程可能已经读入了这一页，腾出的页帧留给以后用
+            frame_idx = page_table_lookup(pager, page_num);
+            if (frame_idx != INVALID_FRAME) {
+                break;
+            }
+            if (victim != INVALID_FRAME) {
+                frame_idx = victim;
+                break;
+            }
+            // 单线程时这说明 pin 泄漏，多线程时等别的线程放开页
+            pthread_cond_wait(&pager->unpinned, &pager->lock);
+        }
+    }
+    Frame *frame = &pager->frames[frame_idx];
+    if (frame->page_num != page_num) {
+        memset(frame->data, 0, PAGE_SIZE);
+        frame->page_num = page_num;
+        frame->pin_count = 0;
+        frame->dirty = false;
+        page_table_insert(pager, page_num, frame_idx);
+
+        if (page_num >= pager->num_pages) {
+            // 新分配的页不用读
+            pager->num_pages = page_num + 1;
+        } else {
+            // 先占住页帧再放开锁读文件，其他线程访问这一页时等待读入完成
+            frame->loading = true;
+            frame->pin_count = 1;
+            pthread_mutex_unlock(&pager->lock);
+            stats_add(STAT_CACHE_MISSES, 1);
+            uint64_t start = stats_now();
+            // 日志中有更新的镜像时以日志为准
+            if (pager->wal == NULL || !wal_read_page(pager->wal, page_num, frame->data)) {
+                uint8_t *buffer = PAGE_COMPRESSION ? malloc(2 * PAGE_SIZE) : NULL;
+                page_read(pager->file_descriptor, page_num, frame->data, buffer);
+                free(buffer);
+            }
+            stats_record(HIST_PAGE_READ, stats_now() - start);
+            pthread_mutex_lock(&pager->lock);
+            frame->loading = false;
+            frame->pin_count -= 1;
+            pthread_cond_broadcast(&pager->loaded);
+        }
+    }
+    // 先 pin 住再等待，读入完成后页帧不会被别的线程淘汰
+    frame->pin_count += 1;
+    frame->referenced = true;
+    while (frame->loading) {
+        pthread_cond_wait(&pager->loaded, &pager->lock);
+    }
+    pthread_mutex_unlock(&pager->lock);
+    if (save_version) {
+        version_save(&pager->versions, page_num, frame->data);
+    }
+    return frame->data;
+}
+
+void pager_unpin(Pager *pager, uint32_t page_num) {
+    if (pager->use_mmap) {
+        return;
+    }
+    pthread_mutex_lock(&pager->lock);
+    uint32_t frame_idx = page_table_lookup(pager, page_num);
+    if (frame_idx == INVALID_FRAME || pager->frames[frame_idx].pin_count == 0) {
+        printf("tried to unpin page %d which is not pinned.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    if (--pager->frames[frame_idx].pin_count == 0) {
+        pthread_cond_signal(&pager->unpinned);
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+//
+// Readahead
+//
+// 把即将访问的页提前异步读进缓冲池。优先用 io_uring（直接用系统调用，不依赖 liburing），
+// 内核不支持或被禁用时退回到线程池 pread。预读只是提示：页帧不够或请求槽用完时直接放弃，
+// 已缓存的页和新分配的页跳过。读入期间页帧处于 loading 状态并由预读持有一个 pin，
+// 访问它的线程在 get_page 中等待读完，和同步读入的处理相同
+//
+#define READAHEAD_PAGES 32          // 顺序扫描时最多提前读的页数
+#define READAHEAD_QUEUE_DEPTH 64    // 同时进行的预读请求数
+#define READAHEAD_THREADS 4         // 不能用 io_uring 时做 pread 的线程数
+#define READAHEAD_STOP UINT64_MAX   // 让完成线程退出的 NOP 请求
+
+typedef struct {
+    uint32_t page_num;
+    uint32_t frame_idx;
+    int fd;
+    off_t offset;
+    bool from_wal;          // 日志中的镜像不压缩，不用解码
+    struct iovec iov;
+} ReadRequest;
+
+typedef struct Readahead {
+    Pager *pager;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    ReadRequest requests[READAHEAD_QUEUE_DEPTH];
+    uint32_t free_slots[READAHEAD_QUEUE_DEPTH];
+    uint32_t num_free;
+    bool stopping;
+    // io_uring，ring_fd 为 -1 时不用
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    // 线程池：等待执行的请求槽
+    uint32_t pending[READAHEAD_QUEUE_DEPTH];
+    uint32_t pending_head;
+    uint32_t num_pending;
+    pthread_t *threads;
+    uint32_t num_threads;
+} Readahead;
+
+// 一个预读请求读完 bytes_read 字节，解码后放开页帧
+void readahead_complete(Readahead *ra, uint32_t slot, ssize_t bytes_read, uint8_t *buffer) {
+    Pager *pager = ra->pager;
+    ReadRequest *request = &ra->requests[slot];
+    Frame *frame = &pager->frames[request->frame_idx];
+    if (bytes_read < 0) {
+        printf("error reading file: %d\n", (int) -bytes_read);
+        exit(EXIT_FAILURE);
+    }
+    if (request->from_wal) {
+        if (bytes_read != PAGE_SIZE) {
+            printf("error reading wal: short read.\n");
+            exit(EXIT_FAILURE);
+        }
+        wal_end_read(pager->wal);
+    } else {
+        // 压缩模式下预读只读了页槽开头的一个块，剩下的部分在这里同步读
+        bytes_read = page_read_rest(request->fd, request->page_num, frame->data, bytes_read);
+        page_decode(request->page_num, frame->data, bytes_read, buffer);
+    }
+    stats_add(STAT_PAGES_PREFETCHED, 1);
+    stats_add(STAT_BYTES_READ, bytes_read);
+
+    pthread_mutex_lock(&pager->lock);
+    frame->loading = false;
+    frame->pin_count -= 1;
+    pthread_cond_broadcast(&pager->loaded);
+    if (frame->pin_count == 0) {
+        pthread_cond_signal(&pager->unpinned);
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    pthread_mutex_lock(&ra->lock);
+    ra->free_slots[ra->num_free++] = slot;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+int io_uring_enter(int ring_fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// 收割 io_uring 的完成事件，直到收到 READAHEAD_STOP
+void *readahead_ring_worker(void *arg) {
+    Readahead *ra = arg;
+    uint8_t *buffer = PAGE_COMPRESSION ? malloc(2 * PAGE_SIZE) : NULL;
+    bool stop = false;
+    while (!stop) {
+        if (io_uring_enter(ra->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            printf("error waiting for io_uring: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t head = *ra->cq_head;
+        uint32_t tail = __atomic_load_n(ra->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ra->cqes[head & ra->cq_mask];
+            if (cqe->user_data == READAHEAD_STOP) {
+                stop = true;
+            } else {
+                readahead_complete(ra, cqe->user_data, cqe->res, buffer);
+            }
+        }
+        __atomic_store_n(ra->cq_head, head, __ATOMIC_RELEASE);
+    }
+    free(buffer);
+    return NULL;
+}
+
+void *readahead_pool_worker(void *arg) {
+    Readahead *ra = arg;
+    uint8_t *buffer = PAGE_COMPRESSION ? malloc(2 * PAGE_SIZE) : NULL;
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+        while (ra->num_pending == 0 && !ra->stopping) {
+            pthread_cond_wait(&ra->changed, &ra->lock);
+        }
+        if (ra->num_pending == 0) {
+            break;
+        }
+        uint32_t slot = ra->pending[ra->pending_head];
+        ra->pending_head = (ra->pending_head + 1) % READAHEAD_QUEUE_DEPTH;
+        ra->num_pending--;
+        pthread_mutex_unlock(&ra->lock);
+
+        ReadRequest *request = &ra->requests[slot];
+        ssize_t bytes_read = pread(request->fd, request->iov.iov_base, request->iov.iov_len, request->offset);
+        readahead_complete(ra, slot, bytes_read < 0 ? -errno : bytes_read, buffer);
+        pthread_mutex_lock(&ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    free(buffer);
+    return NULL;
+}
+
+// 建立 io_uring 并映射提交和完成队列，失败时返回 false
+bool readahead_open_ring(Readahead *ra) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ra->ring_fd = syscall(__NR_io_uring_setup, READAHEAD_QUEUE_DEPTH, &params);
+    if (ra->ring_fd < 0) {
+        ra->ring_fd = -1;
+        return false;
+    }
+    ra->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ra->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ra->cq_ring_size > ra->sq_ring_size) {
+        ra->sq_ring_size = ra->cq_ring_size;
+    }
+    ra->sq_ring = mmap(NULL, ra->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ra->ring_fd, IORING_OFF_SQ_RING);
+    ra->cq_ring = single_mmap ? ra->sq_ring
+                              : mmap(NULL, ra->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ra->ring_fd, IORING_OFF_CQ_RING);
+    ra->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ra->sqes = mmap(NULL, ra->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ra->ring_fd, IORING_OFF_SQES);
+    if (ra->sq_ring == MAP_FAILED || ra->cq_ring == MAP_FAILED || ra->sqes == MAP_FAILED) {
+        printf("error mapping io_uring: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    ra->sq_tail = ra->sq_ring + params.sq_off.tail;
+    ra->sq_mask = *(uint32_t *) (ra->sq_ring + params.sq_off.ring_mask);
+    ra->sq_array = ra->sq_ring + params.sq_off.array;
+    ra->cq_head = ra->cq_ring + params.cq_off.head;
+    ra->cq_tail = ra->cq_ring + params.cq_off.tail;
+    ra->cq_mask = *(uint32_t *) (ra->cq_ring + params.cq_off.ring_mask);
+    ra->cqes = ra->cq_ring + params.cq_off.cqes;
+    return true;
+}
+
+Readahead *readahead_open(Pager *pager) {
+    Readahead *ra = calloc(1, sizeof(Readahead));
+    ra->pager = pager;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->changed, NULL);
+    for (uint32_t i = 0; i < READAHEAD_QUEUE_DEPTH; i++) {
+        ra->free_slots[i] = i;
+    }
+    ra->num_free = READAHEAD_QUEUE_DEPTH;
+    ra->num_threads = readahead_open_ring(ra) ? 1 : READAHEAD_THREADS;
+    ra->threads = malloc(sizeof(pthread_t) * ra->num_threads);
+    for (uint32_t i = 0; i < ra->num_threads; i++) {
+        pthread_create(&ra->threads[i], NULL, ra->ring_fd >= 0 ? readahead_ring_worker : readahead_pool_worker, ra);
+    }
+    return ra;
+}
+
+// 在 ra->lock 下把请求放进提交队列（线程池模式下是待执行队列），之后由 readahead_submit 提交
+void readahead_queue(Readahead *ra, uint32_t slot, uint64_t user_data, uint8_t opcode) {
+    if (ra->ring_fd < 0) {
+        ra->pending[(ra->pending_head + ra->num_pending) % READAHEAD_QUEUE_DEPTH] = slot;
+        ra->num_pending++;
+        return;
+    }
+    // 只有持有 ra->lock 的线程写提交队列，内核读走之前队列不会满：请求槽数等于队列长度
+    uint32_t tail = *ra->sq_tail;
+    uint32_t index = tail & ra->sq_mask;
+    struct io_uring_sqe *sqe = &ra->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    if (opcode == IORING_OP_READV) {
+        ReadRequest *request = &ra->requests[slot];
+        sqe->fd = request->fd;
+        sqe->off = request->offset;
+        sqe->addr = (uint64_t) (uintptr_t) &request->iov;
+        sqe->len = 1;
+    }
+    ra->sq_array[index] = index;
+    __atomic_store_n(ra->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void readahead_submit(Readahead *ra, uint32_t count) {
+    if (ra->ring_fd < 0) {
+        pthread_cond_broadcast(&ra->changed);
+        return;
+    }
+    while (count > 0) {
+        int submitted = io_uring_enter(ra->ring_fd, count, 0, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            printf("error submitting to io_uring: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        count -= submitted;
+    }
+}
+
+// 等所有预读完成后停止完成线程
+void readahead_close(Readahead *ra) {
+    pthread_mutex_lock(&ra->lock);
+    while (ra->num_free < READAHEAD_QUEUE_DEPTH) {
+        pthread_cond_wait(&ra->changed, &ra->lock);
+    }
+    ra->stopping = true;
+    if (ra->ring_fd >= 0) {
+        readahead_queue(ra, 0, READAHEAD_STOP, IORING_OP_NOP);
+        readahead_submit(ra, 1);
+    } else {
+        pthread_cond_broadcast(&ra->changed);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    for (uint32_t i = 0; i < ra->num_threads; i++) {
+        pthread_join(ra->threads[i], NULL);
+    }
+    if (ra->ring_fd >= 0) {
+        munmap(ra->sqes, ra->sqes_size);
+        if (ra->cq_ring != ra->sq_ring) {
+            munmap(ra->cq_ring, ra->cq_ring_size);
+        }
+        munmap(ra->sq_ring, ra->sq_ring_size);
+        close(ra->ring_fd);
+    }
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->changed);
+    free(ra->threads);
+    free(ra);
+}
+
+// 提前读入 page_nums 中的页。不等待读完，也不 pin 住这些页
+void pager_prefetch(Pager *pager, const uint32_t *page_nums, uint32_t count) {
+    if (pager->use_mmap) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (page_nums[i] < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)) {
+                madvise(pager->map + (size_t) page_nums[i] * PAGE_SIZE, PAGE_SIZE, MADV_WILLNEED);
+            }
+        }
+        return;
+    }
+    Readahead *ra = pager->readahead;
+    // 预读最多占缓冲池的四分之一，否则会把刚读进来还没用到的页挤出去
+    if (count > pager->num_frames / 4) {
+        count = pager->num_frames / 4;
+    }
+
+    // 先占住请求槽再分配页帧，分配出去的页帧一定能提交
+    pthread_mutex_lock(&ra->lock);
+    uint32_t slots[READAHEAD_QUEUE_DEPTH];
+    uint32_t num_slots = count < ra->num_free ? count : ra->num_free;
+    ra->num_free -= num_slots;
+    memcpy(slots, ra->free_slots + ra->num_free, num_slots * sizeof(uint32_t));
+    pthread_mutex_unlock(&ra->lock);
+
+    uint32_t num_requests = 0;
+    pthread_mutex_lock(&pager->lock);
+    for (uint32_t i = 0; i < count && num_requests < num_slots; i++) {
+        uint32_t page_num = page_nums[i];
+        if (page_num >= pager->num_pages || page_table_lookup(pager, page_num) != INVALID_FRAME) {
+            continue;
+        }
+        uint32_t frame_idx = pager_evict(pager);
+        if (frame_idx == INVALID_FRAME) {
+            break;
+        }
+        if (page_table_lookup(pager, page_num) != INVALID_FRAME) {
+            continue; // 淘汰脏页时锁被放开过，别的线程已经读入了这一页
+        }
+        Frame *frame = &pager->frames[frame_idx];
+        frame->page_num = page_num;
+        frame->pin_count = 1;
+        frame->referenced = true;
+        frame->dirty = false;
+        frame->loading = true;
+        page_table_insert(pager, page_num, frame_idx);
+
+        ReadRequest *request = &ra->requests[slots[num_requests++]];
+        request->page_num = page_num;
+        request->frame_idx = frame_idx;
+        request->iov.iov_base = frame->data;
+        request->iov.iov_len = page_first_read_size(page_num);
+        request->fd = pager->file_descriptor;
+        request->offset = (off_t) page_num * PAGE_SIZE;
+        request->from_wal = false;
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    // 日志中有更新的镜像时从日志读，读完之前占住日志
+    for (uint32_t i = 0; pager->wal != NULL && i < num_requests; i++) {
+        ReadRequest *request = &ra->requests[slots[i]];
+        off_t offset = wal_begin_read(pager->wal, request->page_num);
+        if (offset != -1) {
+            request->fd = pager->wal->file_descriptor;
+            request->iov.iov_len = PAGE_SIZE;
+            request->offset = offset;
+            request->from_wal = true;
+        }
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    for (uint32_t i = 0; i < num_requests; i++) {
+        readahead_queue(ra, slots[i], slots[i], IORING_OP_READV);
+    }
+    if (num_requests > 0) {
+        readahead_submit(ra, num_requests);
+    }
+    // 没用上的请求槽还回去
+    for (uint32_t i = num_requests; i < num_slots; i++) {
+        ra->free_slots[ra->num_free++] = slots[i];
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+// 读出页在快照 snapshot 时的内容
+void snapshot_read_page(Pager *pager, uint32_t page_num, uint64_t snapshot, void *buffer) {
+    if (version_read(&pager->versions, page_num, snapshot, buffer)) {
+        return;
+    }
+    void *page = get_page(pager, page_num);
+    memcpy(buffer, page, PAGE_SIZE);
+    pager_unpin(pager, page_num);
+    // 复制期间写语句可能开始修改这一页，它修改之前一定已经保存了旧版本，所以再查一次
+    version_read(&pager->versions, page_num, snapshot, buffer);
+}
+
+void pager_flush(Pager *pager, uint32_t page_num) {
+    if (pager->use_mmap) {
+        msync(pager->map + (size_t) page_num * PAGE_SIZE, PAGE_SIZE, MS_SYNC);
+        return;
+    }
+    pthread_mutex_lock(&pager->lock);
+    uint32_t frame_idx = page_table_lookup(pager, page_num);
+    if (frame_idx == INVALID_FRAME) {
+        printf("tried to flush page not in cache.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pager->frames[frame_idx].dirty) {
+        pager_write_frame(pager, &pager->frames[frame_idx]);
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+int compare_frame_page_num(const void *a, const void *b) {
+    uint32_t left = (*(Frame **) a)->page_num;
+    uint32_t right = (*(Frame **) b)->page_num;
+    return (left > right) - (left < right);
+}
+
+// 按页号排序返回所有脏页帧，数量写入 num_dirty，调用者持有 pager->lock 并负责 free。
+// 先等淘汰中的脏页写完，否则它们的未提交帧可能落在这次提交之后
+Frame **pager_collect_dirty(Pager *pager, uint32_t *num_dirty) {
+    while (pager->num_evicting > 0) {
+        pthread_cond_wait(&pager->loaded, &pager->lock);
+    }
+    Frame **dirty = malloc(sizeof(Frame *) * (pager->num_used_frames + 1));
+    *num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_used_frames; i++) {
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+            dirty[(*num_dirty)++] = frame;
+        }
+    }
+    qsort(dirty, *num_dirty, sizeof(Frame *), compare_frame_page_num);
+    return dirty;
+}
+
+// 文件头记录的总页数落后时更新它，写回或提交脏页之前调用
+void pager_update_header(Pager *pager) {
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    if (*header_num_pages(header) != pager->num_pages) {
+        *header_num_pages(header) = pager->num_pages;
+        pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    }
+    pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+// 一条语句执行完毕：开启 WAL 时把它产生的脏页作为一次提交追加到日志，返回提交序号，没有提交时返回 0。
+// 提交在 pager_wait_durable 之后才持久
+uint64_t pager_append_commit(Pager *pager) {
+    if (pager->wal == NULL) {
+        return 0;
+    }
+    wal_restart_if_backfilled(pager->wal);
+    pager_update_header(pager);
+
+    // 脏页在追加日志期间保持 pin 住，不会被其他线程淘汰
+    pthread_mutex_lock(&pager->lock);
+    uint32_t num_dirty;
+    Frame **dirty = pager_collect_dirty(pager, &num_dirty);
+    uint32_t num_pages = pager->num_pages;
+    for (uint32_t i = 0; i < num_dirty; i++) {
+        dirty[i]->dirty = false;
+        dirty[i]->pin_count++;
+    }
+    pthread_mutex_unlock(&pager->lock);
+    uint64_t seq = 0;
+    if (num_dirty > 0) {
+        uint32_t page_nums[num_dirty];
+        void *pages[num_dirty];
+        for (uint32_t i = 0; i < num_dirty; i++) {
+            page_nums[i] = dirty[i]->page_num;
+            pages[i] = dirty[i]->data;
+        }
+        seq = wal_append(pager->wal, page_nums, pages, num_dirty, num_pages);
+
+        pthread_mutex_lock(&pager->lock);
+        for (uint32_t i = 0; i < num_dirty; i++) {
+            if (--dirty[i]->pin_count == 0) {
+                pthread_cond_signal(&pager->unpinned);
+            }
+        }
+        pthread_mutex_unlock(&pager->lock);
+    }
+    free(dirty);
+
+    // 持续写入时后台 checkpoint 永远追不上最新的帧，日志无法从头复用
+    if (wal_num_frames(pager->wal) >= WAL_MAX_FRAMES) {
+        wal_checkpoint(pager->wal);
+    }
+    return seq;
+}
+
+// 等 pager_append_commit 返回的提交写到磁盘
+void pager_wait_durable(Pager *pager, uint64_t seq) {
+    if (seq != 0) {
+        wal_commit_done(pager->wal, seq);
+    }
+}
+
+void pager_commit(Pager *pager) {
+    pager_wait_durable(pager, pager_append_commit(pager));
+}
+
+// 只写回脏页，并把页号相邻的脏页合并成一次 pwritev，返回写回的页数
+// 开启 WAL 时先提交再做完整 checkpoint，返回写回主文件的页数
+uint32_t pager_flush_dirty(Pager *pager) {
+    if (pager->wal != NULL) {
+        pager_commit(pager);
+        return wal_checkpoint(pager->wal);
+    }
+    pager_update_header(pager);
+    if (pager->use_mmap) {
+        // 内核知道哪些页被改过，这里只要求它把映射区同步到文件
+        if (pager->map_length > 0 && msync(pager->map, pager->map_length, MS_SYNC) == -1) {
+            printf("error syncing mapping: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        return pager->num_pages;
+    }
+    pthread_mutex_lock(&pager->lock);
+    uint32_t num_dirty;
+    Frame **dirty = pager_collect_dirty(pager, &num_dirty);
+
+    uint32_t run_start = 0;
+    while (run_start < num_dirty) {
+        uint32_t run_end = run_start + 1;
+        while (run_end < num_dirty && run_end - run_start < MAX_WRITE_RUN &&
+               dirty[run_end]->page_num == dirty[run_end - 1]->page_num + 1) {
+            run_end++;
+        }
+        pager_write_run(pager, dirty + run_start, run_end - run_start);
+        run_start = run_end;
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    free(dirty);
+    return num_dirty;
+}
+
+#define MAX_SCAN_THREADS 64
+#define SCAN_PARTITIONS_PER_THREAD 4 // 并行扫描把范围切成线程数的这么多倍份，先做完的线程多领几份
+
+struct Table {
+    uint32_t root_page_num;
+    Pager *pager;
+    uint32_t last_leaf_page_num; // 最右叶子的提示，释放这一页时清除，使用前仍需校验
+    struct Table *indexes[NUM_INDEXES]; // 二级索引，与主表共用 pager 和文件，没建索引的列为 NULL
+    pthread_rwlock_t db_lock;    // 语句共享持有；批量导入、建索引和系统指令独占持有
+    pthread_mutex_t write_lock;  // 同一时刻只有一个写语句
+    struct Vacuum *vacuum;       // 后台整理（.vacuum incremental），没有启动过时为 NULL
+    uint64_t path_epoch;         // 读语句路径缓存的纪元，独占操作后更换；0 表示不缓存
+    uint32_t scan_threads;       // 按列值过滤的全表扫描的并行线程数
+};
+
+typedef struct {
+    Table *table;
+    uint32_t page_num;
+    uint32_t cell_num;
+    bool end_of_table;
+} Cursor;
+
+typedef enum {
+    NODE_INTERNAL,
+    NODE_LEAF,
+    NODE_FREE
+} NodeType;
+//
+// Common Node Header Layout
+//
+const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
+const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
+const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+
+//
+// Leaf Node Header Layout
+//
+const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+                                       LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE;
+
+//
+// Leaf Node Body Layout（slotted page）
+// 页头之后是按 key 有序的槽目录 {key, 行偏移, 行长度}，从前往后增长；变长的行数据从页尾往前分配。
+// 查找只扫描槽目录，插入删除只移动槽。删除留下的空洞在连续空间不够时整页压缩回收
+//
+#define NODE_BODY_ALIGN 16
+const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_KEY_OFFSET = 0;
+const uint32_t LEAF_NODE_VALUE_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_VALUE_OFFSET_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
+const uint32_t LEAF_NODE_VALUE_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_VALUE_SIZE_OFFSET = LEAF_NODE_VALUE_OFFSET_OFFSET + LEAF_NODE_VALUE_OFFSET_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_OFFSET_SIZE + LEAF_NODE_VALUE_SIZE_SIZE;
+const uint32_t LEAF_NODE_SLOTS_OFFSET = (LEAF_NODE_HEADER_SIZE + NODE_BODY_ALIGN - 1) & ~(NODE_BODY_ALIGN - 1);
+uint32_t LEAF_NODE_SPACE_FOR_CELLS; // 随页大小变化，见 set_page_size
+const uint32_t LEAF_NODE_MAX_CELL_SIZE = LEAF_NODE_SLOT_SIZE + ROW_MAX_SIZE;
+
+//
+//  Internal Node Header Layout
+//
+const uint32_t INTERNAL_NODE_NUM_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEY_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEY_OFFSET + INTERNAL_NODE_NUM_KEY_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_OFFSET = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                           INTERNAL_NODE_NUM_KEY_SIZE +
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE +
+                                           INTERNAL_NODE_RIGHT_COUNT_SIZE;
+
+//
+// Internal Node Body Layout
+// 和叶子节点一样，key 数组在前，其后是子节点页号数组和子树行数数组（右子节点的行数在页头中）。
+// 子树行数用来在 O(log n) 内求 count、按名次定位 OFFSET；索引树中是子树的单元数
+//
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_COUNT_SIZE;
+const uint32_t INTERNAL_NODE_KEYS_OFFSET = (INTERNAL_NODE_HEADER_SIZE + NODE_BODY_ALIGN - 1) & ~(NODE_BODY_ALIGN - 1);
+uint32_t INTERNAL_NODE_SPACE_FOR_CELLS;
+uint32_t INTERNAL_NODE_MAX_CELLS;
+uint32_t INTERNAL_NODE_CHILDREN_OFFSET;
+uint32_t INTERNAL_NODE_COUNTS_OFFSET;
+
+// 删除后非根节点至少保留一半（叶子按占用字节数至少四分之一），否则与兄弟节点借用或合并。
+// 叶子的行是变长的，分裂和重新分配只能做到两边大致相等，所以下限放宽到四分之一
+uint32_t LEAF_NODE_MIN_SPACE;
+uint32_t INTERNAL_NODE_MIN_CELLS;
+
+// 设置页大小并计算依赖它的布局参数
+void set_page_size(uint32_t page_size) {
+    PAGE_SIZE = page_size;
+    LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_SLOTS_OFFSET;
+    LEAF_NODE_MIN_SPACE = LEAF_NODE_SPACE_FOR_CELLS / 4;
+    INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_KEYS_OFFSET;
+    INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+    INTERNAL_NODE_CHILDREN_OFFSET = INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
+    INTERNAL_NODE_COUNTS_OFFSET = INTERNAL_NODE_CHILDREN_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_CHILD_SIZE;
+    INTERNAL_NODE_MIN_CELLS = INTERNAL_NODE_MAX_CELLS / 2;
+}
+
+//
+// Free Page Layout
+//
+const uint32_t FREE_PAGE_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t FREE_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+uint32_t *free_page_next(void *page) {
+    return page + FREE_PAGE_NEXT_OFFSET;
+}
+
+
+uint32_t *node_parent(void *node) {
+    return node + PARENT_POINTER_OFFSET;
+}
+
+uint32_t *leaf_node_num_cells(void *node) {
+    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+uint32_t *leaf_node_content_start(void *node) {
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+void *leaf_node_slot(void *node, uint32_t cell_num) {
+    return node + LEAF_NODE_SLOTS_OFFSET + cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
+uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
+    return leaf_node_slot(node, cell_num) + LEAF_NODE_KEY_OFFSET;
+}
+
+uint16_t *leaf_node_value_offset(void *node, uint32_t cell_num) {
+    return leaf_node_slot(node, cell_num) + LEAF_NODE_VALUE_OFFSET_OFFSET;
+}
+
+uint16_t *leaf_node_value_size(void *node, uint32_t cell_num) {
+    return leaf_node_slot(node, cell_num) + LEAF_NODE_VALUE_SIZE_OFFSET;
+}
+
+void *leaf_node_value(void *node, uint32_t cell_num) {
+    return node + *leaf_node_value_offset(node, cell_num);
+}
+
+// 单元占用的空间：槽加行数据
+uint32_t leaf_node_cell_space(void *node, uint32_t cell_num) {
+    return LEAF_NODE_SLOT_SIZE + *leaf_node_value_size(node, cell_num);
+}
+
+// 所有单元占用的空间，不含删除留下的空洞
+uint32_t leaf_node_used_space(void *node) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t used = num_cells * LEAF_NODE_SLOT_SIZE;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        used += *leaf_node_value_size(node, i);
+    }
+    return used;
+}
+
+// 把行数据重新紧凑地排到页尾，回收删除留下的空洞
+void leaf_node_compact(void *node) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    void *temp = malloc(PAGE_SIZE);
+    memcpy(temp, node, PAGE_SIZE);
+    uint32_t content_start = PAGE_SIZE;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t size = *leaf_node_value_size(node, i);
+        content_start -= size;
+        memcpy(node + content_start, leaf_node_value(temp, i), size);
+        *leaf_node_value_offset(node, i) = content_start;
+    }
+    *leaf_node_content_start(node) = content_start;
+    free(temp);
+}
+
+// 在第 cell_num 个位置插入一个单元，空间不够时返回 false
+bool leaf_node_insert_cell(void *node, uint32_t cell_num, uint32_t key, void *value, uint32_t size) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (leaf_node_used_space(node) + LEAF_NODE_SLOT_SIZE + size > LEAF_NODE_SPACE_FOR_CELLS) {
+        return false;
+    }
+    uint32_t slots_end = LEAF_NODE_SLOTS_OFFSET + (num_cells + 1) * LEAF_NODE_SLOT_SIZE;
+    if (*leaf_node_content_start(node) < slots_end + size) {
+        leaf_node_compact(node);
+    }
+
+    uint32_t content_start = *leaf_node_content_start(node) - size;
+    memcpy(node + content_start, value, size);
+    *leaf_node_content_start(node) = content_start;
+    memmove(leaf_node_slot(node, cell_num + 1), leaf_node_slot(node, cell_num),
+            (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+    *leaf_node_key(node, cell_num) = key;
+    *leaf_node_value_offset(node, cell_num) = content_start;
+    *leaf_node_value_size(node, cell_num) = size;
+    *leaf_node_num_cells(node) = num_cells + 1;
+    return true;
+}
+
+// 删除从 cell_num 开始的 count 个单元，只移除槽，行数据留下的空洞以后再回收
+void leaf_node_remove_cells(void *node, uint32_t cell_num, uint32_t count) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    memmove(leaf_node_slot(node, cell_num), leaf_node_slot(node, cell_num + count),
+            (num_cells - cell_num - count) * LEAF_NODE_SLOT_SIZE);
+    *leaf_node_num_cells(node) = num_cells - count;
+    if (num_cells == count) {
+        *leaf_node_content_start(node) = PAGE_SIZE;
+    }
+}
+
+// 把 src 的第 src_cell 个单元复制到 dst 的第 dst_cell 个位置，调用者保证空间足够
+void leaf_node_copy_cell(void *dst, uint32_t dst_cell, void *src, uint32_t src_cell) {
+    if (!leaf_node_insert_cell(dst, dst_cell, *leaf_node_key(src, src_cell),
+                               leaf_node_value(src, src_cell), *leaf_node_value_size(src, src_cell))) {
+        printf("no space to move leaf cell.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void leaf_node_read_row(void *node, uint32_t cell_num, Row *row) {
+    row->id = *leaf_node_key(node, cell_num);
+    deserialize_row(leaf_node_value(node, cell_num), row);
+}
+
+// 视图指向页中的数据，页内容改变前有效
+void leaf_node_read_view(void *node, uint32_t cell_num, RowView *view) {
+    view->id = *leaf_node_key(node, cell_num);
+    row_view_deserialize(leaf_node_value(node, cell_num), view);
+}
+
+uint32_t *leaf_node_next_leaf(void *node) {
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+uint32_t *internal_node_num_keys(void *node) {
+    return node + INTERNAL_NODE_NUM_KEY_OFFSET;
+}
+
+uint32_t *internal_node_right_child(void *node) {
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+// 第 cell_num 个 cell 的子节点页号
+uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
+    return node + INTERNAL_NODE_CHILDREN_OFFSET + cell_num * INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t *internal_node_child(void *node, uint32_t child_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        printf("tried to access child_num %d > num_keys %d.\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    } else if (child_num == num_keys) {
+        return internal_node_right_child(node);
+    } else {
+        return internal_node_cell(node, child_num);
+    }
+}
+
+uint32_t *internal_node_key(void *node, uint32_t key_num) {
+    return node + INTERNAL_NODE_KEYS_OFFSET + key_num * INTERNAL_NODE_KEY_SIZE;
+}
+
+uint32_t *internal_node_right_count(void *node) {
+    return node + INTERNAL_NODE_RIGHT_COUNT_OFFSET;
+}
+
+// 第 cell_num 个 cell 的子树行数
+uint32_t *internal_node_cell_count(void *node, uint32_t cell_num) {
+    return node + INTERNAL_NODE_COUNTS_OFFSET + cell_num * INTERNAL_NODE_COUNT_SIZE;
+}
+
+// 第 child_num 个子树的行数，下标规则同 internal_node_child
+uint32_t *internal_node_count(void *node, uint32_t child_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        printf("tried to access child_num %d > num_keys %d.\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    } else if (child_num == num_keys) {
+        return internal_node_right_count(node);
+    } else {
+        return internal_node_cell_count(node, child_num);
+    }
+}
+
+// 同 leaf_node_move_cells，移动 key 和对应的子节点页号、子树行数
+void internal_node_move_cells(void *dst, uint32_t dst_cell, void *src, uint32_t src_cell, uint32_t count) {
+    memmove(internal_node_key(dst, dst_cell), internal_node_key(src, src_cell), count * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_cell(dst, dst_cell), internal_node_cell(src, src_cell), count * INTERNAL_NODE_CHILD_SIZE);
+    memmove(internal_node_cell_count(dst, dst_cell), internal_node_cell_count(src, src_cell),
+            count * INTERNAL_NODE_COUNT_SIZE);
+}
+
+NodeType get_node_type(void *node) {
+    uint8_t value = *((uint8_t *) (node + NODE_TYPE_OFFSET));
+    return (NodeType) value;
+}
+
+// 节点的子树行数：叶子是单元数，中间节点是各子树行数之和
+uint32_t node_row_count(void *node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return *leaf_node_num_cells(node);
+    }
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t count = *internal_node_right_count(node);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        count += *internal_node_cell_count(node, i);
+    }
+    return count;
+}
+
+// 把页内不属于任何单元的字节清零，只在压缩写出前对页的副本调用
+void page_clear_unused(void *page) {
+    switch (get_node_type(page)) {
+        case NODE_LEAF: {
+            leaf_node_compact(page);
+            uint32_t slots_end = LEAF_NODE_SLOTS_OFFSET + *leaf_node_num_cells(page) * LEAF_NODE_SLOT_SIZE;
+            memset(page + slots_end, 0, *leaf_node_content_start(page) - slots_end);
+            break;
+        }
+        case NODE_INTERNAL: {
+            uint32_t num_keys = *internal_node_num_keys(page);
+            memset(internal_node_key(page, num_keys), 0, (INTERNAL_NODE_MAX_CELLS - num_keys) * INTERNAL_NODE_KEY_SIZE);
+            memset(internal_node_cell(page, num_keys), 0, (INTERNAL_NODE_MAX_CELLS - num_keys) * INTERNAL_NODE_CHILD_SIZE);
+            uint32_t counts_end = INTERNAL_NODE_COUNTS_OFFSET + num_keys * INTERNAL_NODE_COUNT_SIZE;
+            memset(page + counts_end, 0, PAGE_SIZE - counts_end);
+            break;
+        }
+        case NODE_FREE:
+            memset(page + FREE_PAGE_NEXT_OFFSET + FREE_PAGE_NEXT_SIZE, 0,
+                   PAGE_SIZE - FREE_PAGE_NEXT_OFFSET - FREE_PAGE_NEXT_SIZE);
+            break;
+    }
+}
+
+void set_node_type(void *node, NodeType type) {
+    uint8_t value = type;
+    *((uint8_t *) (node + NODE_TYPE_OFFSET)) = value;
+}
+
+void print_constants() {
+    printf("PAGE_SIZE: %d\n", PAGE_SIZE);
+    printf("PAGE_COMPRESSION: %d\n", PAGE_COMPRESSION);
+    printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+    printf("LEAF_NODE_SLOTS_OFFSET: %d\n", LEAF_NODE_SLOTS_OFFSET);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_CELL_SIZE: %d\n", LEAF_NODE_MAX_CELL_SIZE);
+    printf("LEAF_NODE_MIN_SPACE: %d\n", LEAF_NODE_MIN_SPACE);
+    printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+}
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
+    void *node = get_page(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch (get_node_type(node)) {
+        case NODE_LEAF:
+            num_keys = *leaf_node_num_cells(node);
+            indent(indentation_level);
+            printf("- leaf (size %d) \n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                indent(indentation_level + 1);
+                printf("- %d\n", *leaf_node_key(node, i));
+            }
+            break;
+        case NODE_INTERNAL:
+            num_keys = *internal_node_num_keys(node);
+            indent(indentation_level);
+            printf("- internal (size %d) \n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                child = *internal_node_child(node, i);
+                print_tree(pager, child, indentation_level + 1);
+
+                indent(indentation_level + 1);
+                printf("- key %d \n", *internal_node_key(node, i));
+            }
+            child = *internal_node_right_child(node);
+            print_tree(pager, child, indentation_level + 1);
+            break;
+        case NODE_FREE:
+            // 树上不应出现空闲页
+            indent(indentation_level);
+            printf("- free page %d\n", page_num);
+            break;
+    }
+    pager_unpin(pager, page_num);
+}
+
+typedef struct {
+    uint32_t depth;           // 叶子所在的层数，根为第 1 层
+    uint32_t num_internal;
+    uint32_t num_leaves;
+    uint64_t num_rows;
+    uint64_t value_bytes;     // 所有单元内容的字节数，用来核对索引中的 id 个数
+    uint32_t last_leaf;       // 上一个访问到的叶子，用来检查叶子链表
+} TreeCheck;
+
+// 递归检查子树：节点内 key 严格递增且落在 (lower, upper] 内，父指针正确，
+// 中间节点记录的子树行数与实际相符，所有叶子在同一层，叶子链表顺序与中序遍历一致
+bool verify_node(Pager *pager, uint32_t page_num, uint32_t parent_page_num,
+                 int64_t lower, int64_t upper, uint32_t level, TreeCheck *check) {
+    void *node = get_page(pager, page_num);
+    bool ok = true;
+
+    if (level > 1 && *node_parent(node) != parent_page_num) {
+        printf("page %d: parent pointer %d, expected %d.\n", page_num, *node_parent(node), parent_page_num);
+        ok = false;
+    }
+
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t used = leaf_node_used_space(node);
+        if (level > 1 && used < LEAF_NODE_MIN_SPACE) {
+            printf("page %d: underfull leaf with %d bytes.\n", page_num, used);
+            ok = false;
+        }
+        uint32_t content_start = *leaf_node_content_start(node);
+        if (used > LEAF_NODE_SPACE_FOR_CELLS ||
+            content_start < LEAF_NODE_SLOTS_OFFSET + num_cells * LEAF_NODE_SLOT_SIZE || content_start > PAGE_SIZE) {
+            printf("page %d: bad slot directory.\n", page_num);
+            ok = false;
+        }
+        for (uint32_t i = 0; ok && i < num_cells; i++) {
+            uint32_t offset = *leaf_node_value_offset(node, i);
+            if (offset < content_start || offset + *leaf_node_value_size(node, i) > PAGE_SIZE) {
+                printf("page %d: cell %d outside the content area.\n", page_num, i);
+                ok = false;
+            }
+        }
+        int64_t prev = lower;
+        for (uint32_t i = 0; ok && i < num_cells; i++) {
+            int64_t key = *leaf_node_key(node, i);
+            if (key <= prev || key > upper) {
+                printf("page %d: key %lld out of order.\n", page_num, (long long) key);
+                ok = false;
+            }
+            prev = key;
+        }
+        if (check->depth == 0) {
+            check->depth = level;
+        } else if (check->depth != level) {
+            printf("page %d: leaf at depth %d, expected %d.\n", page_num, level, check->depth);
+            ok = false;
+        }
+        if (check->last_leaf != INVALID_PAGE_NUM) {
+            void *last = get_page(pager, check->last_leaf);
+            if (*leaf_node_next_leaf(last) != page_num) {
+                printf("page %d: leaf chain broken after page %d.\n", page_num, check->last_leaf);
+                ok = false;
+            }
+            pager_unpin(pager, check->last_leaf);
+        }
+        check->last_leaf = page_num;
+        check->num_leaves++;
+        check->num_rows += num_cells;
+        for (uint32_t i = 0; i < num_cells; i++) {
+            check->value_bytes += *leaf_node_value_size(node, i);
+        }
+    } else {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        int64_t prev = lower;
+        check->num_internal++;
+        if (level > 1 && num_keys < INTERNAL_NODE_MIN_CELLS) {
+            printf("page %d: underfull internal node with %d keys.\n", page_num, num_keys);
+            ok = false;
+        }
+        for (uint32_t i = 0; ok && i <= num_keys; i++) {
+            int64_t key = i < num_keys ? *internal_node_key(node, i) : upper;
+            if (key <= prev || key > upper) {
+                printf("page %d: key %lld out of order.\n", page_num, (long long) key);
+                ok = false;
+                break;
+            }
+            uint64_t num_rows = check->num_rows;
+            ok = verify_node(pager, *internal_node_child(node, i), page_num, prev, key, level + 1, check);
+            if (ok && check->num_rows - num_rows != *internal_node_count(node, i)) {
+                printf("page %d: child %d has %llu rows, recorded %d.\n", page_num, i,
+                       (unsigned long long) (check->num_rows - num_rows), *internal_node_count(node, i));
+                ok = false;
+            }
+            prev = key;
+        }
+    }
+
+    pager_unpin(pager, page_num);
+    return ok;
+}
+
+bool verify_tree(Pager *pager, uint32_t root_page_num, TreeCheck *check) {
+    *check = (TreeCheck) {0, 0, 0, 0, 0, INVALID_PAGE_NUM};
+    bool ok = verify_node(pager, root_page_num, INVALID_PAGE_NUM, -1, UINT32_MAX, 1, check);
+    if (ok) {
+        void *last = get_page(pager, check->last_leaf);
+        if (*leaf_node_next_leaf(last) != 0) {
+            printf("page %d: last leaf has next leaf %d.\n", check->last_leaf, *leaf_node_next_leaf(last));
+            ok = false;
+        }
+        pager_unpin(pager, check->last_leaf);
+    }
+    return ok;
+}
+
+// 检查主表和各个索引的 B+ 树，以及所有页的归属
+bool verify_database(Table *table) {
+    Pager *pager = table->pager;
+    TreeCheck check;
+    bool ok = verify_tree(pager, table->root_page_num, &check);
+    uint32_t num_tree_pages = check.num_internal + check.num_leaves;
+
+    // 每一行在每个索引中恰好出现一次
+    for (uint32_t i = 0; ok && i < NUM_INDEXES; i++) {
+        if (table->indexes[i] == NULL) {
+            continue;
+        }
+        TreeCheck index_check;
+        ok = verify_tree(pager, table->indexes[i]->root_page_num, &index_check);
+        uint64_t num_ids = index_check.value_bytes / sizeof(uint32_t);
+        if (ok && num_ids != check.num_rows) {
+            printf("index on %s has %llu ids, table has %llu rows.\n", INDEX_COLUMN_NAMES[i],
+                   (unsigned long long) num_ids, (unsigned long long) check.num_rows);
+            ok = false;
+        }
+        if (ok) {
+            printf("index on %s ok: depth %d, %d internal nodes, %d leaves, %llu values.\n", INDEX_COLUMN_NAMES[i],
+                   index_check.depth, index_check.num_internal, index_check.num_leaves,
+                   (unsigned long long) index_check.num_rows);
+        }
+        num_tree_pages += index_check.num_internal + index_check.num_leaves;
+    }
+
+    // 空闲链表上的页数应与文件头记录一致，且所有页要么在树上要么在链表上
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    uint32_t num_free = 0;
+    uint32_t free_page_num = *header_free_list_head(header);
+    uint32_t expected_free = *header_num_free_pages(header);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+    while (ok && free_page_num != 0) {
+        void *page = get_page(pager, free_page_num);
+        if (get_node_type(page) != NODE_FREE || num_free > pager->num_pages) {
+            printf("page %d: corrupt free list.\n", free_page_num);
+            ok = false;
+        }
+        uint32_t next = *free_page_next(page);
+        pager_unpin(pager, free_page_num);
+        free_page_num = next;
+        num_free++;
+    }
+    if (ok && (num_free != expected_free || 1 + num_tree_pages + num_free != pager->num_pages)) {
+        printf("page accounting mismatch: %d pages, %d in trees, %d free (header says %d).\n",
+               pager->num_pages, num_tree_pages, num_free, expected_free);
+        ok = false;
+    }
+
+    if (ok) {
+        printf("tree ok: depth %d, %d internal nodes, %d leaves, %llu rows, %d free pages.\n",
+               check.depth, check.num_internal, check.num_leaves, (unsigned long long) check.num_rows, num_free);
+    }
+    return ok;
+}
+
+#define KEY_SEARCH_LINEAR_MAX 32 // 二分缩小到这么多个 key 以内后改为整段向量比较
+
+#if defined(__AVX2__)
+// 取出从第 i 个开始的 8 个 key。stride 为 2 时 key 和另一个 32 位字交错存放（叶子槽），
+// 用 shuffle 把两个向量中的 key 挑出来，顺序会打乱，但只用来计数，不影响结果
+__m256i key_load8(const uint32_t *keys, uint32_t stride, uint32_t i) {
+    if (stride == 1) {
+        return _mm256_loadu_si256((const __m256i *) (keys + i));
+    }
+    __m256 a = _mm256_loadu_ps((const float *) (keys + i * 2));
+    __m256 b = _mm256_loadu_ps((const float *) (keys + i * 2 + 8));
+    return _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#endif
+
+#if defined(__SSE2__)
+__m128i key_load4(const uint32_t *keys, uint32_t stride, uint32_t i) {
+    if (stride == 1) {
+        return _mm_loadu_si128((const __m128i *) (keys + i));
+    }
+    __m128 a = _mm_loadu_ps((const float *) (keys + i * 2));
+    __m128 b = _mm_loadu_ps((const float *) (keys + i * 2 + 4));
+    return _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#endif
+
+// 返回有序的 key 序列中小于 key 的个数，即第一个不小于 key 的下标。
+// 第 i 个 key 是 keys[i * stride]：中间节点的 key 数组 stride 为 1，叶子槽目录 stride 为 2。
+// 先二分缩小范围，剩下的一小段用 SIMD 一次比较 8 个（AVX2）或 4 个（SSE2）key 并计数，
+// 没有向量指令时逐个比较。key 是无符号数，比较前两边都翻转符号位以使用有符号比较指令
+uint32_t key_lower_bound(const uint32_t *keys, uint32_t stride, uint32_t num_keys, uint32_t key) {
+    uint32_t low = 0, high = num_keys;
+    while (high - low > KEY_SEARCH_LINEAR_MAX) {
+        uint32_t mid = (low + high) / 2;
+        if (keys[mid * stride] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    uint32_t i = low;
+    uint32_t count = low;
+#if defined(__AVX2__)
+    const __m256i bias8 = _mm256_set1_epi32(INT32_MIN);
+    const __m256i target8 = _mm256_xor_si256(_mm256_set1_epi32((int32_t) key), bias8);
+    for (; i + 8 <= high; i += 8) {
+        __m256i v = _mm256_xor_si256(key_load8(keys, stride, i), bias8);
+        __m256i less = _mm256_cmpgt_epi32(target8, v);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i bias4 = _mm_set1_epi32(INT32_MIN);
+    const __m128i target4 = _mm_xor_si128(_mm_set1_epi32((int32_t) key), bias4);
+    for (; i + 4 <= high; i += 4) {
+        __m128i v = _mm_xor_si128(key_load4(keys, stride, i), bias4);
+        __m128i less = _mm_cmplt_epi32(v, target4);
+        count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+#endif
+    for (; i < high; i++) {
+        count += keys[i * stride] < key;
+    }
+    return count;
+}
+
+// 返回 key 在叶子节点中的下标，不存在时返回它应当插入的位置
+uint32_t leaf_node_find_cell(void *node, uint32_t key) {
+    return key_lower_bound(leaf_node_key(node, 0), LEAF_NODE_SLOT_SIZE / LEAF_NODE_KEY_SIZE,
+                           *leaf_node_num_cells(node), key);
+}
+
+// 返回 key 应当所在的子节点下标
+// 第 i 个 key 是第 i 个子树的最大 key，所以找第一个不小于 key 的位置
+uint32_t internal_node_find_child(void *node, uint32_t key) {
+    return key_lower_bound(internal_node_key(node, 0), 1, *internal_node_num_keys(node), key);
+}
+
+bool is_node_root(void *node) {
+    uint8_t value = *((uint8_t *) (node + IS_ROOT_OFFSET));
+    return (bool) value;
+}
+
+void set_node_root(void *node, bool is_root) {
+    uint8_t value = is_root;
+    *((uint8_t *) (node + IS_ROOT_OFFSET)) = value;
+}
+
+void initialize_leaf_node(void *node) {
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+}
+
+void initialize_internal_node(void *node) {
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    // 空节点没有右子节点，页号 0 是根节点，不能用 0 表示
+    *internal_node_right_child(node) = INVALID_PAGE_NUM;
+    *internal_node_right_count(node) = 0;
+}
+
+// 写语句下降时判断节点是否安全：对它的子树插入或删除一行都不会让它分裂或合并，
+// 修改不会传到更上层，这时可以放开路径上的祖先
+bool node_is_safe(void *node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t used = leaf_node_used_space(node);
+        return used + LEAF_NODE_MAX_CELL_SIZE <= LEAF_NODE_SPACE_FOR_CELLS &&
+               (is_node_root(node) || used >= LEAF_NODE_MIN_SPACE + LEAF_NODE_MAX_CELL_SIZE);
+    }
+    uint32_t num_keys = *internal_node_num_keys(node);
+    return num_keys + 1 < INTERNAL_NODE_MAX_CELLS && (is_node_root(node) || num_keys > INTERNAL_NODE_MIN_CELLS + 1);
+}
+
+// 写语句的下降（latch crabbing）：get_page 给经过的页加写锁，子节点安全时放开本次新加锁的祖先。
+// 同一时刻只有一个写语句，祖先上的锁只是为了挡住读者，所以放开后再访问时重新加锁即可。
+// 要插入或删除一行时 delta 为 ±1，顺路把各层指向子树的行数加上 delta，不用再从根走一遍
+void *table_find_leaf_exclusive(Table *table, uint32_t key, int32_t delta, uint32_t *leaf_page_num) {
+    Pager *pager = table->pager;
+    uint32_t path[MAX_TREE_DEPTH];
+    uint32_t depth = 0;
+    uint32_t page_num = table->root_page_num;
+    for (;;) {
+        bool already_latched = page_is_write_latched(pager, page_num);
+        void *node = get_page(pager, page_num);
+        if (node_is_safe(node)) {
+            for (uint32_t i = 0; i < depth; i++) {
+                page_unlatch_exclusive(pager, path[i]);
+            }
+            depth = 0;
+        }
+        if (!already_latched && latch_mode == LATCH_MODE_WRITE) {
+            if (depth == MAX_TREE_DEPTH) {
+                printf("tree is deeper than %d levels.\n", MAX_TREE_DEPTH);
+                exit(EXIT_FAILURE);
+            }
+            path[depth++] = page_num;
+        }
+        if (get_node_type(node) == NODE_LEAF) {
+            *leaf_page_num = page_num;
+            return node;
+        }
+        uint32_t child_idx = internal_node_find_child(node, key);
+        uint32_t child_num = *internal_node_child(node, child_idx);
+        if (delta != 0) {
+            *internal_node_count(node, child_idx) += delta;
+            pager_mark_dirty(pager, page_num);
+        }
+        pager_unpin(pager, page_num);
+        page_num = child_num;
+    }
+}
+
+// 等持有写锁的写语句结束
+void page_wait_writer(Pager *pager, uint32_t page_num) {
+    page_latch_shared(pager, page_num);
+    page_unlatch_shared(pager, page_num);
+}
+
+// 读语句的路径缓存，每个线程一份：记录上一次乐观下降经过的节点、读它时分片的版本号和它覆盖的 key 范围。
+// 分裂、合并和借用都会写边界两侧的节点，所以版本号没变的节点覆盖的范围也没变，
+// 下一次查找可以从覆盖 key 且版本没变的最深一层继续下降；落在上次的叶子里时不用下降。
+// 独占数据库的操作不加页锁、不改版本号，它们更换表的 path_epoch 让缓存作废
+typedef struct {
+    uint32_t page_num;
+    uint32_t upper;     // 覆盖的 key 范围是 (lower, upper]，lower 为 -1 表示没有下界
+    int64_t lower;
+    uint64_t version;
+} PathLevel;
+
+typedef struct {
+    uint64_t epoch;
+    uint32_t depth;
+    PathLevel levels[MAX_TREE_DEPTH];
+} PathCache;
+
+_Thread_local PathCache path_cache;
+
+// 分配 path_epoch，0 表示不缓存（索引树）
+uint64_t path_epoch_counter;
+
+uint64_t path_epoch_next(void) {
+    return __atomic_add_fetch(&path_epoch_counter, 1, __ATOMIC_RELAXED);
+}
+
+// 读语句的乐观下降：中间节点不加锁，读完用版本号校验期间没有被修改，失败就重来；
+// 只有叶子加共享锁。upper_bound 是沿途分隔 key 的最小值，即叶子覆盖的 key 上界，最右叶子为 UINT32_MAX
+void *table_find_leaf_shared(Table *table, uint32_t key, uint32_t *leaf_page_num, uint32_t *upper_bound) {
+    Pager *pager = table->pager;
+    PathCache *cache = &path_cache;
+    bool use_cache = table->path_epoch != 0;
+    if (use_cache && cache->epoch != table->path_epoch) {
+        cache->epoch = table->path_epoch;
+        cache->depth = 0;
+    }
+restart:
+    for (;;) {
+        uint32_t depth = use_cache ? cache->depth : 0;
+        while (depth > 0) {
+            PathLevel *level = &cache->levels[depth - 1];
+            if (level->lower < key && key <= level->upper &&
+                page_version_unchanged(pager, level->page_num, level->version)) {
+                break;
+            }
+            depth--;
+        }
+
+        int64_t lower = -1;
+        uint32_t bound = UINT32_MAX;
+        uint32_t page_num = table->root_page_num;
+        uint64_t version;
+        uint32_t start_depth = depth;
+        if (depth > 0) {
+            PathLevel *level = &cache->levels[--depth];
+            lower = level->lower;
+            bound = level->upper;
+            page_num = level->page_num;
+            version = level->version;
+        } else {
+            version = page_version(pager, page_num);
+            if (version & 1) {
+                page_wait_writer(pager, page_num);
+                continue;
+            }
+        }
+        // 沿途记录的层在校验通过前不可信，先截断，找到叶子后再放开
+        if (use_cache) {
+            cache->depth = depth;
+        }
+        for (;;) {
+            if (use_cache && depth < MAX_TREE_DEPTH) {
+                cache->levels[depth] = (PathLevel) {page_num, bound, lower, version};
+            }
+            depth++;
+
+            void *node = get_page(pager, page_num);
+            NodeType type = get_node_type(node);
+            if (type == NODE_LEAF) {
+                if (pthread_rwlock_tryrdlock(&page_latch(pager, page_num)->lock) != 0) {
+                    pager_unpin(pager, page_num);
+                    page_wait_writer(pager, page_num);
+                    goto restart;
+                }
+                // 持有共享锁后叶子不会再变；版本没变说明读到的指向它的路径仍然有效
+                if (!page_version_unchanged(pager, page_num, version)) {
+                    page_unlatch_shared(pager, page_num);
+                    pager_unpin(pager, page_num);
+                    goto restart;
+                }
+                if (use_cache) {
+                    cache->depth = depth < MAX_TREE_DEPTH ? depth : MAX_TREE_DEPTH;
+                }
+                stats_add(start_depth == 0 ? STAT_ROOT_DESCENTS :
+                          start_depth == depth ? STAT_LEAF_HINTS : STAT_PATH_HINTS, 1);
+                *leaf_page_num = page_num;
+                *upper_bound = bound;
+                return node;
+            }
+
+            // 页内容可能正在被修改，读到的值校验通过之前都不能信任，不能用会检查越界并退出的访问函数
+            uint32_t num_keys = *internal_node_num_keys(node);
+            if (num_keys > INTERNAL_NODE_MAX_CELLS) {
+                num_keys = INTERNAL_NODE_MAX_CELLS;
+            }
+            uint32_t child_idx = key_lower_bound(internal_node_key(node, 0), 1, num_keys, key);
+            uint32_t child_num;
+            if (child_idx < num_keys) {
+                child_num = *internal_node_cell(node, child_idx);
+                if (*internal_node_key(node, child_idx) < bound) {
+                    bound = *internal_node_key(node, child_idx);
+                }
+            } else {
+                child_num = *internal_node_right_child(node);
+            }
+            if (child_idx > 0 && *internal_node_key(node, child_idx - 1) > lower) {
+                lower = *internal_node_key(node, child_idx - 1);
+            }
+            pager_unpin(pager, page_num);
+            uint64_t child_version = page_version(pager, child_num);
+            if (type != NODE_INTERNAL || !page_version_unchanged(pager, page_num, version)) {
+                goto restart;
+            }
+            if (child_version & 1) {
+                page_wait_writer(pager, child_num);
+                goto restart;
+            }
+            page_num = child_num;
+            version = child_version;
+        }
+    }
+}
+
+// 从根向下找到 key 所在的叶子，返回时叶子已 pin 住，用完后调用 table_release_leaf
+// 读语句（LATCH_MODE_READ）乐观下降并给叶子加共享锁；写语句加写锁并做 latch crabbing；独占模式不加锁
+void *table_find_leaf(Table *table, uint32_t key, uint32_t *leaf_page_num) {
+    if (latch_mode == LATCH_MODE_READ) {
+        uint32_t upper_bound;
+        return table_find_leaf_shared(table, key, leaf_page_num, &upper_bound);
+    }
+    return table_find_leaf_exclusive(table, key, 0, leaf_page_num);
+}
+
+void table_release_leaf(Table *table, uint32_t page_num) {
+    if (latch_mode == LATCH_MODE_READ) {
+        page_unlatch_shared(table->pager, page_num);
+    }
+    pager_unpin(table->pager, page_num);
+}
+
+// 收集内部节点中第 child_idx 个子节点右边、key 不超过 max_key 的兄弟节点，最多 READAHEAD_PAGES 个
+uint32_t internal_node_next_children(void *node, uint32_t child_idx, uint32_t max_key, uint32_t *page_nums) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t count = 0;
+    // 第 i 个子节点中的 key 都大于 key[i - 1]
+    for (uint32_t i = child_idx + 1; i <= num_keys && count < READAHEAD_PAGES; i++) {
+        if (*internal_node_key(node, i - 1) >= max_key) {
+            break;
+        }
+        page_nums[count++] = *internal_node_child(node, i);
+    }
+    return count;
+}
+
+// 在快照中从根向下找到 key 所在的叶子，叶子的内容复制到 buffer，返回叶子覆盖的 key 上界（最右叶子为 UINT32_MAX）。
+// 读到的都是快照中的页副本，不需要任何页锁。max_key 大于 key 时预读同一父节点下、范围内的后续叶子
+uint32_t snapshot_find_leaf(Table *table, uint64_t snapshot, uint32_t key, uint32_t max_key, void *buffer) {
+    uint32_t bound = UINT32_MAX;
+    uint32_t page_num = table->root_page_num;
+    uint32_t siblings[READAHEAD_PAGES];
+    uint32_t num_siblings = 0;
+    for (;;) {
+        snapshot_read_page(table->pager, page_num, snapshot, buffer);
+        if (get_node_type(buffer) == NODE_LEAF) {
+            if (num_siblings > 0) {
+                pager_prefetch(table->pager, siblings, num_siblings);
+            }
+            return bound;
+        }
+        uint32_t child_idx = internal_node_find_child(buffer, key);
+        if (child_idx < *internal_node_num_keys(buffer) && *internal_node_key(buffer, child_idx) < bound) {
+            bound = *internal_node_key(buffer, child_idx);
+        }
+        // 只有最后一层内部节点的兄弟是叶子，上层的在下一轮被覆盖
+        num_siblings = max_key > key ? internal_node_next_children(buffer, child_idx, max_key, siblings) : 0;
+        page_num = *internal_node_child(buffer, child_idx);
+    }
+}
+
+// 快照中 key 小于给定 key 的行数：下降时累加左边各子树的行数，最后加上叶子中排在前面的单元数。
+// 左边子树中的 key 都不超过各自的分隔 key，而分隔 key 小于给定 key，所以删除后分隔 key 偏大也不影响结果
+uint32_t snapshot_rank(Table *table, uint64_t snapshot, uint32_t key, void *buffer) {
+    uint32_t rank = 0;
+    uint32_t page_num = table->root_page_num;
+    for (;;) {
+        snapshot_read_page(table->pager, page_num, snapshot, buffer);
+        if (get_node_type(buffer) == NODE_LEAF) {
+            return rank + leaf_node_find_cell(buffer, key);
+        }
+        uint32_t child_idx = internal_node_find_child(buffer, key);
+        for (uint32_t i = 0; i < child_idx; i++) {
+            rank += *internal_node_cell_count(buffer, i);
+        }
+        page_num = *internal_node_child(buffer, child_idx);
+    }
+}
+
+// 快照中 key 不超过 max_key 的行数
+uint32_t snapshot_rank_upper(Table *table, uint64_t snapshot, uint32_t max_key, void *buffer) {
+    if (max_key < UINT32_MAX) {
+        return snapshot_rank(table, snapshot, max_key + 1, buffer);
+    }
+    snapshot_read_page(table->pager, table->root_page_num, snapshot, buffer);
+    return node_row_count(buffer);
+}
+
+// 快照中第 rank 行（从 0 开始按 key 排序）的 key，超出总行数时返回 false
+bool snapshot_select_rank(Table *table, uint64_t snapshot, uint32_t rank, uint32_t *key, void *buffer) {
+    uint32_t page_num = table->root_page_num;
+    for (;;) {
+        snapshot_read_page(table->pager, page_num, snapshot, buffer);
+        if (get_node_type(buffer) == NODE_LEAF) {
+            if (rank >= *leaf_node_num_cells(buffer)) {
+                return false;
+            }
+            *key = *leaf_node_key(buffer, rank);
+            return true;
+        }
+        uint32_t num_keys = *internal_node_num_keys(buffer);
+        uint32_t child_idx = 0;
+        while (child_idx < num_keys && rank >= *internal_node_cell_count(buffer, child_idx)) {
+            rank -= *internal_node_cell_count(buffer, child_idx);
+            child_idx++;
+        }
+        page_num = *internal_node_child(buffer, child_idx);
+    }
+}
+
+// 返回给定 key 的位置
+// 如果 key 不存在，则返回它应当插入的位置
+// 游标会持有所在叶子页的 pin，用完后需要调用 cursor_close。
+// 游标移动时不加锁，只用于写语句和独占模式，读语句用 table_find_leaf 逐个叶子读取
+Cursor *table_find(Table *table, uint32_t key) {
+    uint32_t page_num;
+    void *node = table_find_leaf(table, key, &page_num);
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->cell_num = leaf_node_find_cell(node, key);
+    cursor->end_of_table = (cursor->cell_num == *leaf_node_num_cells(node));
+    return cursor;
+}
+
+// 子树的最大 key 在最右侧叶子节点上，中间节点需要沿右子节点一路向下
+uint32_t get_node_max_key(Pager *pager, void *node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+    uint32_t right_child_page_num = *internal_node_right_child(node);
+    void *right_child = get_page(pager, right_child_page_num);
+    uint32_t max_key = get_node_max_key(pager, right_child);
+    pager_unpin(pager, right_child_page_num);
+    return max_key;
+}
+
+// 定位到第一个不小于 key 的行
+// 删除后分隔 key 只是上界，key 可能落在最大 key 比它小的叶子末尾，这时移到下一个叶子开头
+Cursor *table_seek(Table *table, uint32_t key) {
+    Pager *pager = table->pager;
+    Cursor *cursor = table_find(table, key);
+    void *node = get_page(pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    pager_unpin(pager, cursor->page_num);
+    if (cursor->cell_num < num_cells) {
+        cursor->end_of_table = false;
+    } else if (next_page_num == 0) {
+        cursor->end_of_table = true;
+    } else {
+        get_page(pager, next_page_num);
+        pager_unpin(pager, cursor->page_num);
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+        cursor->end_of_table = false;
+    }
+    return cursor;
+}
+
+Cursor *table_start(Table *table) {
+    return table_seek(table, 0);
+}
+
+void cursor_close(Cursor *cursor) {
+    pager_unpin(cursor->table->pager, cursor->page_num);
+    free(cursor);
+}
+
+// 二级索引的 B+ 树也用 Table 表示，复用主表的查找、插入和删除
+Table *index_open(Pager *pager, uint32_t root_page_num) {
+    Table *index = malloc(sizeof(Table));
+    index->pager = pager;
+    index->root_page_num = root_page_num;
+    index->last_leaf_page_num = INVALID_PAGE_NUM;
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        index->indexes[i] = NULL;
+    }
+    index->vacuum = NULL;
+    index->path_epoch = 0;
+    index->scan_threads = 1;
+    return index;
+}
+
+void db_default_options(DbOptions *options) {
+    options->page_size = DEFAULT_PAGE_SIZE;
+    options->compress = false;
+    options->cache_pages = DEFAULT_CACHE_PAGES;
+    options->use_mmap = false;
+    options->use_wal = false;
+    options->group_commit = 1;
+    options->scan_threads = 0;
+}
+
+Table *db_open(const char *filename, DbOptions *options) {
+    Pager *pager = pager_open(filename, options);
+    Table *table = malloc(sizeof(Table));
+    table->pager = pager;
+    table->root_page_num = ROOT_PAGE_NUM;
+    table->last_leaf_page_num = INVALID_PAGE_NUM;
+    table->vacuum = NULL;
+    table->path_epoch = path_epoch_next();
+    table->scan_threads = options->scan_threads;
+    if (table->scan_threads == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        table->scan_threads = num_cpus > 0 ? num_cpus : 1;
+    }
+    if (table->scan_threads > MAX_SCAN_THREADS) {
+        table->scan_threads = MAX_SCAN_THREADS;
+    }
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&table->db_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    pthread_mutex_init(&table->write_lock, NULL);
+
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    if (pager->num_pages == 1) {
+        // 新数据库：写入文件头和一个空的根叶子节点
+        memcpy(header + HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC, HEADER_MAGIC_SIZE);
+        *header_free_list_head(header) = 0;
+        *header_num_free_pages(header) = 0;
+        *header_format_version(header) = DB_FORMAT_VERSION;
+        *header_page_size(header) = PAGE_SIZE;
+        *header_root_page(header) = ROOT_PAGE_NUM;
+        *header_compression(header) = PAGE_COMPRESSION;
+        pager_mark_dirty(pager, HEADER_PAGE_NUM);
+
+        void *root_node = get_page(pager, ROOT_PAGE_NUM);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+        pager_mark_dirty(pager, ROOT_PAGE_NUM);
+        pager_unpin(pager, ROOT_PAGE_NUM);
+        *header_num_pages(header) = pager->num_pages;
+    }
+    // 魔数、版本与页大小已在 pager_open 中校验
+    table->root_page_num = *header_root_page(header);
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        uint32_t index_root = *header_index_root(header, i);
+        table->indexes[i] = index_root != 0 ? index_open(pager, index_root) : NULL;
+    }
+    pager_unpin(pager, HEADER_PAGE_NUM);
+
+    return table;
+}
+
+// 等所有语句结束后独占数据库，本线程访问页时不再加锁。
+// 快照读在批次之间不持有 db_lock，所以独占操作和写语句一样要为活跃快照保存页版本
+void db_begin_exclusive(Table *table) {
+    pthread_rwlock_wrlock(&table->db_lock);
+    latch_mode = LATCH_MODE_EXCLUSIVE;
+    version_begin_write(&table->pager->versions);
+    // 独占期间修改的页不更新版本号，各线程缓存的路径都不能再用
+    table->path_epoch = path_epoch_next();
+}
+
+void db_end_exclusive(Table *table) {
+    version_end_write(&table->pager->versions);
+    latch_mode = LATCH_MODE_READ;
+    pthread_rwlock_unlock(&table->db_lock);
+}
+
+void vacuum_stop(Table *table);
+
+// 调用前其他线程必须已经结束所有语句
+void db_close(Table *table) {
+    Pager *pager = table->pager;
+
+    vacuum_stop(table);
+    db_begin_exclusive(table);
+    if (pager->readahead != NULL) {
+        readahead_close(pager->readahead);
+    }
+    pager_flush_dirty(pager);
+    if (pager->wal != NULL) {
+        wal_close(pager->wal);
+    }
+
+    if (pager->use_mmap) {
+        // 去掉按块扩展时多出来的尾部
+        munmap(pager->map, MMAP_RESERVE_BYTES);
+        if (ftruncate(pager->file_descriptor, (off_t) pager->num_pages * PAGE_SIZE) == -1) {
+            printf("error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int result = close(pager->file_descriptor);
+    if (result == -1) {
+        printf("error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < LATCH_STRIPES; i++) {
+        pthread_rwlock_destroy(&pager->latches[i].lock);
+    }
+    free(pager->latches);
+    free(pager->stripe_holds);
+    page_map_free(&pager->write_latched);
+    pthread_mutex_destroy(&pager->lock);
+    pthread_cond_destroy(&pager->unpinned);
+    pthread_cond_destroy(&pager->loaded);
+    version_store_free(&pager->versions);
+    free(pager->page_table);
+    free(pager->compress_buffer);
+    free(pager->frame_data);
+    free(pager->frames);
+    free(pager);
+    pthread_mutex_lock(&page_layout_lock);
+    open_databases--;
+    pthread_mutex_unlock(&page_layout_lock);
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        free(table->indexes[i]);
+    }
+    latch_mode = LATCH_MODE_READ;
+    pthread_rwlock_unlock(&table->db_lock);
+    pthread_rwlock_destroy(&table->db_lock);
+    pthread_mutex_destroy(&table->write_lock);
+    free(table);
+}
+
+// cursor_value 计算游标指示的数据位置
+// 游标本身已经 pin 住所在页，这里取到的指针在游标移动前一直有效
+void *cursor_value(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    void *page = get_page(pager, cursor->page_num);
+    pager_unpin(pager, cursor->page_num);
+    return leaf_node_value(page, cursor->cell_num);
+}
+
+void cursor_read_row(Cursor *cursor, Row *row) {
+    Pager *pager = cursor->table->pager;
+    void *page = get_page(pager, cursor->page_num);
+    pager_unpin(pager, cursor->page_num);
+    leaf_node_read_row(page, cursor->cell_num, row);
+}
+
+// 游标进入叶子 node 后，预读叶子链上同一父节点下的后续叶子
+void cursor_prefetch(Cursor *cursor, void *node) {
+    Pager *pager = cursor->table->pager;
+    if (is_node_root(node) || *leaf_node_num_cells(node) == 0) {
+        return;
+    }
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t child_idx = internal_node_find_child(parent, *leaf_node_key(node, 0));
+    uint32_t page_nums[READAHEAD_PAGES];
+    uint32_t count = internal_node_next_children(parent, child_idx, UINT32_MAX, page_nums);
+    pager_unpin(pager, parent_page_num);
+    if (count > 0) {
+        pager_prefetch(pager, page_nums, count);
+    }
+}
+
+void cursor_advance(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    void *node = get_page(pager, cursor->page_num);
+    pager_unpin(pager, cursor->page_num);
+    cursor->cell_num += 1;
+    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            cursor->end_of_table = true;
+        } else {
+            // 先 pin 住下一页再放开当前页
+            void *next = get_page(pager, next_page_num);
+            pager_unpin(pager, cursor->page_num);
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+            cursor_prefetch(cursor, next);
+        }
+    }
+}
+
+#define DEFAULT_FILL_FACTOR 0.9 // 批量导入时叶子和中间节点的默认填充比例
+
+bool table_import(Table *table, const char *filename, double fill_factor);
+void table_vacuum(Table *table, double fill_factor);
+bool vacuum_running(Table *table);
+void vacuum_start(Table *table);
+
+uint32_t tree_depth(Pager *pager, uint32_t root_page_num) {
+    uint32_t depth = 1;
+    uint32_t page_num = root_page_num;
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_page_num = *internal_node_child(node, 0);
+        pager_unpin(pager, page_num);
+        page_num = child_page_num;
+        node = get_page(pager, page_num);
+        depth++;
+    }
+    pager_unpin(pager, page_num);
+    return depth;
+}
+
+// .stats 的输出，json 时输出一行 JSON 对象，直方图的值为原始单位（纳秒或行数）。
+// 调用者共享持有 db_lock：文件头和树高在快照上读，缓冲池和版本的计数在各自的锁下读，不妨碍同时执行的语句
+void print_stats(Table *table, bool json, OutputBuffer *out) {
+    Stats stats;
+    stats_collect(&stats);
+    Pager *pager = table->pager;
+    uint64_t snapshot = version_begin_snapshot(&pager->versions);
+    void *page = malloc(PAGE_SIZE);
+    snapshot_read_page(pager, HEADER_PAGE_NUM, snapshot, page);
+    uint32_t num_free_pages = *header_num_free_pages(page);
+    uint32_t depth = 1;
+    snapshot_read_page(pager, table->root_page_num, snapshot, page);
+    while (get_node_type(page) == NODE_INTERNAL) {
+        snapshot_read_page(pager, *internal_node_child(page, 0), snapshot, page);
+        depth++;
+    }
+    free(page);
+    version_end_snapshot(&pager->versions, snapshot);
+
+    pthread_mutex_lock(&pager->lock);
+    uint32_t num_pages = pager->num_pages;
+    uint32_t num_used_frames = pager->num_used_frames;
+    pthread_mutex_unlock(&pager->lock);
+    pthread_mutex_lock(&pager->versions.lock);
+    unsigned long long num_versions = pager->versions.num_versions;
+    pthread_mutex_unlock(&pager->versions.lock);
+    uint32_t num_wal_frames = pager->wal != NULL ? wal_num_frames(pager->wal) : 0;
+    uint64_t *counters = stats.counters;
+    double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    if (json) {
+        output_printf(out, "{\"pages\":%u,\"free_pages\":%u,\"cache_frames\":%u,\"cached_pages\":%u,"
+                      "\"tree_depth\":%u,\"page_versions\":%llu,\"wal_frames\":%u,\"counters\":{",
+                      num_pages, num_free_pages, pager->num_frames, num_used_frames, depth, num_versions, num_wal_frames);
+        for (uint32_t i = 0; i < NUM_COUNTERS; i++) {
+            output_printf(out, "%s\"%s\":%llu", i > 0 ? "," : "", COUNTER_NAMES[i],
+                          (unsigned long long) counters[i]);
+        }
+        output_printf(out, "},\"histograms\":{");
+        for (uint32_t i = 0; i < NUM_HISTOGRAMS; i++) {
+            Histogram *histogram = &stats.histograms[i];
+            output_printf(out, "%s\"%s\":{\"unit\":\"%s\",\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"p50\":%llu,"
+                          "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu}", i > 0 ? "," : "", HISTOGRAM_NAMES[i],
+                          i == HIST_SELECT_ROWS ? "rows" : "ns", (unsigned long long) histogram->count,
+                          (unsigned long long) histogram->sum, (unsigned long long) histogram->max,
+                          (unsigned long long) histogram_percentile(histogram, percentiles[0]),
+                          (unsigned long long) histogram_percentile(histogram, percentiles[1]),
+                          (unsigned long long) histogram_percentile(histogram, percentiles[2]),
+                          (unsigned long long) histogram_percentile(histogram, percentiles[3]));
+        }
+        output_printf(out, "}}\n");
+        return;
+    }
+
+    uint64_t lookups = counters[STAT_CACHE_HITS] + counters[STAT_CACHE_MISSES];
+    output_printf(out, "pages: %u in file, %u free, %u / %u cached, tree depth %u, %llu page versions, "
+                  "%u wal frames\n",
+                  num_pages, num_free_pages, num_used_frames, pager->num_frames, depth, num_versions, num_wal_frames);
+    output_printf(out, "cache: %llu hits, %llu misses (%.2f%% hit rate), %llu pages prefetched\n",
+                  (unsigned long long) counters[STAT_CACHE_HITS], (unsigned long long) counters[STAT_CACHE_MISSES],
+                  lookups > 0 ? 100.0 * counters[STAT_CACHE_HITS] / lookups : 100.0,
+                  (unsigned long long) counters[STAT_PAGES_PREFETCHED]);
+    output_printf(out, "io: %llu bytes read, %llu bytes written, %llu syncs\n",
+                  (unsigned long long) counters[STAT_BYTES_READ], (unsigned long long) counters[STAT_BYTES_WRITTEN],
+                  (unsigned long long) counters[STAT_SYNCS]);
+    output_printf(out, "tree: %llu leaf splits, %llu internal splits, %llu root splits, %llu leaf merges, "
+                  "%llu internal merges\n",
+                  (unsigned long long) counters[STAT_LEAF_SPLITS], (unsigned long long) counters[STAT_INTERNAL_SPLITS],
+                  (unsigned long long) counters[STAT_ROOT_SPLITS], (unsigned long long) counters[STAT_LEAF_MERGES],
+                  (unsigned long long) counters[STAT_INTERNAL_MERGES]);
+    output_printf(out, "select: %llu statements, %llu rows scanned, %llu rows returned\n",
+                  (unsigned long long) counters[STAT_SELECTS], (unsigned long long) counters[STAT_ROWS_SCANNED],
+                  (unsigned long long) counters[STAT_ROWS_RETURNED]);
+    output_printf(out, "lookup: %llu root descents, %llu path hints, %llu leaf hints\n",
+                  (unsigned long long) counters[STAT_ROOT_DESCENTS], (unsigned long long) counters[STAT_PATH_HINTS],
+                  (unsigned long long) counters[STAT_LEAF_HINTS]);
+    output_printf(out, "%-16s %10s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "mean", "p50", "p90",
+                  "p99", "p99.9", "max");
+    for (uint32_t i = 0; i < NUM_HISTOGRAMS; i++) {
+        Histogram *histogram = &stats.histograms[i];
+        // 行数分布不换算单位
+        double scale = i == HIST_SELECT_ROWS ? 1.0 : 1000.0;
+        output_printf(out, "%-16s %10llu %10.1f", i == HIST_SELECT_ROWS ? "select rows" : HISTOGRAM_NAMES[i],
+                      (unsigned long long) histogram->count,
+                      histogram->count > 0 ? histogram->sum / scale / histogram->count : 0.0);
+        for (uint32_t j = 0; j < 4; j++) {
+            output_printf(out, " %10.1f", histogram_percentile(histogram, percentiles[j]) / scale);
+        }
+        output_printf(out, " %10.1f\n", histogram->max / scale);
+    }
+}
+
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
+    if (strcmp(input_buffer->buffer, ".exit") == 0) {
+        close_input_buffer(input_buffer);
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    }
+    // .mode [tuple|csv|tsv|binary] 只改变 REPL 的输出格式，不带参数时显示当前格式
+    if (strcmp(input_buffer->buffer, ".mode") == 0) {
+        printf("%s\n", OUTPUT_MODE_NAMES[output_mode]);
+        return META_COMMAND_SUCCESS;
+    }
+    if (strncmp(input_buffer->buffer, ".mode ", 6) == 0) {
+        OutputMode mode = parse_output_mode(input_buffer->buffer + 6);
+        if (mode == NUM_OUTPUT_MODES) {
+            printf("unrecognized output mode '%s'.\n", input_buffer->buffer + 6);
+        } else {
+            output_mode = mode;
+        }
+        return META_COMMAND_SUCCESS;
+    }
+
+    // .stats 只需要共享持有数据库，不等正在执行的语句
+    if (strcmp(input_buffer->buffer, ".stats") == 0 || strcmp(input_buffer->buffer, ".stats json") == 0) {
+        OutputBuffer out = {NULL, 0, 0};
+        pthread_rwlock_rdlock(&table->db_lock);
+        print_stats(table, input_buffer->buffer[6] != 0, &out);
+        pthread_rwlock_unlock(&table->db_lock);
+        output_flush(&out, stdout);
+        free(out.data);
+        return META_COMMAND_SUCCESS;
+    }
+    if (strcmp(input_buffer->buffer, ".stats reset") == 0) {
+        // 之后的 .stats 只统计 reset 以来的部分
+        stats_reset();
+        return META_COMMAND_SUCCESS;
+    }
+
+    // 其他系统指令执行期间独占数据库
+    MetaCommandResult result = META_COMMAND_SUCCESS;
+    db_begin_exclusive(table);
+    if (strcmp(input_buffer->buffer, ".btree") == 0) {
+        printf("Tree: \n");
+        print_tree(table->pager, table->root_page_num, 0);
+    } else if (strcmp(input_buffer->buffer, ".checkpoint") == 0) {
+        uint32_t num_flushed = pager_flush_dirty(table->pager);
+        if (stats_fdatasync(table->pager->file_descriptor) == -1) {
+            printf("error syncing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        printf("checkpoint: %d pages written.\n", num_flushed);
+    } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+        // .import <file.csv> [fill_factor]
+        strtok(input_buffer->buffer, " ");
+        char *filename = strtok(NULL, " ");
+        char *fill = strtok(NULL, " ");
+        table_import(table, filename, fill != NULL ? atof(fill) : DEFAULT_FILL_FACTOR);
+    } else if (strcmp(input_buffer->buffer, ".vacuum") == 0 || strncmp(input_buffer->buffer, ".vacuum ", 8) == 0) {
+        // .vacuum [fill_factor | incremental]
+        char *arg = input_buffer->buffer[7] != 0 ? input_buffer->buffer + 8 : NULL;
+        if (vacuum_running(table)) {
+            printf("vacuum already running.\n");
+        } else if (arg != NULL && strcmp(arg, "incremental") == 0) {
+            vacuum_start(table);
+        } else {
+            table_vacuum(table, arg != NULL ? atof(arg) : DEFAULT_FILL_FACTOR);
+        }
+    } else if (strcmp(input_buffer->buffer, ".verify") == 0) {
+        verify_database(table);
+    } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+        printf("Constants: \n");
+        print_constants();
+    } else {
+        result = META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+    db_end_exclusive(table);
+    return result;
+}
+
+// 校验字段并填充 Row，insert 语句和 .import 共用
+PrepareResult parse_row(char *id, char *username, char *email, Row *row) {
+    if (id == NULL || username == NULL || email == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int id_num = atoi(id);
+    if (id_num < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (strlen(username) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (strlen(email) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    row->id = id_num;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
+    return PREPARE_SUCCESS;
+}
+
+// 列名转成 IndexColumn，不是可索引的列时返回 NUM_INDEXES
+IndexColumn parse_index_column(const char *name) {
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        if (strcmp(name, INDEX_COLUMN_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return NUM_INDEXES;
+}
+
+RowColumn parse_row_column(const char *name, size_t length) {
+    for (uint32_t i = 0; i < NUM_ROW_COLUMNS; i++) {
+        if (strlen(ROW_COLUMN_NAMES[i]) == length && strncmp(name, ROW_COLUMN_NAMES[i], length) == 0) {
+            return i;
+        }
+    }
+    return NUM_ROW_COLUMNS;
+}
+
+// 解析 select 后面可选的列清单（"*" 或逗号分隔的列名），返回清单之后的位置，出错时返回 NULL
+char *prepare_select_columns(char *clause, Statement *statement) {
+    statement->num_select_columns = 0;
+    char *rest = clause + strspn(clause, " ");
+    for (uint32_t i = AGGREGATE_COUNT; i < NUM_AGGREGATES; i++) {
+        size_t length = strlen(AGGREGATE_NAMES[i]);
+        if (strncmp(rest, AGGREGATE_NAMES[i], length) == 0) {
+            statement->select_aggregate = i;
+            statement->select_columns[0] = ROW_ID;
+            statement->num_select_columns = 1;
+            return rest + length;
+        }
+    }
+    if (rest[0] == '*') {
+        clause = rest + 1;
+    } else if (rest[0] != '\0' && strncmp(rest, "where", 5) != 0 && strncmp(rest, "limit", 5) != 0) {
+        for (;;) {
+            size_t length = strspn(rest, "abcdefghijklmnopqrstuvwxyz");
+            RowColumn column = parse_row_column(rest, length);
+            if (column == NUM_ROW_COLUMNS || statement->num_select_columns == NUM_ROW_COLUMNS) {
+                return NULL;
+            }
+            statement->select_columns[statement->num_select_columns++] = column;
+            rest += length;
+            rest += strspn(rest, " ");
+            if (rest[0] != ',') {
+                break;
+            }
+            rest += 1;
+            rest += strspn(rest, " ");
+        }
+        clause = rest;
+    }
+    if (statement->num_select_columns == 0) {
+        for (uint32_t i = 0; i < NUM_ROW_COLUMNS; i++) {
+            statement->select_columns[i] = i;
+        }
+        statement->num_select_columns = NUM_ROW_COLUMNS;
+    }
+    return clause;
+}
+
+// select [* | column, ...] [where id = N | where id between A and B | where username|email = | like '...']
+//        [limit N [offset M]]
+// select count(*) | min(id) | max(id) [where ...] [limit N [offset M]]，limit 和 offset 作用在唯一的结果行上
+PrepareResult prepare_select(char *clause, Statement *statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->select_min_id = 0;
+    statement->select_max_id = UINT32_MAX;
+    statement->select_limit = UINT32_MAX;
+    statement->select_offset = 0;
+    statement->select_aggregate = AGGREGATE_NONE;
+    statement->select_column = NUM_INDEXES;
+    statement->select_like = false;
+    if (clause[0] != '\0' && clause[0] != ' ') {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    clause = prepare_select_columns(clause, statement);
+    if (clause == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int min_id, max_id, limit, offset;
+    int consumed = 0;
+    char column[16];
+    bool column_filter = sscanf(clause, " where %15[a-z] = '%n", column, &consumed) == 1 && consumed > 0;
+    if (!column_filter) {
+        consumed = 0;
+        column_filter = sscanf(clause, " where %15[a-z] like '%n", column, &consumed) == 1 && consumed > 0;
+        statement->select_like = column_filter;
+    }
+    if (column_filter) {
+        statement->select_column = parse_index_column(column);
+        if (statement->select_column == NUM_INDEXES) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        clause += consumed;
+        char *quote = strchr(clause, '\'');
+        if (quote == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        size_t length = quote - clause;
+        if (length > (statement->select_column == INDEX_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        memcpy(statement->select_value, clause, length);
+        statement->select_value[length] = '\0';
+        statement->select_value_length = length;
+        clause = quote + 1;
+        min_id = 0;
+        max_id = -1;
+        consumed = 0;
+    } else if (sscanf(clause, " where id = %d%n", &min_id, &consumed) == 1) {
+        max_id = min_id;
+    } else if (sscanf(clause, " where id between %d and %d%n", &min_id, &max_id, &consumed) == 2) {
+        if (max_id < 0) {
+            return PREPARE_NEGATIVE_ID;
+        }
+    } else {
+        min_id = 0;
+        max_id = -1;
+    }
+    if (min_id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    clause += consumed;
+
+    consumed = 0;
+    if (sscanf(clause, " limit %d%n", &limit, &consumed) == 1) {
+        if (limit < 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->select_limit = limit;
+        clause += consumed;
+
+        consumed = 0;
+        if (sscanf(clause, " offset %d%n", &offset, &consumed) == 1) {
+            if (offset < 0) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            statement->select_offset = offset;
+            clause += consumed;
+        }
+    }
+    clause += strspn(clause, " ");
+    if (clause[0] != '\0') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    statement->select_min_id = min_id;
+    if (max_id >= 0) {
+        statement->select_max_id = max_id;
+    }
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement(char *sql, Statement *statement) {
+    if (strncmp(sql, "insert", 6) == 0) {
+        statement->type = STATEMENT_INSERT;
+        statement->num_rows_to_insert = 0;
+
+        // insert 1 a a@x.com, 2 b b@x.com, ...
+        // strsep 不跳过空串，逗号前后为空的元组（如结尾多一个逗号）按语法错误处理
+        char *tuples = sql + 6;
+        char *tuple;
+        while ((tuple = strsep(&tuples, ",")) != NULL) {
+            char *field_state;
+            char *id = strtok_r(tuple, " ", &field_state);
+            char *username = strtok_r(NULL, " ", &field_state);
+            char *email = strtok_r(NULL, " ", &field_state);
+            if (strtok_r(NULL, " ", &field_state) != NULL) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+
+            if (statement->num_rows_to_insert == statement->rows_capacity) {
+                statement->rows_capacity = statement->rows_capacity == 0 ? 16 : statement->rows_capacity * 2;
+                statement->rows_to_insert = realloc(statement->rows_to_insert,
+                                                    sizeof(Row) * statement->rows_capacity);
+            }
+            PrepareResult result = parse_row(id, username, email,
+                                             &statement->rows_to_insert[statement->num_rows_to_insert]);
+            if (result != PREPARE_SUCCESS) {
+                return result;
+            }
+            statement->num_rows_to_insert++;
+        }
+        return PREPARE_SUCCESS;
+    }
+    if (strncmp(sql, "select", 6) == 0) {
+        return prepare_select(sql + 6, statement);
+    }
+    if (strncmp(sql, "delete", 6) == 0) {
+        statement->type = STATEMENT_DELETE;
+
+        int id_num;
+        char trailing;
+        if (sscanf(sql, "delete where id = %d %c", &id_num, &trailing) != 1) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (id_num < 0) {
+            return PREPARE_NEGATIVE_ID;
+        }
+        statement->id_to_delete = id_num;
+        return PREPARE_SUCCESS;
+    }
+    if (strncmp(sql, "create", 6) == 0) {
+        statement->type = STATEMENT_CREATE_INDEX;
+
+        // create index on username|email
+        char column[16];
+        char trailing;
+        if (sscanf(sql, "create index on %15s %c", column, &trailing) != 1) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->index_column = parse_index_column(column);
+        if (statement->index_column == NUM_INDEXES) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        return PREPARE_SUCCESS;
+    }
+
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+// 优先复用空闲链表上的页，链表为空时才扩展文件
+uint32_t get_unused_page_num(Pager *pager) {
+    if (pager->vacuum_next_page != 0) {
+        return pager->vacuum_next_page++;
+    }
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    uint32_t page_num = *header_free_list_head(header);
+    if (page_num == 0) {
+        pager_unpin(pager, HEADER_PAGE_NUM);
+        return pager->num_pages;
+    }
+
+    void *page = get_page(pager, page_num);
+    *header_free_list_head(header) = *free_page_next(page);
+    *header_num_free_pages(header) -= 1;
+    pager_unpin(pager, page_num);
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+    return page_num;
+}
+
+// 把不再使用的页挂到空闲链表头部
+void free_page(Pager *pager, uint32_t page_num) {
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    void *page = get_page(pager, page_num);
+    memset(page, 0, PAGE_SIZE);
+    set_node_type(page, NODE_FREE);
+    *free_page_next(page) = *header_free_list_head(header);
+    *header_free_list_head(header) = page_num;
+    *header_num_free_pages(header) += 1;
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+void set_node_parent(Pager *pager, uint32_t page_num, uint32_t parent_page_num) {
+    void *node = get_page(pager, page_num);
+    if (*node_parent(node) != parent_page_num) {
+        *node_parent(node) = parent_page_num;
+        pager_mark_dirty(pager, page_num);
+    }
+    pager_unpin(pager, page_num);
+}
+
+
+uint32_t subtree_row_count(Pager *pager, uint32_t page_num) {
+    void *node = get_page(pager, page_num);
+    uint32_t count = node_row_count(node);
+    pager_unpin(pager, page_num);
+    return count;
+}
+
+// 子树中插入或删除一行之前，沿 key 的路径把各层指向它的子树行数加上 delta。
+// 之后的分裂与合并按节点的实际内容重新计算受影响的行数，路径上更高层的行数不再变化。
+// 一般在 table_find_leaf_exclusive 下降时顺路完成；这里只用于没有下降的追加快速路径，
+// 以及下降时猜错了 delta 要改回去的情况。改完一层就放开本次新加的写锁，不挡住读者到语句结束
+void tree_add_row_count(Table *table, uint32_t key, int32_t delta) {
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    while (true) {
+        bool already_latched = page_is_write_latched(pager, page_num);
+        void *node = get_page(pager, page_num);
+        if (get_node_type(node) != NODE_INTERNAL) {
+            pager_unpin(pager, page_num);
+            break;
+        }
+        uint32_t child_idx = internal_node_find_child(node, key);
+        *internal_node_count(node, child_idx) += delta;
+        uint32_t child_page_num = *internal_node_child(node, child_idx);
+        pager_mark_dirty(pager, page_num);
+        pager_unpin(pager, page_num);
+        if (!already_latched && latch_mode == LATCH_MODE_WRITE) {
+            page_unlatch_exclusive(pager, page_num);
+        }
+        page_num = child_page_num;
+    }
+}
+
+void create_new_root(Table *table, uint32_t right_child_page_num) {
+    stats_add(STAT_ROOT_SPLITS, 1);
+    void *root = get_page(table->pager, table->root_page_num);
+
+    // 把原节点数据迁移到左节点，并将左节点设置为非 root
+    uint32_t left_child_page_num = get_unused_page_num(table->pager);
+    void *left_child = get_page(table->pager, left_child_page_num);
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    // 左节点是中间节点时，它的子节点原本指向 root，需要改为指向新页
+    if (get_node_type(left_child) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(left_child);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            set_node_parent(table->pager, *internal_node_child(left_child, i), left_child_page_num);
+        }
+    }
+
+    // 初始化 root 节点
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
+    *internal_node_key(root, 0) = left_child_max_key;
+    *internal_node_right_child(root) = right_child_page_num;
+    *internal_node_cell_count(root, 0) = node_row_count(left_child);
+    *internal_node_right_count(root) = subtree_row_count(table->pager, right_child_page_num);
+    *node_parent(left_child) = table->root_page_num;
+    set_node_parent(table->pager, right_child_page_num, table->root_page_num);
+
+    pager_mark_dirty(table->pager, left_child_page_num);
+    pager_mark_dirty(table->pager, table->root_page_num);
+    pager_unpin(table->pager, left_child_page_num);
+    pager_unpin(table->pager, table->root_page_num);
+}
+
+void internal_node_split_and_insert(Table *table, uint32_t page_num,
+                                   uint32_t left_max_key, uint32_t right_page_num);
+
+// left 子节点分裂出右兄弟 right_page_num 之后，把它登记到中间节点中
+// left_max_key 是分裂后左子树的最大 key，节点需要有容纳一个新单元的空间
+void internal_node_insert_cell(void *node, uint32_t left_max_key, uint32_t right_page_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t index = internal_node_find_child(node, left_max_key);
+
+    if (index == num_keys) {
+        // 分裂的是最右子节点：它变成普通单元，新节点成为右子节点
+        *internal_node_cell(node, num_keys) = *internal_node_right_child(node);
+        *internal_node_key(node, num_keys) = left_max_key;
+        *internal_node_right_child(node) = right_page_num;
+    } else {
+        // [index, num_keys) 整体右移，原来的 key 留给新节点作为上界
+        internal_node_move_cells(node, index + 1, node, index, num_keys - index);
+        *internal_node_key(node, index) = left_max_key;
+        *internal_node_cell(node, index + 1) = right_page_num;
+    }
+    *internal_node_num_keys(node) = num_keys + 1;
+}
+
+void internal_node_insert(Table *table, uint32_t parent_page_num,
+                          uint32_t left_max_key, uint32_t right_page_num) {
+    void *parent = get_page(table->pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    if (num_keys >= INTERNAL_NODE_MAX_CELLS) {
+        pager_unpin(table->pager, parent_page_num);
+        internal_node_split_and_insert(table, parent_page_num, left_max_key, right_page_num);
+        return;
+    }
+
+    internal_node_insert_cell(parent, left_max_key, right_page_num);
+    // 分裂的两半各自重新计算行数，合起来等于分裂前的子树
+    uint32_t index = internal_node_find_child(parent, left_max_key);
+    *internal_node_count(parent, index) = subtree_row_count(table->pager, *internal_node_child(parent, index));
+    *internal_node_count(parent, index + 1) = subtree_row_count(table->pager, right_page_num);
+    set_node_parent(table->pager, right_page_num, parent_page_num);
+    pager_mark_dirty(table->pager, parent_page_num);
+    pager_unpin(table->pager, parent_page_num);
+}
+
+// 中间节点已满：先在临时缓冲区中插入新单元，再把一半单元搬到新节点，
+// 中间的 key 上移到父节点，父节点满了会继续向上分裂
+void internal_node_split_and_insert(Table *table, uint32_t page_num,
+                                   uint32_t left_max_key, uint32_t right_page_num) {
+    stats_add(STAT_INTERNAL_SPLITS, 1);
+    Pager *pager = table->pager;
+    void *old_node = get_page(pager, page_num);
+
+    // key 数组和子节点数组长度固定，放不下多出的一个单元，所以在临时数组中插入：
+    // 分裂的子节点 index 的上界改为 left_max_key，新节点插在它右边并继承原来的上界
+    uint32_t num_keys = *internal_node_num_keys(old_node);
+    uint32_t index = internal_node_find_child(old_node, left_max_key);
+    uint32_t *keys = malloc(sizeof(uint32_t) * (num_keys + 1));
+    uint32_t *children = malloc(sizeof(uint32_t) * (num_keys + 2));
+    uint32_t *counts = malloc(sizeof(uint32_t) * (num_keys + 2));
+    memcpy(keys, internal_node_key(old_node, 0), num_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(children, internal_node_cell(old_node, 0), num_keys * INTERNAL_NODE_CHILD_SIZE);
+    memcpy(counts, internal_node_cell_count(old_node, 0), num_keys * INTERNAL_NODE_COUNT_SIZE);
+    children[num_keys] = *internal_node_right_child(old_node);
+    counts[num_keys] = *internal_node_right_count(old_node);
+    memmove(keys + index + 1, keys + index, (num_keys - index) * sizeof(uint32_t));
+    memmove(children + index + 2, children + index + 1, (num_keys - index) * sizeof(uint32_t));
+    memmove(counts + index + 2, counts + index + 1, (num_keys - index) * sizeof(uint32_t));
+    keys[index] = left_max_key;
+    children[index + 1] = right_page_num;
+    counts[index] = subtree_row_count(pager, children[index]);
+    counts[index + 1] = subtree_row_count(pager, right_page_num);
+    set_node_parent(pager, right_page_num, page_num);
+
+    uint32_t total_keys = num_keys + 1;
+    uint32_t left_num_keys = total_keys / 2;
+    uint32_t right_num_keys = total_keys - left_num_keys - 1;
+    uint32_t separator = keys[left_num_keys];
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    initialize_internal_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+    memcpy(internal_node_key(new_node, 0), keys + left_num_keys + 1, right_num_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(internal_node_cell(new_node, 0), children + left_num_keys + 1, right_num_keys * INTERNAL_NODE_CHILD_SIZE);
+    memcpy(internal_node_cell_count(new_node, 0), counts + left_num_keys + 1, right_num_keys * INTERNAL_NODE_COUNT_SIZE);
+    *internal_node_num_keys(new_node) = right_num_keys;
+    *internal_node_right_child(new_node) = children[total_keys];
+    *internal_node_right_count(new_node) = counts[total_keys];
+
+    // 左半部分留在原节点，分隔 key 对应的子节点成为它的右子节点
+    *internal_node_num_keys(old_node) = left_num_keys;
+    memcpy(internal_node_key(old_node, 0), keys, left_num_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(internal_node_cell(old_node, 0), children, left_num_keys * INTERNAL_NODE_CHILD_SIZE);
+    memcpy(internal_node_cell_count(old_node, 0), counts, left_num_keys * INTERNAL_NODE_COUNT_SIZE);
+    *internal_node_right_child(old_node) = children[left_num_keys];
+    *internal_node_right_count(old_node) = counts[left_num_keys];
+    free(keys);
+    free(children);
+    free(counts);
+
+    for (uint32_t i = 0; i <= right_num_keys; i++) {
+        set_node_parent(pager, *internal_node_child(new_node, i), new_page_num);
+    }
+
+    bool old_is_root = is_node_root(old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    pager_mark_dirty(pager, new_page_num);
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, new_page_num);
+    pager_unpin(pager, page_num);
+
+    if (old_is_root) {
+        create_new_root(table, new_page_num);
+    } else {
+        internal_node_insert(table, parent_page_num, separator, new_page_num);
+    }
+}
+
+// 将叶子节点一分为二，并插入新数据
+// 行是变长的，按占用字节数而不是单元个数分：从左往右放，左边达到总量的一半后其余放到新节点
+void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, void *value, uint32_t size) {
+    stats_add(STAT_LEAF_SPLITS, 1);
+    Pager *pager = cursor->table->pager;
+    void *old_node = get_page(pager, cursor->page_num);
+
+    // 初始化一个新的节点
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    initialize_leaf_node(new_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    // 原节点的单元先复制出来，再清空原节点重新填入
+    void *temp = malloc(PAGE_SIZE);
+    memcpy(temp, old_node, PAGE_SIZE);
+    uint32_t num_cells = *leaf_node_num_cells(temp);
+    uint32_t total_space = leaf_node_used_space(temp) + LEAF_NODE_SLOT_SIZE + size;
+    *leaf_node_num_cells(old_node) = 0;
+    *leaf_node_content_start(old_node) = PAGE_SIZE;
+
+    uint32_t left_space = 0;
+    for (uint32_t i = 0; i <= num_cells; i++) {
+        // 每边至少一个单元
+        bool to_left = i == 0 || (i < num_cells && left_space < total_space / 2);
+        void *dst_node = to_left ? old_node : new_node;
+        uint32_t dst_cell = *leaf_node_num_cells(dst_node);
+        if (i == cursor->cell_num) { // 到达新数据插入的位置
+            leaf_node_insert_cell(dst_node, dst_cell, key, value, size);
+        } else {
+            // 新数据之后的单元在原节点中的下标要减一
+            leaf_node_copy_cell(dst_node, dst_cell, temp, i > cursor->cell_num ? i - 1 : i);
+        }
+        if (to_left) {
+            left_space += leaf_node_cell_space(old_node, dst_cell);
+        }
+    }
+    free(temp);
+
+    bool old_is_root = is_node_root(old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    uint32_t left_max_key = *leaf_node_key(old_node, *leaf_node_num_cells(old_node) - 1);
+    *node_parent(new_node) = parent_page_num;
+    pager_mark_dirty(pager, new_page_num);
+    pager_mark_dirty(pager, cursor->page_num);
+    pager_unpin(pager, new_page_num);
+    pager_unpin(pager, cursor->page_num);
+
+    if (old_is_root) {
+        create_new_root(cursor->table, new_page_num);
+    } else {
+        internal_node_insert(cursor->table, parent_page_num, left_max_key, new_page_num);
+    }
+}
+
+// 在游标位置插入任意内容的单元，页满时分裂
+void leaf_node_insert_value(Cursor *cursor, uint32_t key, void *value, uint32_t size) {
+    void *node = get_page(cursor->table->pager, cursor->page_num);
+    if (!leaf_node_insert_cell(node, cursor->cell_num, key, value, size)) {
+        pager_unpin(cursor->table->pager, cursor->page_num);
+        leaf_node_split_and_insert(cursor, key, value, size);
+        return;
+    }
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+    pager_unpin(cursor->table->pager, cursor->page_num);
+}
+
+void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
+    uint8_t data[ROW_MAX_SIZE];
+    uint32_t size = serialize_row(value, data);
+    leaf_node_insert_value(cursor, key, data, size);
+}
+
+// 删除第 index 个分隔 key 和它右侧的子节点，该子节点的内容已经并入左侧子节点
+void internal_node_remove_right_of(void *node, uint32_t index) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t left_child_page_num = *internal_node_cell(node, index);
+    uint32_t merged_count = *internal_node_count(node, index) + *internal_node_count(node, index + 1);
+    if (index + 1 == num_keys) {
+        *internal_node_right_child(node) = left_child_page_num;
+    } else {
+        // 左子节点接管右子节点的上界 key
+        *internal_node_cell(node, index + 1) = left_child_page_num;
+    }
+    internal_node_move_cells(node, index, node, index + 1, num_keys - index - 1);
+    *internal_node_num_keys(node) = num_keys - 1;
+    *internal_node_count(node, index) = merged_count;
+}
+
+// 中间节点删除单元后可能不满一半：先尝试从兄弟节点借一个子节点，
+// 借不到就与兄弟合并，并继续检查父节点。key 用来在父节点中定位本节点
+void internal_node_rebalance(Table *table, uint32_t page_num, uint32_t key) {
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    if (is_node_root(node)) {
+        if (num_keys == 0) {
+            // 根只剩一个子节点，把子节点提升为根，树高减一
+            uint32_t child_page_num = *internal_node_right_child(node);
+            void *child = get_page(pager, child_page_num);
+            memcpy(node, child, PAGE_SIZE);
+            set_node_root(node, true);
+            pager_unpin(pager, child_page_num);
+            if (get_node_type(node) == NODE_INTERNAL) {
+                for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++) {
+                    set_node_parent(pager, *internal_node_child(node, i), page_num);
+                }
+            }
+            pager_mark_dirty(pager, page_num);
+            pager_unpin(pager, page_num);
+            free_page(pager, child_page_num);
+            if (table->last_leaf_page_num == child_page_num) {
+                table->last_leaf_page_num = INVALID_PAGE_NUM;
+            }
+            return;
+        }
+        pager_unpin(pager, page_num);
+        return;
+    }
+    if (num_keys >= INTERNAL_NODE_MIN_CELLS) {
+        pager_unpin(pager, page_num);
+        return;
+    }
+
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_find_child(parent, key);
+    bool has_left = index > 0;
+    uint32_t separator_index = has_left ? index - 1 : index;
+    uint32_t sibling_page_num = *internal_node_child(parent, has_left ? index - 1 : index + 1);
+    void *sibling = get_page(pager, sibling_page_num);
+    uint32_t sibling_keys = *internal_node_num_keys(sibling);
+
+    if (sibling_keys > INTERNAL_NODE_MIN_CELLS) {
+        // 借一个子节点，父节点的分隔 key 和兄弟的边界 key 互相轮换
+        uint32_t moved_child;
+        uint32_t moved_count;
+        if (has_left) {
+            moved_child = *internal_node_right_child(sibling);
+            moved_count = *internal_node_right_count(sibling);
+            internal_node_move_cells(node, 1, node, 0, num_keys);
+            *internal_node_cell(node, 0) = moved_child;
+            *internal_node_cell_count(node, 0) = moved_count;
+            *internal_node_key(node, 0) = *internal_node_key(parent, separator_index);
+            *internal_node_key(parent, separator_index) = *internal_node_key(sibling, sibling_keys - 1);
+            *internal_node_right_child(sibling) = *internal_node_cell(sibling, sibling_keys - 1);
+            *internal_node_right_count(sibling) = *internal_node_cell_count(sibling, sibling_keys - 1);
+        } else {
+            moved_child = *internal_node_cell(sibling, 0);
+            moved_count = *internal_node_cell_count(sibling, 0);
+            *internal_node_cell(node, num_keys) = *internal_node_right_child(node);
+            *internal_node_cell_count(node, num_keys) = *internal_node_right_count(node);
+            *internal_node_key(node, num_keys) = *internal_node_key(parent, separator_index);
+            *internal_node_right_child(node) = moved_child;
+            *internal_node_right_count(node) = moved_count;
+            *internal_node_key(parent, separator_index) = *internal_node_key(sibling, 0);
+            internal_node_move_cells(sibling, 0, sibling, 1, sibling_keys - 1);
+        }
+        *internal_node_num_keys(node) = num_keys + 1;
+        *internal_node_num_keys(sibling) = sibling_keys - 1;
+        // 借来的子树的行数从兄弟移到本节点名下
+        *internal_node_count(parent, index) += moved_count;
+        *internal_node_count(parent, has_left ? index - 1 : index + 1) -= moved_count;
+        set_node_parent(pager, moved_child, page_num);
+
+        pager_mark_dirty(pager, page_num);
+        pager_mark_dirty(pager, sibling_page_num);
+        pager_mark_dirty(pager, parent_page_num);
+        pager_unpin(pager, sibling_page_num);
+        pager_unpin(pager, parent_page_num);
+        pager_unpin(pager, page_num);
+        return;
+    }
+
+    // 合并：右节点的全部子节点并入左节点，父节点的分隔 key 下移到两者之间
+    stats_add(STAT_INTERNAL_MERGES, 1);
+    uint32_t left_page_num = has_left ? sibling_page_num : page_num;
+    uint32_t right_page_num = has_left ? page_num : sibling_page_num;
+    void *left = has_left ? sibling : node;
+    void *right = has_left ? node : sibling;
+    uint32_t left_keys = *internal_node_num_keys(left);
+    uint32_t right_keys = *internal_node_num_keys(right);
+
+    *internal_node_cell(left, left_keys) = *internal_node_right_child(left);
+    *internal_node_cell_count(left, left_keys) = *internal_node_right_count(left);
+    *internal_node_key(left, left_keys) = *internal_node_key(parent, separator_index);
+    internal_node_move_cells(left, left_keys + 1, right, 0, right_keys);
+    *internal_node_right_child(left) = *internal_node_right_child(right);
+    *internal_node_right_count(left) = *internal_node_right_count(right);
+    *internal_node_num_keys(left) = left_keys + 1 + right_keys;
+    for (uint32_t i = 0; i <= right_keys; i++) {
+        set_node_parent(pager, *internal_node_child(right, i), left_page_num);
+    }
+    internal_node_remove_right_of(parent, separator_index);
+
+    pager_mark_dirty(pager, left_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    pager_unpin(pager, sibling_page_num);
+    pager_unpin(pager, parent_page_num);
+    pager_unpin(pager, page_num);
+    free_page(pager, right_page_num);
+    internal_node_rebalance(table, parent_page_num, key);
+}
+
+// 在相邻叶子之间移动边界上的单元，使两边占用的空间尽量接近（相差不超过两个单元）
+void leaf_node_redistribute(void *left, void *right) {
+    for (;;) {
+        uint32_t left_used = leaf_node_used_space(left);
+        uint32_t right_used = leaf_node_used_space(right);
+        uint32_t left_cells = *leaf_node_num_cells(left);
+        if (left_used < right_used) {
+            uint32_t space = leaf_node_cell_space(right, 0);
+            if (left_used + space > right_used - space) {
+                break;
+            }
+            leaf_node_copy_cell(left, left_cells, right, 0);
+            leaf_node_remove_cells(right, 0, 1);
+        } else {
+            uint32_t space = leaf_node_cell_space(left, left_cells - 1);
+            if (right_used + space > left_used - space) {
+                break;
+            }
+            leaf_node_copy_cell(right, 0, left, left_cells - 1);
+            leaf_node_remove_cells(left, left_cells - 1, 1);
+        }
+    }
+}
+
+// 右叶子的单元全部追加到左叶子，调用者保证放得下
+void leaf_node_merge(void *left, void *right) {
+    uint32_t right_cells = *leaf_node_num_cells(right);
+    for (uint32_t i = 0; i < right_cells; i++) {
+        leaf_node_copy_cell(left, *leaf_node_num_cells(left), right, i);
+    }
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+}
+
+// 叶子节点删除后占用空间低于下限时的处理，与 internal_node_rebalance 对应
+void leaf_node_rebalance(Table *table, uint32_t page_num, uint32_t key) {
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    if (is_node_root(node) || leaf_node_used_space(node) >= LEAF_NODE_MIN_SPACE) {
+        pager_unpin(pager, page_num);
+        return;
+    }
+
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_find_child(parent, key);
+    bool has_left = index > 0;
+    uint32_t separator_index = has_left ? index - 1 : index;
+    uint32_t sibling_page_num = *internal_node_child(parent, has_left ? index - 1 : index + 1);
+    void *sibling = get_page(pager, sibling_page_num);
+
+    uint32_t left_page_num = has_left ? sibling_page_num : page_num;
+    uint32_t right_page_num = has_left ? page_num : sibling_page_num;
+    void *left = has_left ? sibling : node;
+    void *right = has_left ? node : sibling;
+
+    if (leaf_node_used_space(left) + leaf_node_used_space(right) > LEAF_NODE_SPACE_FOR_CELLS) {
+        // 合并后放不下：在两者之间重新分配单元，并更新父节点中两者之间的分隔 key
+        leaf_node_redistribute(left, right);
+        *internal_node_key(parent, separator_index) = *leaf_node_key(left, *leaf_node_num_cells(left) - 1);
+        *internal_node_count(parent, separator_index) = *leaf_node_num_cells(left);
+        *internal_node_count(parent, separator_index + 1) = *leaf_node_num_cells(right);
+
+        pager_mark_dirty(pager, page_num);
+        pager_mark_dirty(pager, sibling_page_num);
+        pager_mark_dirty(pager, parent_page_num);
+        pager_unpin(pager, sibling_page_num);
+        pager_unpin(pager, parent_page_num);
+        pager_unpin(pager, page_num);
+        return;
+    }
+
+    // 合并：右叶子的单元追加到左叶子，右叶子从链表中摘除并释放
+    stats_add(STAT_LEAF_MERGES, 1);
+    leaf_node_merge(left, right);
+    internal_node_remove_right_of(parent, separator_index);
+
+    pager_mark_dirty(pager, left_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    pager_unpin(pager, sibling_page_num);
+    pager_unpin(pager, parent_page_num);
+    pager_unpin(pager, page_num);
+    free_page(pager, right_page_num);
+    // 释放的页可能被同一文件中的其他树复用，提示不能再指向它
+    if (table->last_leaf_page_num == right_page_num) {
+        table->last_leaf_page_num = INVALID_PAGE_NUM;
+    }
+    internal_node_rebalance(table, parent_page_num, key);
+}
+
+// 提示页仍是最右叶子（叶子且没有后继）并且 key 大于它的最大 key 时，直接追加到末尾
+// 这一校验分辨不出其他树的最右叶子：索引与主表共用空闲页，释放提示页的地方（叶子合并、
+// 根节点降级、整理搬页）必须清除提示
+bool table_can_append(void *node, uint32_t key) {
+    if (get_node_type(node) != NODE_LEAF || *leaf_node_next_leaf(node) != 0) {
+        return false;
+    }
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    return num_cells > 0 && key > *leaf_node_key(node, num_cells - 1);
+}
+
+//
+// Secondary Index
+//
+// 每个索引是同一文件中的另一棵 B+ 树，根页号记录在文件头中。key 是列值的 32 位哈希，
+// 单元内容是哈希相同的行的 id 数组（升序）。哈希可能冲突，查到的 id 还要回表比较列值。
+// 一个单元最多放 INDEX_MAX_IDS 个 id，放满后新的 id 依次放进 key + 1、key + 2 ... 的单元，
+// 所以一个值的 id 从它的哈希开始，存放在 key 连续的若干单元中，查找时一直读到某个 key 没有单元为止。
+// 删除 id 后变空的单元若后面还有单元就留着（值为空），保证后面的 id 仍然连得上
+//
+#define INDEX_MAX_IDS ((2 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE) / sizeof(uint32_t)) // 单元不超过一行的最大长度
+
+// FNV-1a
+uint32_t index_hash(const char *value) {
+    uint32_t hash = 2166136261u;
+    for (; *value != '\0'; value++) {
+        hash = (hash ^ (uint8_t) *value) * 16777619u;
+    }
+    return hash;
+}
+
+const char *row_column(Row *row, IndexColumn column) {
+    return column == INDEX_USERNAME ? row->username : row->email;
+}
+
+// 取出 key 对应单元中的 id 数组，返回单元是否存在，同时给出单元所在的叶子和位置。
+// delta 在下降时加到路径上的子树行数中（见 table_find_leaf_exclusive），用于要新建或删掉这个单元的情况
+bool index_find(Table *index, uint32_t key, int32_t delta, uint32_t *ids, uint32_t *num_ids, uint32_t *page_num,
+                uint32_t *cell_num) {
+    void *node = table_find_leaf_exclusive(index, key, delta, page_num);
+    *cell_num = leaf_node_find_cell(node, key);
+    bool found = *cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, *cell_num) == key;
+    *num_ids = 0;
+    if (found) {
+        *num_ids = *leaf_node_value_size(node, *cell_num) / sizeof(uint32_t);
+        memcpy(ids, leaf_node_value(node, *cell_num), *num_ids * sizeof(uint32_t));
+    }
+    table_release_leaf(index, *page_num);
+    return found;
+}
+
+bool index_has_key(Table *index, uint32_t key) {
+    uint32_t ids[INDEX_MAX_IDS];
+    uint32_t num_ids, page_num, cell_num;
+    return index_find(index, key, 0, ids, &num_ids, &page_num, &cell_num);
+}
+
+// 把 id 加入 value 的第一个没放满的单元，都放满时在最后一个单元之后新建一个。
+// 多数值只有一行，第一次下降时就按新建单元更新行数，单元已经存在时再改回去
+void index_add(Table *index, const char *value, uint32_t id) {
+    uint32_t ids[INDEX_MAX_IDS];
+    uint32_t num_ids, page_num, cell_num;
+    uint32_t key = index_hash(value);
+    int32_t delta = 1;
+    bool found;
+    while (true) {
+        found = index_find(index, key, delta, ids, &num_ids, &page_num, &cell_num);
+        if (found && delta != 0) {
+            tree_add_row_count(index, key, -delta);
+        }
+        if (!found || num_ids < INDEX_MAX_IDS) {
+            break;
+        }
+        delta = 0;
+        key++;
+    }
+    if (found) {
+        // 去掉旧单元再插入变长后的新单元，放不下时照常分裂
+        void *node = get_page(index->pager, page_num);
+        leaf_node_remove_cells(node, cell_num, 1);
+        // 放开 pin 之后其他线程可能淘汰这一页，必须先标脏
+        pager_mark_dirty(index->pager, page_num);
+        pager_unpin(index->pager, page_num);
+    } else if (delta == 0) {
+        tree_add_row_count(index, key, 1);
+    }
+
+    uint32_t pos = num_ids;
+    for (; pos > 0 && ids[pos - 1] > id; pos--) {
+        ids[pos] = ids[pos - 1];
+    }
+    ids[pos] = id;
+    num_ids++;
+
+    Cursor cursor = {index, page_num, cell_num, false};
+    leaf_node_insert_value(&cursor, key, ids, num_ids * sizeof(uint32_t));
+}
+
+// 删掉 key 的单元，路径上的行数由调用者更新
+void index_remove_cell(Table *index, uint32_t key, uint32_t page_num, uint32_t cell_num) {
+    Pager *pager = index->pager;
+    void *node = get_page(pager, page_num);
+    leaf_node_remove_cells(node, cell_num, 1);
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+    leaf_node_rebalance(index, page_num, key);
+}
+
+// 与 index_add 相同，第一次下降时就按删掉单元更新行数，猜错时再改回去
+void index_remove(Table *index, const char *value, uint32_t id) {
+    Pager *pager = index->pager;
+    uint32_t key = index_hash(value);
+    uint32_t ids[INDEX_MAX_IDS];
+    uint32_t num_ids, page_num, cell_num;
+    uint32_t pos = 0;
+    int32_t delta = -1;
+    while (true) {
+        bool found = index_find(index, key, delta, ids, &num_ids, &page_num, &cell_num);
+        pos = 0;
+        while (pos < num_ids && ids[pos] != id) {
+            pos++;
+        }
+        if (pos < num_ids) {
+            break;
+        }
+        if (delta != 0) {
+            tree_add_row_count(index, key, -delta);
+            delta = 0;
+        }
+        if (!found) {
+            return;
+        }
+        key++;
+    }
+    memmove(ids + pos, ids + pos + 1, (num_ids - pos - 1) * sizeof(uint32_t));
+    num_ids--;
+
+    // 变短的单元一定放得下原来的位置；单元空了并且后面没有单元时删掉
+    if (num_ids > 0 || index_has_key(index, key + 1)) {
+        if (delta != 0) {
+            tree_add_row_count(index, key, -delta);
+        }
+        void *node = get_page(pager, page_num);
+        leaf_node_remove_cells(node, cell_num, 1);
+        leaf_node_insert_cell(node, cell_num, key, ids, num_ids * sizeof(uint32_t));
+        pager_mark_dirty(pager, page_num);
+        pager_unpin(pager, page_num);
+        leaf_node_rebalance(index, page_num, key);
+        return;
+    }
+    if (delta == 0) {
+        tree_add_row_count(index, key, -1);
+    }
+    index_remove_cell(index, key, page_num, cell_num);
+    // 前面留着的空单元不再有用
+    while (index_find(index, --key, 0, ids, &num_ids, &page_num, &cell_num) && num_ids == 0) {
+        tree_add_row_count(index, key, -1);
+        index_remove_cell(index, key, page_num, cell_num);
+    }
+}
+
+// 释放以 page_num 为根的整棵子树
+void index_free_pages(Pager *pager, uint32_t page_num) {
+    void *node = get_page(pager, page_num);
+    if (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            index_free_pages(pager, *internal_node_child(node, i));
+        }
+    }
+    pager_unpin(pager, page_num);
+    free_page(pager, page_num);
+}
+
+void index_drop(Table *table, IndexColumn column) {
+    Pager *pager = table->pager;
+    index_free_pages(pager, table->indexes[column]->root_page_num);
+    free(table->indexes[column]);
+    table->indexes[column] = NULL;
+
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    *header_index_root(header, column) = 0;
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+// 扫描全表填充一个空索引
+void index_build(Table *table, IndexColumn column) {
+    Table *index = table->indexes[column];
+    Row row;
+    Cursor *cursor = table_start(table);
+    while (!cursor->end_of_table) {
+        cursor_read_row(cursor, &row);
+        index_add(index, row_column(&row, column), row.id);
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+}
+
+ExecuteResult execute_create_index(Statement *statement, Table *table) {
+    IndexColumn column = statement->index_column;
+    if (table->indexes[column] != NULL) {
+        return EXECUTE_INDEX_EXISTS;
+    }
+
+    Pager *pager = table->pager;
+    uint32_t root_page_num = get_unused_page_num(pager);
+    void *root = get_page(pager, root_page_num);
+    initialize_leaf_node(root);
+    set_node_root(root, true);
+    pager_mark_dirty(pager, root_page_num);
+    pager_unpin(pager, root_page_num);
+
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    *header_index_root(header, column) = root_page_num;
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+
+    table->indexes[column] = index_open(pager, root_page_num);
+    index_build(table, column);
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult table_insert(Table *table, Row *row_to_insert) {
+    Pager *pager = table->pager;
+    uint32_t key_to_insert = row_to_insert->id;
+
+    uint32_t page_num = table->last_leaf_page_num;
+    void *node = NULL;
+    uint32_t cell_num = 0;
+    if (page_num != INVALID_PAGE_NUM) {
+        node = get_page(pager, page_num);
+        if (table_can_append(node, key_to_insert)) {
+            cell_num = *leaf_node_num_cells(node);
+        } else {
+            pager_unpin(pager, page_num);
+            node = NULL;
+        }
+    }
+    if (node != NULL) {
+        // 追加时没有从根下降，单独更新最右路径上的行数
+        tree_add_row_count(table, key_to_insert, 1);
+    } else {
+        node = table_find_leaf_exclusive(table, key_to_insert, 1, &page_num);
+        cell_num = leaf_node_find_cell(node, key_to_insert);
+        // 在 key 所在的叶子节点中检查重复，而不是根节点
+        if (cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cell_num) == key_to_insert) {
+            pager_unpin(pager, page_num);
+            tree_add_row_count(table, key_to_insert, -1);
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    bool is_last_leaf = *leaf_node_next_leaf(node) == 0;
+    Cursor cursor = {table, page_num, cell_num, false};
+    leaf_node_insert(&cursor, key_to_insert, row_to_insert);
+
+    // 最右叶子分裂后新的最右叶子是它的后继；根节点分裂后该页变成中间节点，提示作废
+    if (is_last_leaf) {
+        if (get_node_type(node) != NODE_LEAF) {
+            table->last_leaf_page_num = INVALID_PAGE_NUM;
+        } else if (*leaf_node_next_leaf(node) != 0) {
+            table->last_leaf_page_num = *leaf_node_next_leaf(node);
+        } else {
+            table->last_leaf_page_num = page_num;
+        }
+    }
+    pager_unpin(pager, page_num);
+
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        if (table->indexes[i] != NULL) {
+            index_add(table->indexes[i], row_column(row_to_insert, i), key_to_insert);
+        }
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// 多行 insert 按顺序逐行插入，遇到重复 key 时停止，之前的行保留
+ExecuteResult execute_insert(Statement *statement, Table *table) {
+    for (uint32_t i = 0; i < statement->num_rows_to_insert; i++) {
+        ExecuteResult result = table_insert(table, &statement->rows_to_insert[i]);
+        if (result != EXECUTE_SUCCESS) {
+            return result;
+        }
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_delete(Statement *statement, Table *table) {
+    uint32_t key_to_delete = statement->id_to_delete;
+    uint32_t page_num;
+    void *node = table_find_leaf_exclusive(table, key_to_delete, -1, &page_num);
+    uint32_t cell_num = leaf_node_find_cell(node, key_to_delete);
+    if (cell_num == *leaf_node_num_cells(node) || *leaf_node_key(node, cell_num) != key_to_delete) {
+        pager_unpin(table->pager, page_num);
+        tree_add_row_count(table, key_to_delete, 1);
+        return EXECUTE_KEY_NOT_FOUND;
+    }
+
+    Row row;
+    leaf_node_read_row(node, cell_num, &row);
+    leaf_node_remove_cells(node, cell_num, 1);
+    pager_mark_dirty(table->pager, page_num);
+    pager_unpin(table->pager, page_num);
+    leaf_node_rebalance(table, page_num, key_to_delete);
+
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        if (table->indexes[i] != NULL) {
+            index_remove(table->indexes[i], row_column(&row, i), key_to_delete);
+        }
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// 写语句。同一时刻只有一个写语句，执行期间给访问到的页加写锁，读语句可以同时读其他页
+ExecuteResult execute_statement(Statement *statement, Table *table) {
+    ExecuteResult result;
+    if (statement->type == STATEMENT_CREATE_INDEX) {
+        // 建索引会修改 table->indexes，和所有语句互斥
+        db_begin_exclusive(table);
+        result = execute_create_index(statement, table);
+        pager_commit(table->pager);
+        db_end_exclusive(table);
+        return result;
+    }
+
+    pthread_rwlock_rdlock(&table->db_lock);
+    pthread_mutex_lock(&table->write_lock);
+    version_begin_write(&table->pager->versions);
+    latch_mode = LATCH_MODE_WRITE;
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+            result = execute_insert(statement, table);
+            break;
+        case (STATEMENT_DELETE):
+            result = execute_delete(statement, table);
+            break;
+        default:
+            result = EXECUTE_SUCCESS;
+            break;
+    }
+    latch_mode = LATCH_MODE_READ;
+    // 内存中的修改已经完整，先对新快照可见、放开页锁再写日志，读者不必等待提交的 fsync
+    version_end_write(&table->pager->versions);
+    pager_release_latches(table->pager);
+    // 每条语句是一个事务。放开 write_lock 之后再等 fdatasync，等待期间后续语句的提交可以加入同一组
+    uint64_t seq = pager_append_commit(table->pager);
+    pthread_mutex_unlock(&table->write_lock);
+    pthread_rwlock_unlock(&table->db_lock);
+    pager_wait_durable(table->pager, seq);
+    return result;
+}
+
+//
+// Embedded API
+//
+// db_prepare 解析一条语句，db_step 每次返回一行 EXECUTE_ROW，语句结束时返回最终结果，db_finalize 释放。
+// 一个 DbStatement 只能在一个线程中使用，不同线程可以同时执行各自的语句。
+// select 分批取行：按 id 范围每批读一个叶子。按单个 id 查询只在读叶子期间持有它的共享锁；
+// 其他查询第一次取行时开始一个快照，整条语句都读这个快照，期间的写语句不受影响也不会被看到。
+// 没有可用索引的按列值查询在快照中并行扫描，一次取出所有结果。
+// db_step_view 返回指向内部缓冲区的行视图，快照扫描时不复制行，视图在下一次 db_step 之前有效
+//
+struct DbStatement {
+    Table *table;
+    Statement statement;
+    PrepareResult prepare_result;
+    bool finished;
+    Row *rows;              // 当前批次的行
+    uint32_t *cells;        // 或者当前批次的行在 page 中的单元号，rows_in_page 时使用
+    bool rows_in_page;
+    uint32_t num_rows;
+    uint32_t next_row;
+    uint32_t rows_capacity;
+    uint32_t cells_capacity;
+    uint32_t next_id;       // 范围扫描下一批的起始 id
+    uint32_t num_returned;
+    uint32_t skip_rows;     // 按列值过滤时 OFFSET 只能逐行跳过，按 id 范围查询时为 0
+    uint32_t num_skipped;
+    bool has_snapshot;
+    uint64_t snapshot;
+    Table *index;           // 快照开始时已经存在的索引，没有或按 id 查询时为 NULL
+    void *page;             // 快照读的页副本
+    uint64_t start_time;    // 解析成功的时间，记录耗时后清零
+    uint32_t num_scanned;   // select 检查过的行数
+};
+
+DbStatement *db_prepare(Table *table, const char *sql, PrepareResult *result) {
+    DbStatement *stmt = calloc(1, sizeof(DbStatement));
+    stmt->table = table;
+    char *buffer = strdup(sql);
+    *result = prepare_statement(buffer, &stmt->statement);
+    stmt->prepare_result = *result;
+    free(buffer);
+    stmt->next_id = stmt->statement.select_min_id;
+    // 聚合的 limit 和 offset 作用在唯一的结果行上，同样逐行跳过
+    stmt->skip_rows = stmt->statement.select_column != NUM_INDEXES ||
+                      stmt->statement.select_aggregate != AGGREGATE_NONE ? stmt->statement.select_offset : 0;
+    if (*result == PREPARE_SUCCESS) {
+        stmt->start_time = stats_now();
+    }
+    return stmt;
+}
+
+// 语句执行完或被提前 finalize 时记录从解析到结束的耗时，select 还记录扫描和返回的行数
+void db_record_stats(DbStatement *stmt) {
+    if (stmt->start_time == 0) {
+        return;
+    }
+    stats_record((HistogramType) stmt->statement.type, stats_now() - stmt->start_time);
+    if (stmt->statement.type == STATEMENT_SELECT) {
+        stats_add(STAT_SELECTS, 1);
+        stats_add(STAT_ROWS_SCANNED, stmt->num_scanned);
+        stats_add(STAT_ROWS_RETURNED, stmt->num_returned);
+        stats_record(HIST_SELECT_ROWS, stmt->num_scanned);
+    }
+    stmt->start_time = 0;
+}
+
+void db_statement_add_row(DbStatement *stmt, Row *row) {
+    if (stmt->num_rows == stmt->rows_capacity) {
+        stmt->rows_capacity = stmt->rows_capacity == 0 ? 64 : stmt->rows_capacity * 2;
+        stmt->rows = realloc(stmt->rows, sizeof(Row) * stmt->rows_capacity);
+    }
+    stmt->rows[stmt->num_rows++] = *row;
+}
+
+void db_statement_add_cell(DbStatement *stmt, uint32_t cell_num) {
+    if (stmt->num_rows == stmt->cells_capacity) {
+        stmt->cells_capacity = stmt->cells_capacity == 0 ? 64 : stmt->cells_capacity * 2;
+        stmt->cells = realloc(stmt->cells, sizeof(uint32_t) * stmt->cells_capacity);
+    }
+    stmt->cells[stmt->num_rows++] = cell_num;
+}
+
+// 本批次的行加上已经返回和跳过的行达到了 limit（逐行跳过 OFFSET 时再加上要跳过的行数），不用再取。
+// 聚合要看完所有匹配的行
+bool db_batch_full(DbStatement *stmt) {
+    if (stmt->statement.select_aggregate != AGGREGATE_NONE) {
+        return false;
+    }
+    return (uint64_t) stmt->num_returned + stmt->num_skipped + stmt->num_rows >=
+           (uint64_t) stmt->statement.select_limit + stmt->skip_rows;
+}
+
+// like 匹配：% 匹配任意串，_ 匹配一个字符，区分大小写。
+// 遇到 % 时记下位置，之后失配就让这个 % 多吞一个字符重试，只需要回溯到最近的一个 %
+bool like_match(const char *pattern, const char *text, uint32_t length) {
+    const char *star = NULL;
+    uint32_t star_text = 0;
+    uint32_t i = 0;
+    while (i < length) {
+        if (*pattern == '%') {
+            star = ++pattern;
+            star_text = i;
+        } else if (*pattern != '\0' && (*pattern == '_' || *pattern == text[i])) {
+            pattern++;
+            i++;
+        } else if (star != NULL) {
+            pattern = star;
+            i = ++star_text;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '%') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+// 按列值过滤的条件，按 id 范围查询时总是成立
+bool row_view_matches(Statement *statement, RowView *view) {
+    if (statement->select_column == NUM_INDEXES) {
+        return true;
+    }
+    const char *field = view->fields[statement->select_column];
+    uint32_t length = view->lengths[statement->select_column];
+    if (statement->select_like) {
+        return like_match(statement->select_value, field, length);
+    }
+    return length == statement->select_value_length && memcmp(field, statement->select_value, length) == 0;
+}
+
+// 有索引时在快照中一次取出所有匹配的行：从哈希开始逐个读 key 连续的单元，直到某个 key 没有单元。
+// 哈希可能冲突，回表后还要比较列值
+void db_fetch_by_index(DbStatement *stmt) {
+    Statement *statement = &stmt->statement;
+    uint32_t ids[INDEX_MAX_IDS];
+    Row row;
+    stmt->rows_in_page = false;
+    for (uint32_t key = index_hash(statement->select_value); !db_batch_full(stmt); key++) {
+        snapshot_find_leaf(stmt->index, stmt->snapshot, key, key, stmt->page);
+        uint32_t cell_num = leaf_node_find_cell(stmt->page, key);
+        if (cell_num == *leaf_node_num_cells(stmt->page) || *leaf_node_key(stmt->page, cell_num) != key) {
+            break;
+        }
+        uint32_t num_ids = *leaf_node_value_size(stmt->page, cell_num) / sizeof(uint32_t);
+        memcpy(ids, leaf_node_value(stmt->page, cell_num), num_ids * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < num_ids && !db_batch_full(stmt); i++) {
+            snapshot_find_leaf(stmt->table, stmt->snapshot, ids[i], ids[i], stmt->page);
+            cell_num = leaf_node_find_cell(stmt->page, ids[i]);
+            if (cell_num == *leaf_node_num_cells(stmt->page) || *leaf_node_key(stmt->page, cell_num) != ids[i]) {
+                printf("index entry %d has no row.\n", ids[i]);
+                exit(EXIT_FAILURE);
+            }
+            leaf_node_read_row(stmt->page, cell_num, &row);
+            stmt->num_scanned++;
+            if (strcmp(row_column(&row, statement->select_column), statement->select_value) == 0) {
+                db_statement_add_row(stmt, &row);
+            }
+        }
+    }
+    stmt->finished = true;
+}
+
+// 从 next_id 开始读一个叶子里不超过上界的行；按列值查询但没有索引时同样逐叶扫描并比较
+void db_fetch_leaf(DbStatement *stmt) {
+    Statement *statement = &stmt->statement;
+    Table *table = stmt->table;
+    uint32_t page_num, upper_bound;
+    void *node;
+    if (stmt->has_snapshot) {
+        // 扫过第一个叶子之后才预读，带 limit 的短查询不会多读
+        uint32_t max_key = stmt->next_id == statement->select_min_id ? stmt->next_id : statement->select_max_id;
+        upper_bound = snapshot_find_leaf(table, stmt->snapshot, stmt->next_id, max_key, stmt->page);
+        node = stmt->page;
+    } else {
+        node = table_find_leaf_shared(table, stmt->next_id, &page_num, &upper_bound);
+    }
+    // 快照中的叶子副本在下一批之前不会变，只记下单元号
+    stmt->rows_in_page = stmt->has_snapshot;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    RowView view;
+    for (uint32_t i = leaf_node_find_cell(node, stmt->next_id); i < num_cells; i++) {
+        if (*leaf_node_key(node, i) > statement->select_max_id || db_batch_full(stmt)) {
+            stmt->finished = true;
+            break;
+        }
+        stmt->num_scanned++;
+        if (statement->select_column != NUM_INDEXES) {
+            leaf_node_read_view(node, i, &view);
+            if (!row_view_matches(statement, &view)) {
+                continue;
+            }
+        }
+        if (stmt->rows_in_page) {
+            db_statement_add_cell(stmt, i);
+        } else {
+            Row row;
+            leaf_node_read_row(node, i, &row);
+            db_statement_add_row(stmt, &row);
+        }
+    }
+    if (!stmt->has_snapshot) {
+        table_release_leaf(table, page_num);
+    }
+    // 叶子覆盖到 upper_bound 为止，下一批从它的后一个 id 开始
+    if (upper_bound >= statement->select_max_id) {
+        stmt->finished = true;
+    } else {
+        stmt->next_id = upper_bound + 1;
+    }
+}
+
+// 并行扫描：没有可用索引的按列值查询要扫描整个范围。按快照中中间节点的分隔 key 把范围切成分区，
+// 工作线程各自领取分区，用自己的页缓冲从根下降扫描，在本线程里比较条件。
+// 分区按 id 顺序排列，各分区的结果按顺序拼接就是有序的；聚合查询只合并计数和最值，与顺序无关
+//
+typedef struct {
+    uint32_t min_id;        // 覆盖的 id 范围 [min_id, max_id]
+    uint32_t max_id;
+    uint32_t page_num;      // 划分时对应的子树
+    Row *rows;              // 匹配的行，按 id 有序
+    uint32_t num_rows;
+    uint32_t rows_capacity;
+    uint32_t num_scanned;
+    uint32_t count;         // 聚合查询不保存行，只记匹配的行数和第一、最后一个匹配的 id
+    uint32_t first_id;
+    uint32_t last_id;
+    bool done;              // 扫描完成后原子地置位，之后其他线程可以读 num_rows
+} ScanPartition;
+
+typedef struct {
+    DbStatement *stmt;
+    ScanPartition *partitions;
+    uint32_t num_partitions;
+    uint32_t next_partition;    // 下一个待领取的分区，原子递增
+    uint64_t row_limit;         // 一个分区最多需要的行数：limit 加上逐行跳过的 OFFSET
+} ParallelScan;
+
+void scan_partition_add(ScanPartition **partitions, uint32_t *num_partitions, uint32_t *capacity,
+                        uint32_t page_num, uint64_t min_id, uint64_t max_id) {
+    if (min_id > max_id) {
+        return;
+    }
+    if (*num_partitions == *capacity) {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        *partitions = realloc(*partitions, sizeof(ScanPartition) * *capacity);
+    }
+    ScanPartition *partition = &(*partitions)[(*num_partitions)++];
+    memset(partition, 0, sizeof(ScanPartition));
+    partition->page_num = page_num;
+    partition->min_id = min_id;
+    partition->max_id = max_id;
+}
+
+// 从根开始逐层展开，直到每个线程能分到 SCAN_PARTITIONS_PER_THREAD 个分区或者已经展开到叶子。
+// 子节点覆盖 (前一个分隔 key, 自己的分隔 key]，删除后分隔 key 偏大也不影响各区间互不相交；
+// 子树行数为 0 的子节点直接跳过
+void parallel_scan_split(ParallelScan *scan) {
+    DbStatement *stmt = scan->stmt;
+    Table *table = stmt->table;
+    Statement *statement = &stmt->statement;
+    uint32_t target = table->scan_threads * SCAN_PARTITIONS_PER_THREAD;
+    uint32_t capacity = 0;
+    scan->partitions = NULL;
+    scan->num_partitions = 0;
+    scan_partition_add(&scan->partitions, &scan->num_partitions, &capacity, table->root_page_num,
+                       statement->select_min_id, statement->select_max_id);
+
+    while (scan->num_partitions > 0 && scan->num_partitions < target) {
+        ScanPartition *level = scan->partitions;
+        uint32_t level_size = scan->num_partitions;
+        scan->partitions = NULL;
+        scan->num_partitions = 0;
+        capacity = 0;
+        bool is_leaf = false;
+        for (uint32_t i = 0; i < level_size; i++) {
+            snapshot_read_page(table->pager, level[i].page_num, stmt->snapshot, stmt->page);
+            if (get_node_type(stmt->page) == NODE_LEAF) {
+                is_leaf = true;
+                break;
+            }
+            uint32_t num_keys = *internal_node_num_keys(stmt->page);
+            uint64_t lower = level[i].min_id;
+            for (uint32_t j = 0; j <= num_keys && lower <= level[i].max_id; j++) {
+                uint64_t upper = j < num_keys ? *internal_node_key(stmt->page, j) : level[i].max_id;
+                if (upper > level[i].max_id) {
+                    upper = level[i].max_id;
+                }
+                if (*internal_node_count(stmt->page, j) > 0) {
+                    scan_partition_add(&scan->partitions, &scan->num_partitions, &capacity,
+                                       *internal_node_child(stmt->page, j), lower, upper);
+                }
+                lower = upper + 1 > lower ? upper + 1 : lower;
+            }
+        }
+        // 树是平衡的，一个节点是叶子这一层就都是叶子，保留上一层的划分
+        if (is_leaf) {
+            free(scan->partitions);
+            scan->partitions = level;
+            scan->num_partitions = level_size;
+            break;
+        }
+        free(level);
+    }
+}
+
+// 带 limit 时，前面连续已完成的分区凑够了行数，后面的分区就不用再扫
+bool parallel_scan_satisfied(ParallelScan *scan, uint32_t end) {
+    Statement *statement = &scan->stmt->statement;
+    if (statement->select_limit == UINT32_MAX || statement->select_aggregate != AGGREGATE_NONE) {
+        return false;
+    }
+    uint64_t num_rows = 0;
+    for (uint32_t i = 0; i < end && __atomic_load_n(&scan->partitions[i].done, __ATOMIC_ACQUIRE); i++) {
+        num_rows += scan->partitions[i].num_rows;
+        if (num_rows >= scan->row_limit) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void parallel_scan_run_partition(ParallelScan *scan, uint32_t partition_num, void *page) {
+    DbStatement *stmt = scan->stmt;
+    Statement *statement = &stmt->statement;
+    ScanPartition *partition = &scan->partitions[partition_num];
+    bool aggregate = statement->select_aggregate != AGGREGATE_NONE;
+    uint32_t next_id = partition->min_id;
+    RowView view;
+    while (!parallel_scan_satisfied(scan, partition_num)) {
+        uint32_t upper_bound = snapshot_find_leaf(stmt->table, stmt->snapshot, next_id, partition->max_id, page);
+        uint32_t num_cells = *leaf_node_num_cells(page);
+        for (uint32_t i = leaf_node_find_cell(page, next_id); i < num_cells; i++) {
+            uint32_t id = *leaf_node_key(page, i);
+            if (id > partition->max_id) {
+                return;
+            }
+            partition->num_scanned++;
+            leaf_node_read_view(page, i, &view);
+            if (!row_view_matches(statement, &view)) {
+                continue;
+            }
+            if (aggregate) {
+                partition->first_id = partition->count == 0 ? id : partition->first_id;
+                partition->last_id = id;
+                partition->count++;
+                continue;
+            }
+            if (partition->num_rows == partition->rows_capacity) {
+                partition->rows_capacity = partition->rows_capacity == 0 ? 64 : partition->rows_capacity * 2;
+                partition->rows = realloc(partition->rows, sizeof(Row) * partition->rows_capacity);
+            }
+            row_from_view(&view, &partition->rows[partition->num_rows++]);
+            if (partition->num_rows >= scan->row_limit) {
+                return;
+            }
+        }
+        if (upper_bound >= partition->max_id) {
+            return;
+        }
+        next_id = upper_bound + 1;
+    }
+}
+
+void *parallel_scan_worker(void *arg) {
+    ParallelScan *scan = arg;
+    void *page = malloc(PAGE_SIZE);
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&scan->next_partition, 1, __ATOMIC_RELAXED);
+        if (i >= scan->num_partitions) {
+            break;
+        }
+        parallel_scan_run_partition(scan, i, page);
+        __atomic_store_n(&scan->partitions[i].done, true, __ATOMIC_RELEASE);
+    }
+    free(page);
+    return NULL;
+}
+
+// 在语句的快照中并行扫描整个范围，调用线程也参与。调用前持有 db_lock，工作线程不必再加
+void parallel_scan_run(DbStatement *stmt, ParallelScan *scan) {
+    Statement *statement = &stmt->statement;
+    scan->stmt = stmt;
+    scan->next_partition = 0;
+    scan->row_limit = (uint64_t) statement->select_limit + stmt->skip_rows;
+    parallel_scan_split(scan);
+
+    uint32_t num_threads = stmt->table->scan_threads < scan->num_partitions ? stmt->table->scan_threads
+                                                                            : scan->num_partitions;
+    pthread_t threads[MAX_SCAN_THREADS];
+    uint32_t num_started = 0;
+    // 线程创建失败时由已经启动的线程领取剩下的分区
+    while (num_started + 1 < num_threads &&
+           pthread_create(&threads[num_started], NULL, parallel_scan_worker, scan) == 0) {
+        num_started++;
+    }
+    parallel_scan_worker(scan);
+    for (uint32_t i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (uint32_t i = 0; i < scan->num_partitions; i++) {
+        stmt->num_scanned += scan->partitions[i].num_scanned;
+    }
+}
+
+void parallel_scan_free(ParallelScan *scan) {
+    for (uint32_t i = 0; i < scan->num_partitions; i++) {
+        free(scan->partitions[i].rows);
+    }
+    free(scan->partitions);
+}
+
+// 按分区顺序拼接各分区的结果，语句一次取完
+void db_fetch_parallel(DbStatement *stmt) {
+    ParallelScan scan;
+    parallel_scan_run(stmt, &scan);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < scan.num_partitions; i++) {
+        total += scan.partitions[i].num_rows;
+    }
+    if (total > scan.row_limit) {
+        total = scan.row_limit;
+    }
+    if (total > stmt->rows_capacity) {
+        stmt->rows_capacity = total;
+        stmt->rows = realloc(stmt->rows, sizeof(Row) * total);
+    }
+    for (uint32_t i = 0; i < scan.num_partitions && stmt->num_rows < total; i++) {
+        uint32_t num_rows = scan.partitions[i].num_rows;
+        if (num_rows > total - stmt->num_rows) {
+            num_rows = total - stmt->num_rows;
+        }
+        memcpy(stmt->rows + stmt->num_rows, scan.partitions[i].rows, sizeof(Row) * num_rows);
+        stmt->num_rows += num_rows;
+    }
+    parallel_scan_free(&scan);
+    stmt->rows_in_page = false;
+    stmt->finished = true;
+}
+
+// 按列值过滤但没有可用的索引（或者是 like）时并行扫描，单线程配置下仍然逐叶流式返回
+bool db_use_parallel(DbStatement *stmt) {
+    return stmt->statement.select_column != NUM_INDEXES && stmt->index == NULL && stmt->table->scan_threads > 1;
+}
+
+
+// 按 id 范围查询的 OFFSET：用子树行数求出范围起点的名次，直接定位到跳过之后的第一行
+void db_seek_offset(DbStatement *stmt) {
+    Statement *statement = &stmt->statement;
+    uint64_t rank = (uint64_t) snapshot_rank(stmt->table, stmt->snapshot, statement->select_min_id, stmt->page) +
+                    statement->select_offset;
+    uint32_t key;
+    if (rank > UINT32_MAX || !snapshot_select_rank(stmt->table, stmt->snapshot, rank, &key, stmt->page) ||
+        key > statement->select_max_id) {
+        stmt->finished = true;
+    } else {
+        stmt->next_id = key;
+    }
+}
+
+// 按 id 范围的聚合只沿一两条根到叶子的路径读页；按列值过滤时照常取出匹配的行再聚合，并行扫描时只合并各分区的计数和首尾 id
+void db_fetch_aggregate(DbStatement *stmt) {
+    Statement *statement = &stmt->statement;
+    Table *table = stmt->table;
+    uint32_t count = 0;
+    uint32_t min_id = 0;
+    uint32_t max_id = 0;
+    if (statement->select_column == NUM_INDEXES) {
+        uint32_t lower = snapshot_rank(table, stmt->snapshot, statement->select_min_id, stmt->page);
+        uint32_t upper = snapshot_rank_upper(table, stmt->snapshot, statement->select_max_id, stmt->page);
+        if (upper > lower) {
+            count = upper - lower;
+            if (statement->select_aggregate == AGGREGATE_MIN) {
+                snapshot_select_rank(table, stmt->snapshot, lower, &min_id, stmt->page);
+            } else if (statement->select_aggregate == AGGREGATE_MAX) {
+                snapshot_select_rank(table, stmt->snapshot, upper - 1, &max_id, stmt->page);
+            }
+        }
+    } else if (db_use_parallel(stmt)) {
+        ParallelScan scan;
+        parallel_scan_run(stmt, &scan);
+        for (uint32_t i = 0; i < scan.num_partitions; i++) {
+            ScanPartition *partition = &scan.partitions[i];
+            if (partition->count > 0) {
+                min_id = count == 0 ? partition->first_id : min_id;
+                max_id = partition->last_id;
+                count += partition->count;
+            }
+        }
+        parallel_scan_free(&scan);
+    } else {
+        while (!stmt->finished) {
+            stmt->num_rows = 0;
+            if (stmt->index != NULL) {
+                db_fetch_by_index(stmt);
+            } else {
+                db_fetch_leaf(stmt);
+            }
+            for (uint32_t i = 0; i < stmt->num_rows; i++) {
+                uint32_t id = stmt->rows_in_page ? *leaf_node_key(stmt->page, stmt->cells[i]) : stmt->rows[i].id;
+                min_id = count == 0 || id < min_id ? id : min_id;
+                max_id = count == 0 || id > max_id ? id : max_id;
+                count++;
+            }
+        }
+    }
+
+    stmt->num_rows = 0;
+    stmt->rows_in_page = false;
+    stmt->finished = true;
+    // 空范围的 min 和 max 没有结果行
+    if (statement->select_aggregate == AGGREGATE_COUNT || count > 0) {
+        Row row = {0};
+        row.id = statement->select_aggregate == AGGREGATE_COUNT ? count :
+                 statement->select_aggregate == AGGREGATE_MIN ? min_id : max_id;
+        db_statement_add_row(stmt, &row);
+    }
+}
+
+void db_begin_snapshot(DbStatement *stmt) {
+    Statement *statement = &stmt->statement;
+    Table *table = stmt->table;
+    stmt->snapshot = version_begin_snapshot(&table->pager->versions);
+    stmt->has_snapshot = true;
+    // 索引按列值的哈希组织，like 用不上
+    stmt->index = statement->select_column != NUM_INDEXES && !statement->select_like ?
+                  table->indexes[statement->select_column] : NULL;
+    stmt->page = malloc(PAGE_SIZE);
+}
+
+// 尽早结束快照，让写语句不再为它保存页版本。page 中可能还有没返回的行，到 db_finalize 时再释放
+void db_end_snapshot(DbStatement *stmt) {
+    if (stmt->has_snapshot) {
+        version_end_snapshot(&stmt->table->pager->versions, stmt->snapshot);
+        stmt->has_snapshot = false;
+    }
+}
+
+ExecuteResult db_step_view(DbStatement *stmt, RowView *view) {
+    Statement *statement = &stmt->statement;
+    // 解析失败的语句可能只填了一半
+    if (stmt->prepare_result != PREPARE_SUCCESS) {
+        return EXECUTE_NOT_PREPARED;
+    }
+    if (statement->type != STATEMENT_SELECT) {
+        if (stmt->finished) {
+            return EXECUTE_SUCCESS;
+        }
+        stmt->finished = true;
+        ExecuteResult result = execute_statement(statement, stmt->table);
+        db_record_stats(stmt);
+        return result;
+    }
+
+    while (stmt->next_row == stmt->num_rows || stmt->num_skipped < stmt->skip_rows) {
+        if (stmt->next_row < stmt->num_rows) {
+            stmt->next_row++;
+            stmt->num_skipped++;
+            continue;
+        }
+        if (stmt->finished || stmt->num_returned == statement->select_limit) {
+            db_record_stats(stmt);
+            return EXECUTE_SUCCESS;
+        }
+        stmt->num_rows = 0;
+        stmt->next_row = 0;
+        Table *table = stmt->table;
+        pthread_rwlock_rdlock(&table->db_lock);
+        bool point_lookup = statement->select_column == NUM_INDEXES &&
+                            statement->select_min_id == statement->select_max_id &&
+                            statement->select_offset == 0 && statement->select_aggregate == AGGREGATE_NONE;
+        if (!stmt->has_snapshot && stmt->page == NULL && !point_lookup) {
+            db_begin_snapshot(stmt);
+            if (statement->select_offset > 0 && statement->select_column == NUM_INDEXES &&
+                statement->select_aggregate == AGGREGATE_NONE) {
+                db_seek_offset(stmt);
+            }
+        }
+        if (statement->select_aggregate != AGGREGATE_NONE) {
+            db_fetch_aggregate(stmt);
+        } else if (stmt->index != NULL) {
+            db_fetch_by_index(stmt);
+        } else if (db_use_parallel(stmt)) {
+            db_fetch_parallel(stmt);
+        } else if (!stmt->finished) { // OFFSET 可能已经越过了范围
+            db_fetch_leaf(stmt);
+        }
+        pthread_rwlock_unlock(&table->db_lock);
+        if (stmt->finished) {
+            db_end_snapshot(stmt);
+        }
+    }
+    uint32_t i = stmt->next_row++;
+    if (stmt->rows_in_page) {
+        leaf_node_read_view(stmt->page, stmt->cells[i], view);
+    } else {
+        row_view_from_row(&stmt->rows[i], view);
+    }
+    stmt->num_returned++;
+    return EXECUTE_ROW;
+}
+
+ExecuteResult db_step(DbStatement *stmt, Row *row) {
+    RowView view;
+    ExecuteResult result = db_step_view(stmt, &view);
+    if (result == EXECUTE_ROW) {
+        row_from_view(&view, row);
+    }
+    return result;
+}
+
+void db_finalize(DbStatement *stmt) {
+    db_record_stats(stmt);
+    db_end_snapshot(stmt);
+    free(stmt->statement.rows_to_insert);
+    free(stmt->rows);
+    free(stmt->cells);
+    free(stmt->page);
+    free(stmt);
+}
+
+//
+// Bulk Load
+//
+// 输入每行 "id,username,email"。已按 id 排好序时直接流式构建，
+// 否则先分段排序写入临时文件，再多路归并成一个有序临时文件。
+// 空表自底向上构建：按填充因子顺序写满叶子，再逐层生成中间节点。
+//
+#define SORT_RUN_ROWS 65536     // 外部排序每段在内存中排序的行数
+#define BULK_FLUSH_PAGES 1024   // 每生成这么多页刷一次脏页，连续的页合并成顺序写
+
+typedef struct {
+    FILE *file;
+    bool is_csv;        // true 读 CSV 文本，false 读排好序的 Row 二进制临时文件
+    uint64_t line_num;
+    char *line;
+    size_t line_capacity;
+} RowReader;
+
+PrepareResult parse_row(char *id, char *username, char *email, Row *row);
+
+// 读下一行，结束时返回 PREPARE_UNRECOGNIZED_STATEMENT
+PrepareResult row_reader_next(RowReader *reader, Row *row) {
+    if (!reader->is_csv) {
+        return fread(row, sizeof(Row), 1, reader->file) == 1 ? PREPARE_SUCCESS : PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+
+    ssize_t length;
+    while ((length = getline(&reader->line, &reader->line_capacity, reader->file)) > 0) {
+        reader->line_num++;
+        while (length > 0 && (reader->line[length - 1] == '\n' || reader->line[length - 1] == '\r')) {
+            reader->line[--length] = 0;
+        }
+        if (length == 0) {
+            continue;
+        }
+        char *id = strtok(reader->line, ",");
+        char *username = strtok(NULL, ",");
+        char *email = strtok(NULL, ",");
+        return parse_row(id, username, email, row);
+    }
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+int compare_row_id(const void *a, const void *b) {
+    uint32_t left = ((Row *) a)->id;
+    uint32_t right = ((Row *) b)->id;
+    return (left > right) - (left < right);
+}
+
+typedef struct {
+    uint32_t page_num;
+    uint32_t max_key;
+    uint32_t row_count;
+} BulkNode;
+
+typedef struct {
+    Table *table;
+    double fill_factor;
+    BulkNode *nodes;            // 当前层已经写出的节点，从叶子层开始逐层向上
+    uint64_t num_nodes;
+    uint64_t nodes_capacity;
+    void *leaves[2];            // 内存中的最后两个叶子，最后一个不满时可以和前一个合并或重新分配
+    uint32_t num_leaves;
+    uint32_t leaf_fill_space;
+    uint32_t pages_since_flush;
+    bool flush_dirty;           // 每 BULK_FLUSH_PAGES 页刷一次脏页，WAL 模式下的 .vacuum 关掉它，整个重建是一次提交
+} BulkLoader;
+
+// 条目平均分到各节点；节点数按填充因子计算，但每个节点不少于 min_items
+uint64_t bulk_num_nodes(uint64_t num_items, uint32_t fill, uint32_t min_items) {
+    uint64_t num_nodes = (num_items + fill - 1) / fill;
+    if (num_nodes > 1 && num_items / num_nodes < min_items) {
+        num_nodes = num_items / min_items;
+    }
+    return num_nodes > 0 ? num_nodes : 1;
+}
+
+void bulk_loader_init(BulkLoader *loader, Table *table, double fill_factor) {
+    loader->table = table;
+    loader->fill_factor = fill_factor;
+    loader->nodes = NULL;
+    loader->num_nodes = 0;
+    loader->nodes_capacity = 0;
+    loader->leaves[0] = malloc(PAGE_SIZE);
+    loader->leaves[1] = malloc(PAGE_SIZE);
+    initialize_leaf_node(loader->leaves[0]);
+    loader->num_leaves = 1;
+    // 叶子至少填到一半，保证最后一个叶子和前一个重新分配后两边都不低于下限
+    loader->leaf_fill_space = (uint32_t) (LEAF_NODE_SPACE_FOR_CELLS * fill_factor);
+    if (loader->leaf_fill_space < LEAF_NODE_SPACE_FOR_CELLS / 2) {
+        loader->leaf_fill_space = LEAF_NODE_SPACE_FOR_CELLS / 2;
+    }
+    loader->pages_since_flush = 0;
+    loader->flush_dirty = true;
+}
+
+// 分配一个新页，每生成 BULK_FLUSH_PAGES 页刷一次脏页
+uint32_t bulk_new_page(BulkLoader *loader) {
+    Pager *pager = loader->table->pager;
+    if (loader->flush_dirty && ++loader->pages_since_flush >= BULK_FLUSH_PAGES) {
+        pager_flush_dirty(pager);
+        loader->pages_since_flush = 0;
+    }
+    return get_unused_page_num(pager);
+}
+
+void bulk_push_node(BulkLoader *loader, uint32_t page_num, uint32_t max_key, uint32_t row_count) {
+    if (loader->num_nodes == loader->nodes_capacity) {
+        loader->nodes_capacity = loader->nodes_capacity == 0 ? 64 : loader->nodes_capacity * 2;
+        loader->nodes = realloc(loader->nodes, sizeof(BulkNode) * loader->nodes_capacity);
+    }
+    loader->nodes[loader->num_nodes].page_num = page_num;
+    loader->nodes[loader->num_nodes].max_key = max_key;
+    loader->nodes[loader->num_nodes].row_count = row_count;
+    loader->num_nodes++;
+}
+
+// 把内存中的叶子写到新页，并接到上一个叶子后面
+void bulk_write_leaf(BulkLoader *loader, void *leaf) {
+    Pager *pager = loader->table->pager;
+    uint32_t page_num = bulk_new_page(loader);
+    void *node = get_page(pager, page_num);
+    memcpy(node, leaf, PAGE_SIZE);
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+
+    if (loader->num_nodes > 0) {
+        uint32_t prev_page_num = loader->nodes[loader->num_nodes - 1].page_num;
+        void *prev = get_page(pager, prev_page_num);
+        *leaf_node_next_leaf(prev) = page_num;
+        pager_mark_dirty(pager, prev_page_num);
+        pager_unpin(pager, prev_page_num);
+    }
+    bulk_push_node(loader, page_num, *leaf_node_key(leaf, *leaf_node_num_cells(leaf) - 1), *leaf_node_num_cells(leaf));
+}
+
+// 按 key 递增的顺序追加一个单元
+void bulk_add_cell(BulkLoader *loader, uint32_t key, void *value, uint32_t size) {
+    void *leaf = loader->leaves[loader->num_leaves - 1];
+    uint32_t num_cells = *leaf_node_num_cells(leaf);
+    if (num_cells > 0 && leaf_node_used_space(leaf) + LEAF_NODE_SLOT_SIZE + size > loader->leaf_fill_space) {
+        // 当前叶子已满：更早的那个写出，当前叶子变成前一个，再开始一个新叶子
+        if (loader->num_leaves == 2) {
+            void *written = loader->leaves[0];
+            bulk_write_leaf(loader, written);
+            loader->leaves[0] = loader->leaves[1];
+            loader->leaves[1] = written;
+        }
+        loader->num_leaves = 2;
+        leaf = loader->leaves[1];
+        initialize_leaf_node(leaf);
+        num_cells = 0;
+    }
+    leaf_node_insert_cell(leaf, num_cells, key, value, size);
+}
+
+void bulk_add_row(BulkLoader *loader, Row *row) {
+    uint8_t data[ROW_MAX_SIZE];
+    uint32_t size = serialize_row(row, data);
+    bulk_add_cell(loader, row->id, data, size);
+}
+
+// 中间层：把当前层的节点按填充因子平均分给上一层，直到只剩一个节点，它写到固定的根页
+void bulk_build_internal_levels(BulkLoader *loader) {
+    Pager *pager = loader->table->pager;
+    uint32_t internal_fill = (uint32_t) (INTERNAL_NODE_MAX_CELLS * loader->fill_factor) + 1;
+    if (internal_fill < 2) {
+        internal_fill = 2;
+    }
+
+    while (loader->num_nodes > 1) {
+        BulkNode *children = loader->nodes;
+        uint64_t num_children = loader->num_nodes;
+        uint64_t num_parents = bulk_num_nodes(num_children, internal_fill, INTERNAL_NODE_MIN_CELLS + 1);
+        loader->nodes = NULL;
+        loader->num_nodes = 0;
+        loader->nodes_capacity = 0;
+
+        uint64_t next_child = 0;
+        for (uint64_t i = 0; i < num_parents; i++) {
+            uint64_t count = num_children / num_parents + (i < num_children % num_parents ? 1 : 0);
+            bool is_root = num_parents == 1;
+            uint32_t page_num = is_root ? loader->table->root_page_num : bulk_new_page(loader);
+            void *node = get_page(pager, page_num);
+            initialize_internal_node(node);
+            set_node_root(node, is_root);
+            for (uint64_t j = 0; j < count; j++) {
+                BulkNode *child = &children[next_child++];
+                if (j + 1 < count) {
+                    *internal_node_cell(node, j) = child->page_num;
+                    *internal_node_key(node, j) = child->max_key;
+                    *internal_node_cell_count(node, j) = child->row_count;
+                } else {
+                    *internal_node_right_child(node) = child->page_num;
+                    *internal_node_right_count(node) = child->row_count;
+                }
+                set_node_parent(pager, child->page_num, page_num);
+            }
+            *internal_node_num_keys(node) = count - 1;
+            uint32_t row_count = node_row_count(node);
+            pager_mark_dirty(pager, page_num);
+            pager_unpin(pager, page_num);
+            bulk_push_node(loader, page_num, children[next_child - 1].max_key, row_count);
+        }
+        free(children);
+    }
+}
+
+void bulk_loader_finish(BulkLoader *loader) {
+    Pager *pager = loader->table->pager;
+    void *last = loader->leaves[loader->num_leaves - 1];
+    if (loader->num_leaves == 2 && leaf_node_used_space(last) < LEAF_NODE_MIN_SPACE) {
+        // 最后一个叶子不满：放得下就并入前一个，否则两者重新分配
+        void *prev = loader->leaves[0];
+        if (leaf_node_used_space(prev) + leaf_node_used_space(last) <= LEAF_NODE_SPACE_FOR_CELLS) {
+            leaf_node_merge(prev, last);
+            loader->num_leaves = 1;
+        } else {
+            leaf_node_redistribute(prev, last);
+        }
+    }
+
+    if (loader->num_nodes == 0 && loader->num_leaves == 1) {
+        // 只有一个叶子：直接写到根页
+        if (*leaf_node_num_cells(loader->leaves[0]) > 0) {
+            void *root = get_page(pager, loader->table->root_page_num);
+            memcpy(root, loader->leaves[0], PAGE_SIZE);
+            set_node_root(root, true);
+            pager_mark_dirty(pager, loader->table->root_page_num);
+            pager_unpin(pager, loader->table->root_page_num);
+        }
+    } else {
+        for (uint32_t i = 0; i < loader->num_leaves; i++) {
+            bulk_write_leaf(loader, loader->leaves[i]);
+        }
+        bulk_build_internal_levels(loader);
+    }
+
+    free(loader->nodes);
+    free(loader->leaves[0]);
+    free(loader->leaves[1]);
+}
+
+// 把有序输入写入空表，重复的 id 只保留第一行
+uint64_t bulk_load(Table *table, RowReader *reader, double fill_factor) {
+    BulkLoader loader;
+    bulk_loader_init(&loader, table, fill_factor);
+
+    Row row;
+    uint64_t num_loaded = 0;
+    uint32_t last_id = 0;
+    while (row_reader_next(reader, &row) == PREPARE_SUCCESS) {
+        if (num_loaded > 0 && row.id == last_id) {
+            continue;
+        }
+        bulk_add_row(&loader, &row);
+        last_id = row.id;
+        num_loaded++;
+    }
+    bulk_loader_finish(&loader);
+    return num_loaded;
+}
+
+// 最小堆下沉，堆中存放段号，按各段当前行的 id 排序
+void run_heap_sift_down(uint32_t *heap, uint32_t heap_size, Row *heads, uint32_t pos) {
+    while (pos * 2 + 1 < heap_size) {
+        uint32_t child = pos * 2 + 1;
+        if (child + 1 < heap_size && heads[heap[child + 1]].id < heads[heap[child]].id) {
+            child++;
+        }
+        if (heads[heap[pos]].id <= heads[heap[child]].id) {
+            break;
+        }
+        uint32_t tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
+}
+
+// 把各段有序临时文件多路归并成一个去重后的有序临时文件
+void merge_sorted_runs(FILE **runs, uint32_t num_runs, FILE *output) {
+    Row *heads = malloc(sizeof(Row) * num_runs);
+    uint32_t *heap = malloc(sizeof(uint32_t) * num_runs);
+    uint32_t heap_size = 0;
+    for (uint32_t i = 0; i < num_runs; i++) {
+        rewind(runs[i]);
+        if (fread(&heads[i], sizeof(Row), 1, runs[i]) == 1) {
+            heap[heap_size++] = i;
+        }
+    }
+    for (int64_t pos = (int64_t) heap_size / 2 - 1; pos >= 0; pos--) {
+        run_heap_sift_down(heap, heap_size, heads, pos);
+    }
+
+    uint64_t num_rows = 0;
+    uint32_t last_id = 0;
+    while (heap_size > 0) {
+        uint32_t run = heap[0];
+        if (num_rows == 0 || heads[run].id != last_id) {
+            fwrite(&heads[run], sizeof(Row), 1, output);
+            last_id = heads[run].id;
+            num_rows++;
+        }
+        if (fread(&heads[run], sizeof(Row), 1, runs[run]) != 1) {
+            heap[0] = heap[--heap_size];
+        }
+        run_heap_sift_down(heap, heap_size, heads, 0);
+    }
+
+    free(heap);
+    free(heads);
+}
+
+bool table_is_empty(Table *table) {
+    void *root = get_page(table->pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    pager_unpin(table->pager, table->root_page_num);
+    return empty;
+}
+
+// .import 和 --import 的实现，成功返回 true
+bool table_import(Table *table, const char *filename, double fill_factor) {
+    RowReader reader = {fopen(filename, "r"), true, 0, NULL, 0};
+    if (reader.file == NULL) {
+        printf("unable to open '%s'.\n", filename);
+        return false;
+    }
+    if (fill_factor <= 0 || fill_factor > 1) {
+        fill_factor = DEFAULT_FILL_FACTOR;
+    }
+
+    // 第一遍：校验每一行，统计行数并判断是否已经有序；无序时顺便生成有序段
+    Row *run = malloc(sizeof(Row) * SORT_RUN_ROWS);
+    FILE **runs = NULL;
+    uint32_t num_runs = 0;
+    uint32_t run_length = 0;
+    uint64_t num_input_rows = 0;
+    uint32_t last_id = 0;
+    bool sorted = true;
+    Row row;
+    PrepareResult result;
+    while ((result = row_reader_next(&reader, &row)) == PREPARE_SUCCESS) {
+        if (num_input_rows > 0 && row.id < last_id) {
+            sorted = false;
+        }
+        last_id = row.id;
+        if (run_length == SORT_RUN_ROWS) {
+            qsort(run, run_length, sizeof(Row), compare_row_id);
+            runs = realloc(runs, sizeof(FILE *) * (num_runs + 1));
+            runs[num_runs] = tmpfile();
+            fwrite(run, sizeof(Row), run_length, runs[num_runs++]);
+            run_length = 0;
+        }
+        run[run_length++] = row;
+        num_input_rows++;
+    }
+    if (result != PREPARE_UNRECOGNIZED_STATEMENT) {
+        printf("syntax error on line %llu of '%s'.\n", (unsigned long long) reader.line_num, filename);
+        for (uint32_t i = 0; i < num_runs; i++) {
+            fclose(runs[i]);
+        }
+        free(runs);
+        free(run);
+        free(reader.line);
+        fclose(reader.file);
+        return false;
+    }
+
+    // 第二步：准备有序输入。已有序时重新读一遍 CSV，否则排序/归并到临时文件
+    FILE *sorted_file = NULL;
+    if (sorted) {
+        rewind(reader.file);
+        reader.line_num = 0;
+    } else {
+        qsort(run, run_length, sizeof(Row), compare_row_id);
+        runs = realloc(runs, sizeof(FILE *) * (num_runs + 1));
+        runs[num_runs] = tmpfile();
+        fwrite(run, sizeof(Row), run_length, runs[num_runs++]);
+        sorted_file = tmpfile();
+        merge_sorted_runs(runs, num_runs, sorted_file);
+        rewind(sorted_file);
+        reader.is_csv = false;
+        reader.file = sorted_file;
+    }
+    for (uint32_t i = 0; i < num_runs; i++) {
+        fclose(runs[i]);
+    }
+    free(runs);
+    free(run);
+
+    // 第三步：空表自底向上构建，非空表按 id 顺序逐行插入
+    uint64_t num_loaded = 0;
+    if (table_is_empty(table)) {
+        num_loaded = bulk_load(table, &reader, fill_factor);
+        // 索引最后统一扫描一遍建立
+        for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+            if (table->indexes[i] != NULL) {
+                index_build(table, i);
+            }
+        }
+    } else {
+        while (row_reader_next(&reader, &row) == PREPARE_SUCCESS) {
+            if (table_insert(table, &row) == EXECUTE_SUCCESS) {
+                num_loaded++;
+            }
+        }
+    }
+    pager_commit(table->pager);
+
+    if (sorted_file != NULL) {
+        fclose(sorted_file);
+        reader.file = NULL;
+    }
+    if (reader.file != NULL) {
+        fclose(reader.file);
+    }
+    free(reader.line);
+
+    printf("imported %llu rows", (unsigned long long) num_loaded);
+    if (num_loaded < num_input_rows) {
+        printf(", skipped %llu duplicate ids", (unsigned long long) (num_input_rows - num_loaded));
+    }
+    printf(".\n");
+    return true;
+}
+
+//
+// Vacuum
+//
+// 随机插入和分裂之后，链表中相邻的叶子散落在文件各处，顺序扫描变成随机读，分裂留下的半空叶子也浪费空间。
+// .vacuum [fill_factor] 独占数据库重建整个文件：先把主表和各索引的单元按 key 顺序导出到临时文件，
+// 再从第 2 页起按页号顺序分配，用批量构建写出每棵树（叶子按链表顺序连续存放、按填充因子装满），最后截掉文件尾部。
+// 重建期间 num_pages 保持原值，覆盖旧页时照常为活跃快照保存版本；WAL 模式下整个重建是一次提交。
+//
+// .vacuum incremental 在后台线程中分步整理，每步只独占数据库很短的时间：把主表链表中接下来的叶子依次搬到
+// 文件前部的连续页上（原来占着目标页的节点搬到空闲页或文件末尾），全部就位后把文件末尾的节点搬进空闲页并截断。
+// 它只移动页，不重新装填叶子
+//
+#define VACUUM_STEP_PAGES 64        // 后台整理每步最多搬动的页数
+#define VACUUM_STEP_INTERVAL_MS 10  // 两步之间让出数据库的时间
+
+typedef struct Vacuum {
+    Table *table;
+    pthread_t thread;
+    bool stop;                  // 由 vacuum_stop 设置
+    bool done;                  // 后台线程已经结束
+    uint32_t next_page;         // 下一个叶子要放到的页
+    uint32_t last_key;          // 已就位的叶子中最大的 key
+    bool has_last_key;          // 还没有叶子就位时为 false，从最左的叶子开始
+    bool leaves_placed;         // 主表的叶子已经全部就位，开始截断
+    uint64_t pages_moved;
+} Vacuum;
+
+// 把一棵树的单元按 key 顺序写到临时文件：4 字节 key、2 字节长度、值
+FILE *vacuum_dump_tree(Pager *pager, uint32_t root_page_num) {
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        printf("error creating temporary file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t page_num = root_page_num;
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_page_num = *internal_node_child(node, 0);
+        pager_unpin(pager, page_num);
+        page_num = child_page_num;
+        node = get_page(pager, page_num);
+    }
+    while (true) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        for (uint32_t i = 0; i < num_cells; i++) {
+            uint16_t size = *leaf_node_value_size(node, i);
+            fwrite(leaf_node_key(node, i), sizeof(uint32_t), 1, file);
+            fwrite(&size, sizeof(size), 1, file);
+            fwrite(leaf_node_value(node, i), size, 1, file);
+        }
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        pager_unpin(pager, page_num);
+        if (next_page_num == 0) {
+            break;
         }
-        pager_flush(pager, i);
-        pager->pages[i] = NULL;
-        free(pager->pages[i]);
+        page_num = next_page_num;
+        node = get_page(pager, page_num);
     }
-
-    int result = close(pager->file_descriptor);
-    if (result == -1) {
-        printf("error closing db file.\n");
+    if (fflush(file) != 0) {
+        printf("error writing temporary file: %d\n", errno);
         exit(EXIT_FAILURE);
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void *page = pager->pages[i];
-        if (page) {
-            pager->pages[i] = NULL;
-            free(page);
+    rewind(file);
+    return file;
+}
+
+// 把导出的单元写成一棵新树，根页不变，其余页由 get_unused_page_num 分配
+void vacuum_load_tree(Table *tree, FILE *file, double fill_factor) {
+    Pager *pager = tree->pager;
+    void *root = get_page(pager, tree->root_page_num);
+    initialize_leaf_node(root);
+    set_node_root(root, true);
+    pager_mark_dirty(pager, tree->root_page_num);
+    pager_unpin(pager, tree->root_page_num);
+    tree->last_leaf_page_num = INVALID_PAGE_NUM;
+
+    BulkLoader loader;
+    bulk_loader_init(&loader, tree, fill_factor);
+    loader.flush_dirty = pager->wal == NULL;
+    uint32_t key;
+    uint16_t size;
+    uint8_t value[ROW_MAX_SIZE];
+    while (fread(&key, sizeof(key), 1, file) == 1 && fread(&size, sizeof(size), 1, file) == 1) {
+        if (size > sizeof(value) || (size > 0 && fread(value, size, 1, file) != 1)) {
+            printf("error reading temporary file.\n");
+            exit(EXIT_FAILURE);
         }
+        bulk_add_cell(&loader, key, value, size);
     }
+    bulk_loader_finish(&loader);
+    fclose(file);
+}
 
-    free(pager);
-    free(table);
+// 把逻辑上的页数降到 num_pages：丢掉缓存中更靠后的页（包括没写回的脏页，它们的内容已经作废）。调用者独占数据库
+void pager_truncate(Pager *pager, uint32_t num_pages) {
+    // 活跃快照可能还要读这些页，先让 get_page 为它们保存版本
+    pthread_mutex_lock(&pager->versions.lock);
+    bool has_snapshots = pager->versions.num_snapshots > 0;
+    pthread_mutex_unlock(&pager->versions.lock);
+    for (uint32_t page_num = num_pages; has_snapshots && page_num < pager->num_pages; page_num++) {
+        get_page(pager, page_num);
+        pager_unpin(pager, page_num);
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    for (uint32_t i = 0; i < pager->num_used_frames; i++) {
+        Frame *frame = &pager->frames[i];
+        // 异步预读可能还在读这一页
+        while (frame->page_num != INVALID_PAGE_NUM && frame->page_num >= num_pages && frame->loading) {
+            pthread_cond_wait(&pager->loaded, &pager->lock);
+        }
+        if (frame->page_num != INVALID_PAGE_NUM && frame->page_num >= num_pages) {
+            page_table_remove(pager, frame->page_num);
+            frame->page_num = INVALID_PAGE_NUM;
+            frame->dirty = false;
+            frame->referenced = false;
+        }
+    }
+    if (num_pages < pager->num_pages) {
+        pager->num_pages = num_pages;
+    }
+    pthread_mutex_unlock(&pager->lock);
 }
 
-// cursor_value 计算游标指示的数据位置
-void *cursor_value(Cursor *cursor) {
-    void *page = get_page(cursor->table->pager, cursor->page_num);
-    return leaf_node_value(page, cursor->cell_num);
+// 提交并写回主文件，再把文件截到 num_pages 页。先写回是因为日志中旧的帧会在 checkpoint 时写到被截掉的位置
+void pager_truncate_file(Pager *pager) {
+    pager_flush_dirty(pager);
+    if (stats_fdatasync(pager->file_descriptor) == -1) {
+        printf("error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    off_t length = (off_t) pager->num_pages * PAGE_SIZE;
+    if (pager->use_mmap) {
+        // 映射按块扩展，只截到块边界，截掉的部分换回不可访问的预留地址空间
+        length = ((off_t) pager->num_pages + MMAP_CHUNK_PAGES - 1) / MMAP_CHUNK_PAGES * MMAP_CHUNK_PAGES * PAGE_SIZE;
+        if (length >= pager->map_length) {
+            return;
+        }
+        if (mmap(pager->map + length, pager->map_length - length, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            printf("error unmapping db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->map_length = length;
+    }
+    if (length >= pager->file_length) {
+        return;
+    }
+    if (ftruncate(pager->file_descriptor, length) == -1) {
+        printf("error truncating db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->file_length = length;
 }
 
-void cursor_advance(Cursor *cursor) {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0) {
-            cursor->end_of_table = true;
-        } else {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
+// 调用者独占数据库
+void table_vacuum(Table *table, double fill_factor) {
+    Pager *pager = table->pager;
+    if (fill_factor <= 0 || fill_factor > 1) {
+        fill_factor = DEFAULT_FILL_FACTOR;
+    }
+    uint32_t old_num_pages = pager->num_pages;
+    FILE *files[NUM_INDEXES + 1];
+    files[0] = vacuum_dump_tree(pager, table->root_page_num);
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        files[i + 1] = table->indexes[i] != NULL ? vacuum_dump_tree(pager, table->indexes[i]->root_page_num) : NULL;
+    }
+
+    // 原来的页全部作废，空闲链表清空，从根页之后开始顺序分配：主表在前，各索引依次在后
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    *header_free_list_head(header) = 0;
+    *header_num_free_pages(header) = 0;
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+    pager->vacuum_next_page = ROOT_PAGE_NUM + 1;
+    vacuum_load_tree(table, files[0], fill_factor);
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        if (files[i + 1] == NULL) {
+            continue;
         }
+        Table *index = table->indexes[i];
+        index->root_page_num = get_unused_page_num(pager);
+        header = get_page(pager, HEADER_PAGE_NUM);
+        *header_index_root(header, i) = index->root_page_num;
+        pager_mark_dirty(pager, HEADER_PAGE_NUM);
+        pager_unpin(pager, HEADER_PAGE_NUM);
+        vacuum_load_tree(index, files[i + 1], fill_factor);
     }
+    uint32_t num_pages = pager->vacuum_next_page;
+    pager->vacuum_next_page = 0;
+
+    pager_truncate(pager, num_pages);
+    pager_truncate_file(pager);
+    printf("vacuum: %u pages -> %u pages.\n", old_num_pages, num_pages);
 }
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
-    if (strcmp(input_buffer->buffer, ".exit") == 0) {
-        close_input_buffer(input_buffer);
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-        printf("Tree: \n");
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
-    } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-        printf("Constants: \n");
-        print_constants();
-        return META_COMMAND_SUCCESS;
-    } else {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+// 从空闲链表中摘下指定的页，返回是否找到
+bool free_list_remove(Pager *pager, uint32_t page_num) {
+    void *header = get_page(pager, HEADER_PAGE_NUM);
+    uint32_t *link = header_free_list_head(header);
+    uint32_t link_page_num = HEADER_PAGE_NUM;
+    bool found = false;
+    while (*link != 0) {
+        uint32_t current = *link;
+        void *page = get_page(pager, current);
+        if (current == page_num) {
+            *link = *free_page_next(page);
+            pager_mark_dirty(pager, link_page_num);
+            pager_unpin(pager, current);
+            *header_num_free_pages(header) -= 1;
+            pager_mark_dirty(pager, HEADER_PAGE_NUM);
+            found = true;
+            break;
+        }
+        if (link_page_num != HEADER_PAGE_NUM) {
+            pager_unpin(pager, link_page_num);
+        }
+        link = free_page_next(page);
+        link_page_num = current;
+    }
+    if (link_page_num != HEADER_PAGE_NUM) {
+        pager_unpin(pager, link_page_num);
     }
+    pager_unpin(pager, HEADER_PAGE_NUM);
+    return found;
 }
 
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement) {
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-        statement->type = STATEMENT_INSERT;
+// 叶子在链表中的前一个叶子，最左的叶子返回 INVALID_PAGE_NUM：
+// 向上找到第一个不是最左子节点的祖先，再从它左边的兄弟一路向右下到叶子
+uint32_t leaf_node_prev_leaf(Pager *pager, uint32_t page_num) {
+    uint32_t child_page_num = page_num;
+    while (true) {
+        void *node = get_page(pager, child_page_num);
+        bool is_root = is_node_root(node);
+        uint32_t parent_page_num = *node_parent(node);
+        pager_unpin(pager, child_page_num);
+        if (is_root) {
+            return INVALID_PAGE_NUM;
+        }
 
-        char *id, *username, *email;
-        char *str = strtok(input_buffer->buffer, " ");
-        id = strtok(NULL, " ");
-        username = strtok(NULL, " ");
-        email = strtok(NULL, " ");
+        void *parent = get_page(pager, parent_page_num);
+        uint32_t index = 0;
+        while (*internal_node_child(parent, index) != child_page_num) {
+            index++;
+        }
+        uint32_t prev_page_num = index > 0 ? *internal_node_child(parent, index - 1) : INVALID_PAGE_NUM;
+        pager_unpin(pager, parent_page_num);
+        if (prev_page_num != INVALID_PAGE_NUM) {
+            void *prev = get_page(pager, prev_page_num);
+            while (get_node_type(prev) == NODE_INTERNAL) {
+                uint32_t right_page_num = *internal_node_right_child(prev);
+                pager_unpin(pager, prev_page_num);
+                prev_page_num = right_page_num;
+                prev = get_page(pager, prev_page_num);
+            }
+            pager_unpin(pager, prev_page_num);
+            return prev_page_num;
+        }
+        child_page_num = parent_page_num;
+    }
+}
 
-        if (id == NULL || username == NULL || email == NULL) {
-            return PREPARE_SYNTAX_ERROR;
+// 把节点从 src 搬到没有被使用的页 dst，修正所有指向它的页号：父节点中的子节点指针（根节点是文件头中的索引根）、
+// 子节点的父指针、前一个叶子的 next 指针。src 由调用者处理。主表的根固定在 ROOT_PAGE_NUM，不能搬
+void vacuum_move_node(Table *table, uint32_t src, uint32_t dst) {
+    Pager *pager = table->pager;
+    void *node = get_page(pager, src);
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t prev_page_num = leaf_node_prev_leaf(pager, src);
+        if (prev_page_num != INVALID_PAGE_NUM) {
+            void *prev = get_page(pager, prev_page_num);
+            *leaf_node_next_leaf(prev) = dst;
+            pager_mark_dirty(pager, prev_page_num);
+            pager_unpin(pager, prev_page_num);
         }
+    } else {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            set_node_parent(pager, *internal_node_child(node, i), dst);
+        }
+    }
 
-        int id_num = atoi(id);
-        if (id_num < 0) {
-            return PREPARE_NEGATIVE_ID;
+    if (is_node_root(node)) {
+        void *header = get_page(pager, HEADER_PAGE_NUM);
+        for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+            if (table->indexes[i] != NULL && table->indexes[i]->root_page_num == src) {
+                table->indexes[i]->root_page_num = dst;
+                *header_index_root(header, i) = dst;
+            }
         }
-        if (strlen(username) > COLUMN_USERNAME_SIZE) {
-            return PREPARE_STRING_TOO_LONG;
+        pager_mark_dirty(pager, HEADER_PAGE_NUM);
+        pager_unpin(pager, HEADER_PAGE_NUM);
+    } else {
+        uint32_t parent_page_num = *node_parent(node);
+        void *parent = get_page(pager, parent_page_num);
+        uint32_t index = 0;
+        while (*internal_node_child(parent, index) != src) {
+            index++;
         }
-        if (strlen(email) > COLUMN_EMAIL_SIZE) {
-            return PREPARE_STRING_TOO_LONG;
+        *internal_node_child(parent, index) = dst;
+        pager_mark_dirty(pager, parent_page_num);
+        pager_unpin(pager, parent_page_num);
+    }
+
+    void *dst_node = get_page(pager, dst);
+    memcpy(dst_node, node, PAGE_SIZE);
+    pager_mark_dirty(pager, dst);
+    pager_unpin(pager, dst);
+    pager_unpin(pager, src);
+    // 主表和索引最右叶子的提示可能指向 src
+    table->last_leaf_page_num = INVALID_PAGE_NUM;
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+        if (table->indexes[i] != NULL) {
+            table->indexes[i]->last_leaf_page_num = INVALID_PAGE_NUM;
         }
+    }
+}
 
-        statement->row_to_insert.id = id_num;
-        strcpy(statement->row_to_insert.username, username);
-        strcpy(statement->row_to_insert.email, email);
-        return PREPARE_SUCCESS;
+// 腾出页 page_num 给下一个叶子：空闲页从链表中摘下，节点搬到空闲页或文件末尾的新页
+void vacuum_clear_page(Table *table, uint32_t page_num) {
+    Pager *pager = table->pager;
+    void *page = get_page(pager, page_num);
+    NodeType type = get_node_type(page);
+    pager_unpin(pager, page_num);
+    if (type == NODE_FREE) {
+        free_list_remove(pager, page_num);
+    } else {
+        vacuum_move_node(table, page_num, get_unused_page_num(pager));
     }
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+}
+
+// 把链表中的下一个叶子搬到 next_page，返回搬动的页数。中间节点的 key 在删除后可能大于子树中实际的最大 key，
+// 所以不能按 key 查找下一个叶子：先找到已就位的最后一个 key 所在的叶子，再沿链表取它的下一个
+uint32_t vacuum_place_leaf(Vacuum *vacuum) {
+    Table *table = vacuum->table;
+    Pager *pager = table->pager;
+    uint32_t page_num;
+    table_find_leaf(table, vacuum->last_key, &page_num);
+    table_release_leaf(table, page_num);
+    if (page_num == table->root_page_num) {
+        vacuum->leaves_placed = true;
+        return 0;
+    }
+    if (vacuum->has_last_key && page_num < vacuum->next_page) {
+        void *placed = get_page(pager, page_num);
+        uint32_t next_page_num = *leaf_node_next_leaf(placed);
+        pager_unpin(pager, page_num);
+        if (next_page_num == 0) {
+            vacuum->leaves_placed = true;
+            return 0;
+        }
+        page_num = next_page_num;
     }
 
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    uint32_t moved = 0;
+    if (page_num != vacuum->next_page) {
+        vacuum_clear_page(table, vacuum->next_page);
+        vacuum_move_node(table, page_num, vacuum->next_page);
+        free_page(pager, page_num);
+        moved = 2;
+    }
+    void *leaf = get_page(pager, vacuum->next_page);
+    uint32_t num_cells = *leaf_node_num_cells(leaf);
+    if (num_cells > 0) {
+        vacuum->last_key = *leaf_node_key(leaf, num_cells - 1);
+        vacuum->has_last_key = true;
+    }
+    if (*leaf_node_next_leaf(leaf) == 0) {
+        vacuum->leaves_placed = true;
+    }
+    pager_unpin(pager, vacuum->next_page);
+    vacuum->next_page++;
+    return moved;
 }
 
-uint32_t get_unused_page_num(Pager *pager) {
-    return pager->num_pages;
+// 去掉文件末尾的一页：空闲页直接摘下，节点搬进空闲页。没有可用的空闲页时返回 false
+bool vacuum_shrink(Table *table) {
+    Pager *pager = table->pager;
+    uint32_t last_page_num = pager->num_pages - 1;
+    if (last_page_num <= ROOT_PAGE_NUM) {
+        return false;
+    }
+    void *page = get_page(pager, last_page_num);
+    NodeType type = get_node_type(page);
+    pager_unpin(pager, last_page_num);
+    if (type == NODE_FREE) {
+        free_list_remove(pager, last_page_num);
+    } else {
+        void *header = get_page(pager, HEADER_PAGE_NUM);
+        bool has_free_page = *header_free_list_head(header) != 0;
+        pager_unpin(pager, HEADER_PAGE_NUM);
+        if (!has_free_page) {
+            return false;
+        }
+        vacuum_move_node(table, last_page_num, get_unused_page_num(pager));
+    }
+    pager_truncate(pager, last_page_num);
+    return true;
 }
 
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+// 整理一步，返回是否已经完成。调用者独占数据库
+bool vacuum_step(Vacuum *vacuum) {
+    uint64_t moved = 0;
+    while (moved < VACUUM_STEP_PAGES) {
+        if (!vacuum->leaves_placed) {
+            moved += vacuum_place_leaf(vacuum);
+        } else if (vacuum_shrink(vacuum->table)) {
+            moved++;
+        } else {
+            vacuum->pages_moved += moved;
+            return true;
+        }
+    }
+    vacuum->pages_moved += moved;
+    return false;
+}
 
-void create_new_root(Table *table, uint32_t right_child_page_num) {
-    void *root = get_page(table->pager, table->root_page_num);
+void *vacuum_worker(void *arg) {
+    Vacuum *vacuum = arg;
+    Table *table = vacuum->table;
+    Pager *pager = table->pager;
+    uint32_t old_num_pages = pager->num_pages;
+    struct timespec interval = {0, VACUUM_STEP_INTERVAL_MS * 1000000L};
+    bool finished = false;
+    while (!finished && !__atomic_load_n(&vacuum->stop, __ATOMIC_ACQUIRE)) {
+        db_begin_exclusive(table);
+        finished = vacuum_step(vacuum);
+        // 每一步是一个事务
+        pager_commit(pager);
+        if (finished) {
+            pager_truncate_file(pager);
+            printf("vacuum: %u pages -> %u pages, %llu pages moved.\n", old_num_pages, pager->num_pages,
+                   (unsigned long long) vacuum->pages_moved);
+            fflush(stdout);
+        }
+        db_end_exclusive(table);
+        nanosleep(&interval, NULL);
+    }
+    __atomic_store_n(&vacuum->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    // 把原节点数据迁移到左节点，并将左节点设置为非 root
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void *left_child = get_page(table->pager, left_child_page_num);
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+bool vacuum_running(Table *table) {
+    return table->vacuum != NULL && !__atomic_load_n(&table->vacuum->done, __ATOMIC_ACQUIRE);
+}
 
-    // 初始化 root 节点
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
+// 等后台整理结束（未结束时让它在当前这一步之后停下）并回收
+void vacuum_stop(Table *table) {
+    Vacuum *vacuum = table->vacuum;
+    if (vacuum == NULL) {
+        return;
+    }
+    __atomic_store_n(&vacuum->stop, true, __ATOMIC_RELEASE);
+    pthread_join(vacuum->thread, NULL);
+    free(vacuum);
+    table->vacuum = NULL;
 }
 
-// 将叶子节点一分为二，并插入新数据
-/* 1 2 3 4 5 6 7 8 9 10 12 13 14, (insert 11, cursor->cell_num = 10)
- * LEAF_NODE_MAX_CELLS = 13
- * LEAF_NODE_LEFT_SPLIT_COUNT = 7
- * LEAF_NODE_RIGHT_SPLIT_COUNT = 7
- * i = [13...0]:
- *      i = 13 >= 7, dst = new_node, idx_within_node = 13 % 7 = 6, i > 10, old_node(12) -> new_node(6)
- *      i = 12 >= 7, dst = new_node, idx_within_node = 12 % 7 = 5, i > 10, old_node(11) -> new_node(5)
- *      i = 11 >= 7, dst = new_node, idx_within_node = 11 % 7 = 4, i > 10, old_node(10) -> new_node(4)
- *      i = 10 >= 7, dst = new_node, idx_within_node = 10 % 7 = 3, i = 10, 11 -> new_node(3)
- *      i = 9 >= 7, dst = new_node, idx_within_node = 9 % 7 = 2, i < 10, old_node(9) -> new_node(2)
- *      i = 8 >= 7, dst = new_node, idx_within_node = 8 % 7 = 1, i < 10, old_node(8) -> new_node(1)
- *      i = 7 >= 7, dst = new_node, idx_within_node = 7 % 7 = 0, i < 10, old_node(7) -> new_node(0)
- *      ...
- */
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
-    void *old_node = get_page(cursor->table->pager, cursor->page_num);
+// 启动后台整理，调用者独占数据库
+void vacuum_start(Table *table) {
+    // 上一次已经结束的整理在这里回收，调用者独占数据库时它不会再等锁
+    vacuum_stop(table);
+    Vacuum *vacuum = calloc(1, sizeof(Vacuum));
+    vacuum->table = table;
+    vacuum->next_page = ROOT_PAGE_NUM + 1;
+    table->vacuum = vacuum;
+    pthread_create(&vacuum->thread, NULL, vacuum_worker, vacuum);
+}
 
-    // 初始化一个新的节点
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void *new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node) = new_page_num;
+//
+// Server
+//
+// --listen 指定 Unix 域套接字的路径，--port 指定 TCP 端口（只监听 127.0.0.1），两者可以同时使用。
+// 协议按行：每行一条语句，和 REPL 的输入相同。每条语句的回复是按连接的输出格式（.mode）编码的行，
+// 之后一行结果，"executed." 或其他出错提示。系统指令只支持 .mode、.stats [json|reset] 和 .exit。
+// 客户端可以不等回复连续发送多条语句，回复按顺序返回。
+// 每个工作线程有自己的 epoll，各自从监听套接字 accept 连接，一个连接始终由同一个线程处理。
+// select 边执行边发送，输出缓冲超过上限时暂停执行，等对方读走后再继续
+//
+#define DEFAULT_SERVER_THREADS 4
+#define SERVER_MAX_LINE 4096        // 一行请求的最大长度
+#define SERVER_READ_CHUNK 16384
+#define SERVER_OUTPUT_LIMIT 65536   // 未发出的回复超过这么多字节时暂停执行语句
+#define SERVER_MAX_EVENTS 64
 
-    // 将原数据拆分到两个节点中
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void *dst_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) { // 先把后半部分数据分到新的节点中
-            dst_node = new_node;
-        } else {
-            dst_node = old_node;
+typedef struct Connection {
+    int fd;
+    char *input;              // 收到但还没有执行的请求，从 input_start 开始
+    uint32_t input_start;
+    uint32_t input_length;
+    uint32_t input_capacity;
+    OutputBuffer output;      // 还没有发出的回复，从 output_sent 开始
+    uint32_t output_sent;
+    OutputMode mode;          // 这个连接用 .mode 设置的输出格式
+    DbStatement *statement;   // 正在返回行的 select
+    uint32_t events;          // 当前在 epoll 中关注的事件
+    bool closing;             // 对方已关闭或要求退出，回复发完后关闭
+    bool broken;              // 连接出错，立即关闭
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+typedef struct {
+    Table *table;
+    int *listen_fds;
+    uint32_t num_listen_fds;
+    int stop_fd;              // eventfd，可读时所有工作线程退出
+} Server;
+
+typedef struct {
+    Server *server;
+    int epoll_fd;
+    Connection *connections;  // 本线程的所有连接
+    pthread_t thread;
+} ServerWorker;
+
+int server_listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("socket path is too long.\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // 上次运行留下的套接字文件会让 bind 失败
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        printf("error listening on %s: %d\n", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+int server_listen_tcp(uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        printf("error listening on port %d: %d\n", port, errno);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// 读到 EAGAIN 或本轮读够为止，一个连接发来大量请求时不会饿死同一线程的其他连接
+void connection_read(Connection *conn) {
+    if (conn->input_start > 0) {
+        conn->input_length -= conn->input_start;
+        memmove(conn->input, conn->input + conn->input_start, conn->input_length);
+        conn->input_start = 0;
+    }
+    uint32_t total = 0;
+    while (total < SERVER_OUTPUT_LIMIT) {
+        if (conn->input_capacity - conn->input_length < SERVER_READ_CHUNK) {
+            conn->input_capacity = conn->input_length + SERVER_READ_CHUNK;
+            conn->input = realloc(conn->input, conn->input_capacity);
+        }
+        ssize_t bytes_read = read(conn->fd, conn->input + conn->input_length, conn->input_capacity - conn->input_length);
+        if (bytes_read > 0) {
+            conn->input_length += bytes_read;
+            total += bytes_read;
+        } else if (bytes_read == 0) {
+            conn->closing = true;
+            return;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            conn->broken = true;
+            return;
+        }
+    }
+}
+
+// 执行缓冲区中完整的请求行，直到没有请求或者输出积压
+void connection_execute(Table *table, Connection *conn) {
+    OutputBuffer *out = &conn->output;
+    while (!conn->broken && out->length - conn->output_sent < SERVER_OUTPUT_LIMIT) {
+        if (conn->statement != NULL) {
+            RowView row;
+            ExecuteResult result = db_step_view(conn->statement, &row);
+            if (result == EXECUTE_ROW) {
+                output_row(out, conn->mode, &conn->statement->statement, &row);
+            } else {
+                if (conn->statement->statement.type == STATEMENT_SELECT) {
+                    output_end(out, conn->mode);
+                }
+                db_finalize(conn->statement);
+                conn->statement = NULL;
+                output_printf(out, "%s\n", execute_result_message(result));
+            }
+            continue;
         }
-        uint32_t idx_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT; // 应该插入到左/右节点的位置
-        void *dst = leaf_node_cell(dst_node, idx_within_node);
 
-        if (i == cursor->cell_num) { // 到达新数据插入的位置
-            serialize_row(value, leaf_node_value(dst_node, idx_within_node));
-            *leaf_node_key(dst_node, idx_within_node) = key;
-        } else if (i > cursor->cell_num) {
-            memcpy(dst, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memcpy(dst, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE); // 因为新插入的数据占了一个位置
+        char *line = conn->input + conn->input_start;
+        uint32_t available = conn->input_length - conn->input_start;
+        char *end = memchr(line, '\n', available);
+        if (end == NULL) {
+            if (available > SERVER_MAX_LINE) {
+                output_printf(out, "error: request is too long.\n");
+                conn->closing = true;
+            }
+            if (conn->closing) {
+                // 对方关闭时最后一行可能没有换行，丢弃
+                conn->input_start = conn->input_length;
+            }
+            return;
+        }
+        conn->input_start += end - line + 1;
+        *end = 0;
+        if (end > line && end[-1] == '\r') {
+            end[-1] = 0;
+        }
+
+        if (line[0] == '.') {
+            if (strcmp(line, ".exit") == 0) {
+                conn->closing = true;
+                conn->input_start = conn->input_length;
+                return;
+            }
+            if (strncmp(line, ".mode ", 6) == 0) {
+                OutputMode mode = parse_output_mode(line + 6);
+                if (mode == NUM_OUTPUT_MODES) {
+                    output_printf(out, "unrecognized output mode '%s'.\n", line + 6);
+                } else {
+                    conn->mode = mode;
+                    output_printf(out, "%s\n", execute_result_message(EXECUTE_SUCCESS));
+                }
+                continue;
+            }
+            if (strcmp(line, ".stats") == 0 || strcmp(line, ".stats json") == 0) {
+                pthread_rwlock_rdlock(&table->db_lock);
+                print_stats(table, line[6] != 0, out);
+                pthread_rwlock_unlock(&table->db_lock);
+                output_printf(out, "%s\n", execute_result_message(EXECUTE_SUCCESS));
+                continue;
+            }
+            if (strcmp(line, ".stats reset") == 0) {
+                stats_reset();
+                output_printf(out, "%s\n", execute_result_message(EXECUTE_SUCCESS));
+                continue;
+            }
+            // 其他系统指令会独占数据库并打印到服务端的标准输出，不对客户端开放
+            output_printf(out, "unrecognized command '%s'.\n", line);
+            continue;
         }
+        PrepareResult prepare_result;
+        DbStatement *statement = db_prepare(table, line, &prepare_result);
+        if (prepare_result != PREPARE_SUCCESS) {
+            db_finalize(statement);
+            output_printf(out, prepare_result_message(prepare_result), line);
+            output_printf(out, "\n");
+            continue;
+        }
+        conn->statement = statement;
     }
+}
 
-    // 更新左右节点数据个数
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+void connection_write(Connection *conn) {
+    OutputBuffer *out = &conn->output;
+    while (!conn->broken && conn->output_sent < out->length) {
+        ssize_t bytes_written = send(conn->fd, out->data + conn->output_sent,
+                                     out->length - conn->output_sent, MSG_NOSIGNAL);
+        if (bytes_written >= 0) {
+            conn->output_sent += bytes_written;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            conn->broken = true;
+        }
+    }
+    conn->output_sent = 0;
+    out->length = 0;
+}
 
-    if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
+void connection_close(ServerWorker *worker, Connection *conn) {
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->statement != NULL) {
+        db_finalize(conn->statement);
+    }
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
     } else {
-        printf("need to implement updating parent after split.\n");
-        exit(EXIT_FAILURE);
+        worker->connections = conn->next;
     }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    free(conn->input);
+    free(conn->output.data);
+    free(conn);
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        leaf_node_split_and_insert(cursor, key, value);
+void connection_handle(ServerWorker *worker, Connection *conn, uint32_t events) {
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        connection_read(conn);
+    }
+    connection_execute(worker->server->table, conn);
+    connection_write(conn);
+
+    bool pending = conn->output_sent < conn->output.length;
+    if (conn->broken || (conn->closing && !pending && conn->statement == NULL)) {
+        connection_close(worker, conn);
         return;
     }
+    // 有回复没发完时只等可写，发完之前不再读新的请求；语句没执行完时等可写后继续执行
+    uint32_t wanted = pending ? EPOLLOUT : EPOLLIN;
+    if (!pending && conn->statement != NULL) {
+        wanted = EPOLLOUT;
+    }
+    if (wanted != conn->events) {
+        struct epoll_event event = {.events = wanted, .data.ptr = conn};
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = wanted;
+    }
+}
 
-    if (cursor->cell_num < num_cells) {
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+void server_accept(ServerWorker *worker, int listen_fd) {
+    for (;;) {
+        // 监听套接字由所有工作线程共享，别的线程先 accept 时这里返回 EAGAIN
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                printf("error accepting connection: %d\n", errno);
+            }
+            return;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        Connection *conn = calloc(1, sizeof(Connection));
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->next = worker->connections;
+        if (worker->connections != NULL) {
+            worker->connections->prev = conn;
         }
+        worker->connections = conn;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event);
     }
-
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-    void *node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
-    Row *row_to_insert = &statement->row_to_insert;
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor *cursor = table_find(table, key_to_insert);
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
+void *server_worker_run(void *arg) {
+    ServerWorker *worker = arg;
+    Server *server = worker->server;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    for (;;) {
+        int num_events = epoll_wait(worker->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("error waiting for events: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < num_events; i++) {
+            // 监听套接字和 eventfd 的 data 指向 Server 中保存它们的 fd
+            void *ptr = events[i].data.ptr;
+            if (ptr == &server->stop_fd) {
+                while (worker->connections != NULL) {
+                    connection_close(worker, worker->connections);
+                }
+                return NULL;
+            }
+            if (ptr >= (void *) server->listen_fds && ptr < (void *) (server->listen_fds + server->num_listen_fds)) {
+                server_accept(worker, *(int *) ptr);
+            } else {
+                connection_handle(worker, ptr, events[i].events);
+            }
         }
     }
-    leaf_node_insert(cursor, key_to_insert, row_to_insert);
-
-    free(cursor);
-    return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table) {
-    Row row;
-    Cursor *cursor = table_start(table);
-    while (!cursor->end_of_table) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+// 服务直到收到 SIGINT 或 SIGTERM，然后关闭所有连接
+void server_run(Table *table, const char *socket_path, int port, uint32_t num_threads) {
+    // 信号只由主线程的 sigwait 接收，工作线程继承屏蔽字
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int listen_fds[2];
+    Server server = {table, listen_fds, 0, eventfd(0, EFD_CLOEXEC)};
+    if (socket_path != NULL) {
+        listen_fds[server.num_listen_fds++] = server_listen_unix(socket_path);
+        printf("listening on %s.\n", socket_path);
     }
-    free(cursor);
-    return EXECUTE_SUCCESS;
-}
+    if (port >= 0) {
+        listen_fds[server.num_listen_fds++] = server_listen_tcp(port);
+        printf("listening on 127.0.0.1:%d.\n", port);
+    }
+    fflush(stdout);
 
-ExecuteResult execute_statement(Statement *statement, Table *table) {
-    switch (statement->type) {
-        case (STATEMENT_INSERT):
-            return execute_insert(statement, table);
-        case (STATEMENT_SELECT):
-            return execute_select(statement, table);
+    ServerWorker *workers = calloc(num_threads, sizeof(ServerWorker));
+    for (uint32_t i = 0; i < num_threads; i++) {
+        workers[i].server = &server;
+        workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        // EPOLLEXCLUSIVE：新连接只唤醒一个等待的线程
+        for (uint32_t j = 0; j < server.num_listen_fds; j++) {
+            struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_fds[j]};
+            epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, listen_fds[j], &event);
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &server.stop_fd};
+        epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, server.stop_fd, &event);
+        pthread_create(&workers[i].thread, NULL, server_worker_run, &workers[i]);
+    }
+
+    int signal_number;
+    sigwait(&signals, &signal_number);
+    // eventfd 一直保持可读，每个工作线程都会看到
+    uint64_t one = 1;
+    write(server.stop_fd, &one, sizeof(one));
+    for (uint32_t i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].epoll_fd);
+    }
+    for (uint32_t i = 0; i < server.num_listen_fds; i++) {
+        close(listen_fds[i]);
+    }
+    if (socket_path != NULL) {
+        unlink(socket_path);
     }
+    close(server.stop_fd);
+    free(workers);
 }
 
+#ifndef SIMPLE_DB_NO_MAIN
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    char *filename = NULL;
+    DbOptions options;
+    db_default_options(&options);
+    char *import_filename = NULL;
+    double fill_factor = DEFAULT_FILL_FACTOR;
+    char *socket_path = NULL;
+    int port = -1;
+    uint32_t server_threads = DEFAULT_SERVER_THREADS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            // 只在创建数据库时生效，已有文件以文件头记录的页大小为准
+            options.page_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+            options.cache_pages = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.use_mmap = true;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            options.use_wal = true;
+        } else if (strcmp(argv[i], "--group-commit") == 0 && i + 1 < argc) {
+            options.group_commit = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+            options.scan_threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc) {
+            import_filename = argv[++i];
+        } else if (strcmp(argv[i], "--fill-factor") == 0 && i + 1 < argc) {
+            fill_factor = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server-threads") == 0 && i + 1 < argc) {
+            server_threads = strtoul(argv[++i], NULL, 10);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
         printf("must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
-    char *filename = argv[1];
-    Table *table = db_open(filename);
+    Table *table = db_open(filename, &options);
+
+    // 批量导入模式：导入完成后直接退出
+    if (import_filename != NULL) {
+        db_begin_exclusive(table);
+        bool ok = table_import(table, import_filename, fill_factor);
+        db_end_exclusive(table);
+        db_close(table);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // 服务模式：不读标准输入，收到 SIGINT 或 SIGTERM 后关闭数据库退出
+    if (socket_path != NULL || port >= 0) {
+        if (port > 65535 || server_threads == 0) {
+            printf("invalid server options.\n");
+            exit(EXIT_FAILURE);
+        }
+        server_run(table, socket_path, port, server_threads);
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    }
+
     InputBuffer *input_buffer = new_input_buffer();
+    OutputBuffer output = {NULL, 0, 0};
     while (true) {
         print_prompt();
         read_input(input_buffer);
@@ -763,35 +7323,29 @@ int main(int argc, char *argv[]) {
         }
 
         // 处理 SQL 语句
-        Statement statement;
-        switch (prepare_statement(input_buffer, &statement)) {
-            case (PREPARE_SUCCESS):
-                break;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("syntax error. could not parse statement.\n");
-                continue;
-            case (PREPARE_UNRECOGNIZED_STATEMENT):
-                printf("unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-                continue;
-            case PREPARE_NEGATIVE_ID:
-                printf("id must be positive.\n");
-                continue;
-            case PREPARE_STRING_TOO_LONG:
-                printf("string is too long.\n");
-                continue;
+        PrepareResult prepare_result;
+        DbStatement *statement = db_prepare(table, input_buffer->buffer, &prepare_result);
+        if (prepare_result != PREPARE_SUCCESS) {
+            db_finalize(statement);
+            printf(prepare_result_message(prepare_result), input_buffer->buffer);
+            printf("\n");
+            continue;
         }
 
-        switch (execute_statement(&statement, table)) {
-            case (EXECUTE_SUCCESS):
-                printf("executed.\n");
-                break;
-            case (EXECUTE_TABLE_FULL):
-                printf("error: table full.\n");
-                break;
-            case EXECUTE_DUPLICATE_KEY:
-                printf("error: duplicate key.\n");
-                break;
+        RowView row;
+        ExecuteResult result;
+        while ((result = db_step_view(statement, &row)) == EXECUTE_ROW) {
+            output_row(&output, output_mode, &statement->statement, &row);
+            if (output.length >= OUTPUT_FLUSH_SIZE) {
+                output_flush(&output, stdout);
+            }
         }
+        if (statement->statement.type == STATEMENT_SELECT) {
+            output_end(&output, output_mode);
+        }
+        output_flush(&output, stdout);
+        db_finalize(statement);
+        printf("%s\n", execute_result_message(result));
     }
 }
-
+#endif
@@ -0,0 +1,82 @@
+#ifndef SIMPLE_DB_H
+#define SIMPLE_DB_H
+
+//
+// 嵌入式接口：simple_database 的 REPL 和服务端、simple_db_bench 都通过它访问数据库。
+// 以 SIMPLE_DB_NO_MAIN 编译 main.c 得到不含 main 的静态库 simple_db
+//
+#include <stdbool.h>
+#include <stdint.h>
+
+#define COLUMN_USERNAME_SIZE  32
+#define COLUMN_EMAIL_SIZE 255
+
+typedef enum {
+    PREPARE_SUCCESS,
+    PREPARE_NEGATIVE_ID,
+    PREPARE_STRING_TOO_LONG,
+    PREPARE_SYNTAX_ERROR,
+    PREPARE_UNRECOGNIZED_STATEMENT
+} PrepareResult;
+
+typedef enum {
+    EXECUTE_SUCCESS,
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_KEY_NOT_FOUND,
+    EXECUTE_TABLE_FULL,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_NOT_PREPARED,   // 语句解析失败，db_step 不执行它
+    EXECUTE_ROW // db_step 返回了一行，语句还没有结束
+
+} ExecuteResult;
+
+typedef struct {
+    uint32_t id;
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+} Row;
+
+// 可以建二级索引的列
+typedef enum {
+    INDEX_USERNAME,
+    INDEX_EMAIL,
+    NUM_INDEXES
+} IndexColumn;
+
+// 一行的只读视图，字符串直接指向叶子页或 Row 中的数据，不以 0 结尾。按 IndexColumn 取字符串列
+typedef struct {
+    uint32_t id;
+    const char *fields[NUM_INDEXES];
+    uint8_t lengths[NUM_INDEXES];
+} RowView;
+
+typedef struct {
+    uint32_t page_size;     // 只在创建数据库时使用，已有数据库以文件头为准
+    bool compress;          // 同上，是否压缩存储页
+    uint32_t cache_pages;
+    bool use_mmap;
+    bool use_wal;
+    uint32_t group_commit;  // 开启 WAL 时每多少个提交做一次 fdatasync，凑不够时最多等 10ms；语句总在提交持久后返回
+    uint32_t scan_threads;  // 没有可用索引的按列值查询用多少个线程并行扫描，0 表示 CPU 核数
+} DbOptions;
+
+typedef struct Table Table;
+typedef struct DbStatement DbStatement;
+
+void db_default_options(DbOptions *options);
+// 同一进程中同时打开的数据库页大小和压缩模式必须相同，否则 db_open 报错退出
+Table *db_open(const char *filename, DbOptions *options);
+void db_close(Table *table);
+
+// db_prepare 解析一条语句，db_step 每次返回一行 EXECUTE_ROW，语句结束时返回最终结果，db_finalize 释放。
+// 解析失败时 db_step 返回 EXECUTE_NOT_PREPARED，同样要 db_finalize。一个 DbStatement 只能在一个线程中使用
+DbStatement *db_prepare(Table *table, const char *sql, PrepareResult *result);
+ExecuteResult db_step(DbStatement *stmt, Row *row);
+// 同 db_step，但返回的视图只在下一次 db_step 之前有效
+ExecuteResult db_step_view(DbStatement *stmt, RowView *view);
+void db_finalize(DbStatement *stmt);
+
+const char *prepare_result_message(PrepareResult result);
+const char *execute_result_message(ExecuteResult result);
+
+#endif
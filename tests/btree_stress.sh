@@ -0,0 +1,132 @@
+#!/bin/sh
+# B+ 树压力测试：按随机顺序插入 rows 行，再随机删除四分之一，然后
+#   .verify  检查树结构、子树行数和所有页的归属，行数要与预期一致
+#   .btree   检查 key 全局严格递增、分隔 key 不小于左边的 key 且小于右边的 key、所有叶子在同一层
+#   查询     count(*)、min/max 和 limit/offset 的结果与 awk 算出的预期一致（expected 文件）
+#   重新打开 从文件读回的树仍能通过 .verify，行数不变
+# 用法：btree_stress.sh <simple_database> [rows [options...]]，rows 默认 1000000，options 原样传给 simple_database，
+# 例如 --mmap 或 --page-size 8192 --compress --cache-pages 64
+set -eu
+
+bin=$1
+rows=${2:-1000000}
+shift $(($# < 2 ? $# : 2))
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+expected="$dir/expected" awk -v rows="$rows" 'BEGIN {
+    srand(20240601)
+    for (i = 1; i <= rows; i++) {
+        keys[i] = i
+    }
+    for (i = rows; i > 1; i--) {
+        j = int(rand() * i) + 1
+        t = keys[i]; keys[i] = keys[j]; keys[j] = t
+    }
+    for (i = 1; i <= rows; i++) {
+        printf "insert %d user%d user%d@example.com\n", keys[i], keys[i], keys[i]
+    }
+    # 删除顺序与插入顺序无关：从打乱后的中间位置往两头交替取
+    for (i = 1; i <= rows; i++) {
+        present[i] = 1
+    }
+    for (i = 0; i < int(rows / 4); i++) {
+        key = keys[int(rows / 2) + (i % 2 ? -1 : 1) * int(i / 2 + 1)]
+        printf "delete where id = %d\n", key
+        delete present[key]
+    }
+    print ".verify"
+
+    # 子树行数：整表和区间的 count(*)、min/max，以及 offset 定位
+    expected = ENVIRON["expected"]
+    print "select count(*)"
+    print "(" rows - int(rows / 4) ")" > expected
+    for (q = 0; q < 8; q++) {
+        low = int(rand() * rows) + 1
+        high = low + int(rand() * rows / 8)
+        offset = int(rand() * 100)
+        printf "select count(*) where id between %d and %d\n", low, high
+        printf "select min(id) where id between %d and %d\n", low, high
+        printf "select max(id) where id between %d and %d\n", low, high
+        printf "select id where id between %d and %d limit 3 offset %d\n", low, high, offset
+        count = 0; min = 0; max = 0; n = 0
+        for (k = low; k <= high && k <= rows; k++) {
+            if (k in present) {
+                count++
+                if (min == 0) min = k
+                max = k
+                if (count > offset && n < 3) page[n++] = k
+            }
+        }
+        print "(" count ")" > expected
+        if (count > 0) print "(" min ")\n(" max ")" > expected
+        for (j = 0; j < n; j++) print "(" page[j] ")" > expected
+    }
+    print ".btree"
+    print ".exit"
+}' > "$dir/input"
+
+"$bin" "$@" "$dir/test.db" < "$dir/input" > "$dir/output"
+
+awk -v expected=$((rows - rows / 4)) '
+function fail(message) {
+    print "FAIL: " message " (line " NR ")"
+    failed = 1
+    exit 1
+}
+{ sub(/^(db > )+/, "") }
+/error|Error/ { fail($0) }
+/^tree ok:/ {
+    verified = 1
+    if ($(NF - 4) != expected) fail("verify counted " $(NF - 4) " rows, expected " expected)
+    next
+}
+/^(page|index|free list)/ { fail($0) }
+/^ *- leaf/ {
+    level = (index($0, "-") - 1) / 2
+    if (leaf_level == "") leaf_level = level
+    else if (level != leaf_level) fail("leaves at levels " leaf_level " and " level)
+    next
+}
+/^ *- key / {
+    separator = $3 + 0
+    if (num_keys > 0 && last > separator) fail("key " last " left of separator " separator)
+    bound = separator
+    pending = 1
+    next
+}
+/^ *- [0-9]+ *$/ {
+    key = $2 + 0
+    if (num_keys > 0 && key <= last) fail("key " key " after " last)
+    if (pending && key <= bound) fail("key " key " right of separator " bound)
+    pending = 0
+    last = key
+    num_keys++
+}
+END {
+    if (failed) exit 1
+    if (!verified) { print "FAIL: .verify did not report tree ok"; exit 1 }
+    if (num_keys != expected) { print "FAIL: .btree listed " num_keys " keys, expected " expected; exit 1 }
+    printf "ok: %d rows, leaves at depth %d\n", num_keys, leaf_level + 1
+}' "$dir/output"
+
+sed -n 's/^\(db > \)*\((.*\)$/\2/p' "$dir/output" > "$dir/results"
+if ! cmp -s "$dir/expected" "$dir/results"; then
+    echo "FAIL: query results differ from expected:"
+    diff "$dir/expected" "$dir/results" | head -20
+    exit 1
+fi
+
+printf '.verify\nselect count(*)\n.exit\n' | "$bin" "$@" "$dir/test.db" > "$dir/reopen"
+awk -v expected=$((rows - rows / 4)) '
+{ sub(/^(db > )+/, "") }
+/error|Error|^(page|index|free list)/ { print "FAIL: after reopening: " $0; failed = 1; exit 1 }
+/^tree ok:/ { verified = $(NF - 4) }
+/^\(/ { gsub(/[()]/, ""); count = $0 }
+END {
+    if (failed) exit 1
+    if (verified != expected || count != expected) {
+        print "FAIL: after reopening: .verify counted " verified ", count(*) " count ", expected " expected
+        exit 1
+    }
+}' "$dir/reopen"
@@ -0,0 +1,102 @@
+#!/bin/sh
+# 批量导入测试：
+#   --import   无序的 CSV（超过一个排序段，带重复 id）导入空库，按 id 外部排序后自底向上构建
+#   .import    有序的 CSV 导入非空表，逐行插入，维护已有的索引；另一个空库先建索引再导入，最后统一建立索引
+#   .verify    每一步之后树结构完整，索引中的 id 数与行数一致
+#   查询       导入报告的行数、count(*)、min/max、按 id 和按列值的查询与 awk 算出的预期一致（expected 文件）
+# 用法：import.sh <simple_database> [rows]，rows 默认 200000
+set -eu
+
+bin=$1
+rows=${2:-200000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# 无序文件：偶数 id 2..2*rows 打乱顺序，末尾重复前 100 行；有序文件：奇数 id 1..1999，再加一个已有的 id
+expected="$dir/expected" awk -v rows="$rows" -v dir="$dir" '
+function row(id) {
+    return id ",user" id ",user" id "@example.com"
+}
+function query(sql, result) {
+    print sql > input
+    if (result != "") print result > expected
+}
+BEGIN {
+    srand(20240607)
+    expected = ENVIRON["expected"]
+    for (i = 1; i <= rows; i++) {
+        keys[i] = 2 * i
+    }
+    for (i = rows; i > 1; i--) {
+        j = int(rand() * i) + 1
+        t = keys[i]; keys[i] = keys[j]; keys[j] = t
+    }
+    for (i = 1; i <= rows; i++) print row(keys[i]) > (dir "/unsorted.csv")
+    for (i = 1; i <= 100; i++) print row(keys[i]) > (dir "/unsorted.csv")
+    for (i = 1; i < 2000; i += 2) print row(i) > (dir "/sorted.csv")
+    print row(2000) > (dir "/sorted.csv")
+
+    # 第一个库：--import 之后建索引，再用 .import 合并有序文件
+    print "imported " rows " rows, skipped 100 duplicate ids." > expected
+    input = dir "/input1"
+    query("create index on username")
+    query(".verify")
+    query("select count(*)", "(" rows ")")
+    query("select min(id)", "(2)")
+    query("select max(id)", "(" 2 * rows ")")
+    query(".import " dir "/sorted.csv")
+    print "imported 1000 rows, skipped 1 duplicate ids." > expected
+    query(".verify")
+    query("select count(*)", "(" rows + 1000 ")")
+    query("select min(id)", "(1)")
+    query("select count(*) where id between 1 and 2000", "(2000)")
+    for (i = 1; i <= 20; i++) {
+        id = int(rand() * 2 * rows) + 1
+        if (id % 2 == 0 || id < 2000) result = "(" id ", user" id ", user" id "@example.com)"
+        else result = ""
+        query("select where id = " id, result)
+        query("select id where username = '\''user" id "'\''", result == "" ? "" : "(" id ")")
+    }
+    query(".exit")
+
+    # 第二个库：先建索引，.import 导入空表
+    input = dir "/input2"
+    query("create index on email")
+    query(".import " dir "/unsorted.csv 0.7")
+    print "imported " rows " rows, skipped 100 duplicate ids." > expected
+    query(".verify")
+    query("select count(*)", "(" rows ")")
+    for (i = 1; i <= 10; i++) {
+        id = keys[int(rand() * rows) + 1]
+        query("select id where email = '\''user" id "@example.com'\''", "(" id ")")
+    }
+    query(".exit")
+}'
+
+"$bin" --import "$dir/unsorted.csv" --fill-factor 0.9 "$dir/first.db" > "$dir/output"
+"$bin" "$dir/first.db" < "$dir/input1" >> "$dir/output"
+"$bin" "$dir/second.db" < "$dir/input2" >> "$dir/output"
+
+awk '
+function fail(message) {
+    print "FAIL: " message " (line " NR ")"
+    failed = 1
+    exit 1
+}
+{ sub(/^(db > )+/, "") }
+/error|Error|unable/ { fail($0) }
+/^(page|free list)/ { fail($0) }
+/^index on .* ids, table has/ { fail($0) }
+/^tree ok:/ { verified++ }
+END {
+    if (failed) exit 1
+    if (verified != 3) { print "FAIL: .verify reported tree ok " verified " times, expected 3"; exit 1 }
+}' "$dir/output"
+
+sed -n -e 's/^\(db > \)*\(imported .*\)$/\2/p' -e 's/^\(db > \)*\((.*\)$/\2/p' "$dir/output" > "$dir/results"
+if ! cmp -s "$dir/expected" "$dir/results"; then
+    echo "FAIL: import results differ from expected:"
+    diff "$dir/expected" "$dir/results" | head -20
+    exit 1
+fi
+echo "ok: $rows rows imported"
@@ -0,0 +1,92 @@
+#!/bin/sh
+# 索引重复值测试：很多行共用同一个列值，一个值的 id 远超一个索引单元的容量（72 个），然后
+#   查询     按列值的 count(*)、min/max 在插入、删除、重新插入后都与 awk 算出的预期一致（expected 文件）
+#   .verify  每个索引中的 id 数与行数一致
+# username 的索引先建好，逐行插入时维护；email 的索引在插入之后扫描全表建立。
+# 用法：index_duplicates.sh <simple_database> [rows]，rows 默认 2000
+set -eu
+
+bin=$1
+rows=${2:-2000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+expected="$dir/expected" awk -v rows="$rows" '
+# username：四分之三的行是 dup，其余各不相同；email 只有 3 个值
+function insert(i) {
+    printf "insert %d %s e%d@example.com\n", i, i % 4 ? "dup" : "user" i, i % 3
+    present[i] = 1
+}
+function check(    i, count, min, max, email) {
+    count = 0; min = 0; max = 0; email = 0
+    for (i = 1; i <= rows; i++) {
+        if (!(i in present)) continue
+        if (i % 3 == 0) email++
+        if (i % 4 == 0) continue
+        count++
+        if (min == 0) min = i
+        max = i
+    }
+    print "select count(*) where username = '\''dup'\''"
+    print "select min(id) where username = '\''dup'\''"
+    print "select max(id) where username = '\''dup'\''"
+    print "select count(*) where email = '\''e0@example.com'\''"
+    print "(" count ")" > expected
+    if (count > 0) print "(" min ")\n(" max ")" > expected
+    print "(" email ")" > expected
+    print ".verify"
+}
+BEGIN {
+    expected = ENVIRON["expected"]
+    print "create index on username"
+    for (i = 1; i <= rows; i++) insert(i)
+    print "create index on email"
+    check()
+
+    # 删掉一半 dup 行，前面的单元出现空位
+    for (i = 1; i <= rows; i += 2) {
+        printf "delete where id = %d\n", i
+        delete present[i]
+    }
+    check()
+
+    # 重新插入一部分，填进空位
+    for (i = 1; i <= rows; i += 4) insert(i)
+    check()
+
+    # 删掉所有 dup 行，索引中只剩其他值的单元
+    for (i = 1; i <= rows; i++) {
+        if (i % 4 && i in present) {
+            printf "delete where id = %d\n", i
+            delete present[i]
+        }
+    }
+    check()
+    print ".exit"
+}' > "$dir/input"
+
+"$bin" "$dir/test.db" < "$dir/input" > "$dir/output"
+
+awk '
+function fail(message) {
+    print "FAIL: " message " (line " NR ")"
+    failed = 1
+    exit 1
+}
+{ sub(/^(db > )+/, "") }
+/error|Error/ { fail($0) }
+/^tree ok:/ { verified++; next }
+/^(page|free list)/ { fail($0) }
+/^index on .* ids, table has/ { fail($0) }
+END {
+    if (failed) exit 1
+    if (verified != 4) { print "FAIL: .verify reported tree ok " verified " times, expected 4"; exit 1 }
+}' "$dir/output"
+
+sed -n 's/^\(db > \)*\((.*\)$/\2/p' "$dir/output" > "$dir/results"
+if ! cmp -s "$dir/expected" "$dir/results"; then
+    echo "FAIL: query results differ from expected:"
+    diff "$dir/expected" "$dir/results" | head -20
+    exit 1
+fi
+echo "ok: $rows rows, $(grep -c . "$dir/expected") query results"
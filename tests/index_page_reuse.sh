@@ -0,0 +1,114 @@
+#!/bin/sh
+# 索引与主表共用空闲页的测试：主表最右叶子合并释放后，这一页被索引的最右叶子复用，
+# 主表最右叶子的提示不能再指向它。步骤：
+#   建 username 索引，按 id 顺序插入 rows 行，username 都是 a
+#   删掉一半行留出空位，再删掉顶部的行，主表最右叶子合并到左边的叶子
+#   在空位中插入较低的 id，username 都是 b：主表叶子有空位不分裂，索引只在最右端增长并分裂
+#   插入一个比所有 id 和索引 key 都大的 id，再删掉一部分行
+# 之后检查
+#   查询     按 id 的查询和 count(*) 与 awk 算出的预期一致（expected 文件）
+#   .verify  树结构完整，索引中的 id 数与行数一致
+# 索引的 key 是列值的 FNV-1a 散列；a、b 的散列小于所有 id，且 b 的单元排在 a 的所有单元之后。
+# 用法：index_page_reuse.sh <simple_database> [rows]，rows 默认 6000
+set -eu
+
+bin=$1
+rows=${2:-6000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+expected="$dir/expected" awk -v rows="$rows" '
+# 32 位 FNV-1a，与 index_hash 相同；awk 没有异或，低 8 位逐位计算
+function fnv(s,    h, i, c, low, x, b) {
+    h = 2166136261
+    for (i = 1; i <= length(s); i++) {
+        c = ord[substr(s, i, 1)]
+        low = h % 256
+        x = 0
+        for (b = 1; b < 256; b *= 2) {
+            if ((int(low / b) + int(c / b)) % 2) x += b
+        }
+        h = h - low + x
+        # h * 16777619 = h * 2^24 + h * 403（模 2^32）
+        h = ((h % 256) * 16777216 + h * 403) % 4294967296
+    }
+    return h
+}
+function insert(id, name) {
+    printf "insert %d %s e%d\n", id, name, id
+    present[id] = name
+}
+function delete_row(id) {
+    printf "delete where id = %d\n", id
+    delete present[id]
+}
+function lookup(id) {
+    printf "select where id = %d\n", id
+    if (id in present) print "(" id ", " present[id] ", e" id ")" > expected
+}
+BEGIN {
+    expected = ENVIRON["expected"]
+    for (i = 0; i < 256; i++) ord[sprintf("%c", i)] = i
+    for (n = 0; ; n++) {
+        a = "user" n
+        hash_a = fnv(a)
+        if (hash_a < 268435456) break
+    }
+    for (n++; ; n++) {
+        b = "user" n
+        hash_b = fnv(b)
+        if (hash_b > hash_a + rows && hash_b < 1073741824) break
+    }
+    base = 1073741824
+    top = 100
+
+    print "create index on username"
+    for (i = 1; i <= rows; i++) insert(base + i, a)
+    for (i = 2; i <= rows - top; i += 2) delete_row(base + i)
+    for (i = rows; i > rows - top; i--) delete_row(base + i)
+    # 只插回一半空位，合并过的叶子也放得下
+    for (i = 4; i <= rows - top; i += 4) insert(base + i, b)
+    insert(2147483647, a)
+
+    lookup(2147483647)
+    for (i = 1; i <= rows; i += 97) lookup(base + i)
+    for (i = 4; i <= rows; i += 100) lookup(base + i)
+    print ".verify"
+    for (i = 1; i <= rows; i += 3) {
+        if ((base + i) in present) delete_row(base + i)
+    }
+    delete_row(2147483647)
+    n = 0
+    for (id in present) n++
+    print "select count(*)"
+    print "(" n ")" > expected
+    for (i = 1; i <= rows; i += 97) lookup(base + i)
+    print ".verify"
+    print ".exit"
+}' > "$dir/input"
+
+"$bin" "$dir/test.db" < "$dir/input" > "$dir/output"
+
+awk '
+function fail(message) {
+    print "FAIL: " message " (line " NR ")"
+    failed = 1
+    exit 1
+}
+{ sub(/^(db > )+/, "") }
+/error|Error|not found/ { fail($0) }
+/^tree ok:/ { verified++; next }
+/^(page [0-9]|free list)/ { fail($0) }
+/^index on .* ids, table has/ { fail($0) }
+END {
+    if (failed) exit 1
+    if (verified != 2) { print "FAIL: .verify reported tree ok " verified " times, expected 2"; exit 1 }
+}' "$dir/output"
+
+sed -n 's/^\(db > \)*\((.*\)$/\2/p' "$dir/output" > "$dir/results"
+if ! cmp -s "$dir/expected" "$dir/results"; then
+    echo "FAIL: query results differ from expected:"
+    diff "$dir/expected" "$dir/results" | head -20
+    exit 1
+fi
+echo "ok: $rows rows, $(grep -c . "$dir/expected") query results"
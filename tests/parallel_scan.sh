@@ -0,0 +1,85 @@
+#!/bin/sh
+# 并行扫描测试：按随机顺序插入 rows 行、删掉一部分后，同一组按列值过滤的查询分别用
+# --scan-threads 1（逐叶扫描）和 --scan-threads 4（按分区并行扫描）执行，检查
+#   一致     两次的输出逐字节相同，包括行的顺序、limit/offset 和聚合
+#   查询     count(*) 的结果与 awk 算出的预期一致（expected 文件）
+# username 的一部分行取 team<n>，同一个值有很多行；email 各不相同。
+# 用法：parallel_scan.sh <simple_database> [rows]，rows 默认 200000
+set -eu
+
+bin=$1
+rows=${2:-200000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+expected="$dir/expected" awk -v rows="$rows" -v dir="$dir" '
+function username(id) {
+    return id % 3 ? "user" id : "team" id % 50
+}
+function count(sql, pattern, field,    i, n) {
+    n = 0
+    for (i = 1; i <= rows; i++) {
+        if ((i in present) && (field == "email" ? "user" i "@example.com" : username(i)) ~ pattern) n++
+    }
+    print sql > queries
+    print "(" n ")" > expected
+}
+BEGIN {
+    srand(20240615)
+    expected = ENVIRON["expected"]
+    input = dir "/input"
+    queries = dir "/queries"
+    for (i = 1; i <= rows; i++) {
+        keys[i] = i
+    }
+    for (i = rows; i > 1; i--) {
+        j = int(rand() * i) + 1
+        t = keys[i]; keys[i] = keys[j]; keys[j] = t
+    }
+    for (i = 1; i <= rows; i++) {
+        printf "insert %d %s user%d@example.com\n", keys[i], username(keys[i]), keys[i] > input
+        present[keys[i]] = 1
+    }
+    for (i = 1; i <= rows / 5; i++) {
+        printf "delete where id = %d\n", keys[i] > input
+        delete present[keys[i]]
+    }
+    print ".exit" > input
+
+    count("select count(*) where username like '\''%7'\''", "7$", "username")
+    count("select count(*) where username = '\''team7'\''", "^team7$", "username")
+    count("select count(*) where email like '\''user1%'\''", "^user1", "email")
+    count("select count(*) where username like '\''team_'\''", "^team.$", "username")
+    count("select count(*) where username = '\''nobody'\''", "^nobody$", "username")
+    print "select id where username like '\''%7'\''" > queries
+    print "select where username = '\''team7'\''" > queries
+    print "select id, email where email like '\''%99@%'\''" > queries
+    print "select id where username like '\''team%'\'' limit 20 offset 1000" > queries
+    print "select username where username like '\''user%5'\'' limit 10" > queries
+    print "select min(id) where username = '\''team13'\''" > queries
+    print "select max(id) where username like '\''%1'\''" > queries
+    printf "select where email = '\''user%d@example.com'\''\n", keys[rows] > queries
+    print ".exit" > queries
+}'
+
+"$bin" "$dir/test.db" < "$dir/input" > /dev/null
+"$bin" --scan-threads 1 "$dir/test.db" < "$dir/queries" > "$dir/serial"
+"$bin" --scan-threads 4 "$dir/test.db" < "$dir/queries" > "$dir/parallel"
+
+if grep -q "error\|Error" "$dir/serial" "$dir/parallel"; then
+    echo "FAIL: $(grep -h "error\|Error" "$dir/serial" "$dir/parallel" | head -1)"
+    exit 1
+fi
+if ! cmp -s "$dir/serial" "$dir/parallel"; then
+    echo "FAIL: parallel scan output differs from serial scan:"
+    diff "$dir/serial" "$dir/parallel" | head -20
+    exit 1
+fi
+
+sed -n 's/^\(db > \)*\((.*\)$/\2/p' "$dir/parallel" | head -n "$(wc -l < "$dir/expected")" > "$dir/results"
+if ! cmp -s "$dir/expected" "$dir/results"; then
+    echo "FAIL: count(*) results differ from expected:"
+    diff "$dir/expected" "$dir/results" | head -20
+    exit 1
+fi
+echo "ok: $(sed -n 's/^\(db > \)*(.*$/&/p' "$dir/parallel" | wc -l) result lines match"
@@ -0,0 +1,97 @@
+#!/bin/sh
+# 路径缓存测试：点查询会从上一次下降的路径继续，这里让写语句不断改动被缓存的节点。
+# 按随机顺序插入 rows 行后进行多轮：
+#   每轮围绕一个热点 id 删掉一段连续的 id（叶子合并），查询热点附近的 id，再插回这一段（叶子分裂），再查询；
+#   中途执行 .vacuum 和 create index，它们独占数据库、让所有缓存作废
+# 之后检查
+#   查询     每次点查询的结果与 awk 算出的预期一致（expected 文件）
+#   .verify  树结构完整
+#   .stats   点查询确实用到了缓存的路径或叶子
+# 用法：path_cache.sh <simple_database> [rows]，rows 默认 100000
+set -eu
+
+bin=$1
+rows=${2:-100000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+expected="$dir/expected" awk -v rows="$rows" '
+function lookup(id) {
+    printf "select where id = %d\n", id
+    if (id in present) print "(" id ", user" id ", user" id "@example.com)" > expected
+}
+# 热点前后各 span 个 id，其中一部分间隔较远，落在相邻的叶子里
+function probe(hot, span,    i) {
+    for (i = -span; i <= span; i += 7) lookup(hot + i)
+    lookup(hot)
+    lookup(hot - 200)
+    lookup(hot + 200)
+}
+BEGIN {
+    srand(20240612)
+    expected = ENVIRON["expected"]
+    for (i = 1; i <= rows; i++) {
+        keys[i] = i
+    }
+    for (i = rows; i > 1; i--) {
+        j = int(rand() * i) + 1
+        t = keys[i]; keys[i] = keys[j]; keys[j] = t
+    }
+    for (i = 1; i <= rows; i++) {
+        printf "insert %d user%d user%d@example.com\n", keys[i], keys[i], keys[i]
+        present[keys[i]] = 1
+    }
+
+    for (round = 1; round <= 200; round++) {
+        hot = int(rand() * (rows - 1000)) + 500
+        span = int(rand() * 300) + 20
+        probe(hot, span)
+        for (id = hot - span; id <= hot + span; id++) {
+            if (id in present) {
+                printf "delete where id = %d\n", id
+                delete present[id]
+            }
+        }
+        probe(hot, span)
+        # 插回时跳过一部分，删掉的 id 不全部回来
+        for (id = hot + span; id >= hot - span; id--) {
+            if (id % 5) {
+                printf "insert %d user%d user%d@example.com\n", id, id, id
+                present[id] = 1
+            }
+        }
+        probe(hot, span)
+        if (round == 70) print ".vacuum"
+        if (round == 140) print "create index on username"
+    }
+    print ".verify"
+    print ".stats"
+    print ".exit"
+}' > "$dir/input"
+
+"$bin" "$dir/test.db" < "$dir/input" > "$dir/output"
+
+awk '
+function fail(message) {
+    print "FAIL: " message " (line " NR ")"
+    failed = 1
+    exit 1
+}
+{ sub(/^(db > )+/, "") }
+/error|Error/ { fail($0) }
+/^(page [0-9]|free list)/ { fail($0) }
+/^index on .* ids, table has/ { fail($0) }
+/^tree ok:/ { verified = 1 }
+/^lookup:/ { hints = $5 + $8; print }
+END {
+    if (failed) exit 1
+    if (!verified) { print "FAIL: .verify did not report tree ok"; exit 1 }
+    if (hints == 0) { print "FAIL: no lookup used the path cache"; exit 1 }
+}' "$dir/output"
+
+sed -n 's/^\(db > \)*\((.*\)$/\2/p' "$dir/output" > "$dir/results"
+if ! cmp -s "$dir/expected" "$dir/results"; then
+    echo "FAIL: query results differ from expected:"
+    diff "$dir/expected" "$dir/results" | head -20
+    exit 1
+fi
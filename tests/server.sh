@@ -0,0 +1,134 @@
+#!/bin/sh
+# 服务模式测试：--listen 启动服务，clients 个客户端同时连接，各自不等回复连续发送语句：
+# 插入 id 模 clients 余 k 的行，中间穿插查询自己插入过的行和 count(*)。之后检查
+#   回复     每个客户端收到的回复与 awk 算出的预期逐行一致（count(*) 只检查不小于自己插入的行数）
+#   关闭     SIGTERM 后服务正常退出
+#   .verify  重新打开后树结构完整，count(*) 等于所有客户端插入的行数
+# 客户端用 python3 的套接字实现，没有 python3 时跳过（返回 77）。
+# 用法：server.sh <simple_database> [rows] [clients]，rows 默认 100000，clients 默认 8
+set -eu
+
+bin=$1
+rows=${2:-100000}
+clients=${3:-8}
+if ! command -v python3 > /dev/null; then
+    echo "skipped: python3 not found"
+    exit 77
+fi
+dir=$(mktemp -d)
+pid=
+trap 'if [ -n "$pid" ]; then kill "$pid" 2> /dev/null || true; fi; rm -rf "$dir"' EXIT
+
+# 发送和接收放在两个线程里：服务端的输出缓冲满时会暂停读取请求，客户端要边发边收
+cat > "$dir/client.py" << 'EOF'
+import socket, sys, threading
+sock = socket.socket(socket.AF_UNIX)
+sock.connect(sys.argv[1])
+with open(sys.argv[2], 'rb') as f:
+    requests = f.read()
+sender = threading.Thread(target=sock.sendall, args=(requests,))
+sender.start()
+with open(sys.argv[3], 'wb') as out:
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            break
+        out.write(chunk)
+sender.join()
+EOF
+
+awk -v rows="$rows" -v clients="$clients" -v dir="$dir" 'BEGIN {
+    for (k = 0; k < clients; k++) {
+        input = dir "/input" k
+        expected = dir "/expected" k
+        n = 0
+        for (id = k + 1; id <= rows; id += clients) {
+            printf "insert %d user%d user%d@example.com\n", id, id, id > input
+            print "executed." > expected
+            ids[n++] = id
+            if (n % 10 == 0) {
+                old = ids[int(n / 2)]
+                printf "select where id = %d\n", old > input
+                printf "(%d, user%d, user%d@example.com)\nexecuted.\n", old, old, old > expected
+            }
+            if (n % 100 == 0) {
+                print "select count(*)" > input
+                print "count " n "\nexecuted." > expected
+            }
+        }
+        print ".exit" > input
+        close(input)
+        close(expected)
+    }
+}'
+
+"$bin" --listen "$dir/sock" --server-threads 4 "$dir/test.db" > "$dir/server" &
+pid=$!
+i=0
+until [ -S "$dir/sock" ]; do
+    i=$((i + 1))
+    if [ "$i" -gt 100 ]; then
+        echo "FAIL: server did not start"
+        cat "$dir/server"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+k=0
+client_pids=""
+while [ "$k" -lt "$clients" ]; do
+    python3 "$dir/client.py" "$dir/sock" "$dir/input$k" "$dir/output$k" &
+    client_pids="$client_pids $!"
+    k=$((k + 1))
+done
+for client_pid in $client_pids; do
+    wait "$client_pid"
+done
+
+k=0
+while [ "$k" -lt "$clients" ]; do
+    # count(*) 的结果取决于其他客户端的进度，只要求不小于本客户端已经插入的行数
+    if ! awk -v expected="$dir/expected$k" -v client="$k" '
+    {
+        if ((getline line < expected) <= 0) { print "FAIL: client " client ": unexpected reply " $0; exit 1 }
+        if (line ~ /^count /) {
+            split(line, parts, " ")
+            if ($0 !~ /^\([0-9]+\)$/ || substr($0, 2) + 0 < parts[2] + 0) {
+                print "FAIL: client " client ": count(*) returned " $0 " after " parts[2] " inserts"
+                exit 1
+            }
+        } else if ($0 != line) {
+            print "FAIL: client " client ": expected \"" line "\", got \"" $0 "\" (line " NR ")"
+            exit 1
+        }
+    }
+    END {
+        if ((getline line < expected) > 0) { print "FAIL: client " client ": missing replies from \"" line "\""; exit 1 }
+    }' "$dir/output$k"; then
+        exit 1
+    fi
+    k=$((k + 1))
+done
+
+kill -TERM "$pid"
+if ! wait "$pid"; then
+    echo "FAIL: server exited with an error"
+    cat "$dir/server"
+    exit 1
+fi
+
+printf '.verify\nselect count(*)\n.exit\n' | "$bin" "$dir/test.db" > "$dir/check"
+awk -v rows="$rows" -v clients="$clients" '
+{ sub(/^(db > )+/, "") }
+/error|Error|^(page|index|free list)/ { print "FAIL: " $0; failed = 1; exit 1 }
+/^tree ok:/ { verified = $(NF - 4) }
+/^\(/ { gsub(/[()]/, ""); count = $0 }
+END {
+    if (failed) exit 1
+    if (verified != rows || count != rows) {
+        print "FAIL: .verify counted " verified ", count(*) " count ", expected " rows
+        exit 1
+    }
+    printf "ok: %d clients, %d rows\n", clients, rows
+}' "$dir/check"
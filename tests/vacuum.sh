@@ -0,0 +1,135 @@
+#!/bin/sh
+# 整理测试：按随机顺序插入 rows 行并建 email 索引，删掉一半后
+#   .vacuum              重建整个文件，页数减少
+#   .vacuum incremental  插回删掉的行、再删掉一部分后在后台分步整理，期间照常插入、删除和查询，等它报告完成
+#   .verify              每次整理之后树结构完整，索引中的 id 数与行数一致；重新打开后再检查一次
+#   查询                 count(*)、min/max、按 id 和按 email 的查询与 awk 算出的预期一致（expected 文件）
+# 标准输出用 stdbuf 行缓冲，后台整理完成的报告出现后才送入后半部分输入。
+# 用法：vacuum.sh <simple_database> [rows]，rows 默认 200000
+set -eu
+
+bin=$1
+rows=${2:-200000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+expected="$dir/expected" awk -v rows="$rows" -v dir="$dir" '
+function query(sql, result) {
+    print sql > input
+    if (result != "") print result > expected
+}
+function check(    i, id, count, min, max) {
+    count = 0; min = 0; max = 0
+    for (i = 1; i <= rows; i++) {
+        if (i in present) {
+            count++
+            if (min == 0) min = i
+            max = i
+        }
+    }
+    query("select count(*)", "(" count ")")
+    query("select min(id)", "(" min ")")
+    query("select max(id)", "(" max ")")
+    for (i = 1; i <= 10; i++) {
+        id = int(rand() * rows) + 1
+        query("select where id = " id, id in present ? "(" id ", user" id ", user" id "@example.com)" : "")
+        query("select id where email = '\''user" id "@example.com'\''", id in present ? "(" id ")" : "")
+    }
+}
+BEGIN {
+    srand(20240610)
+    expected = ENVIRON["expected"]
+    input = dir "/input1"
+    for (i = 1; i <= rows; i++) {
+        keys[i] = i
+    }
+    for (i = rows; i > 1; i--) {
+        j = int(rand() * i) + 1
+        t = keys[i]; keys[i] = keys[j]; keys[j] = t
+    }
+    query("create index on email")
+    for (i = 1; i <= rows; i++) {
+        printf "insert %d user%d user%d@example.com\n", keys[i], keys[i], keys[i] > input
+        present[keys[i]] = 1
+    }
+    # 删掉一半，留下大量空闲页和半空的叶子
+    for (i = 1; i <= rows / 2; i++) {
+        query("delete where id = " keys[i])
+        delete present[keys[i]]
+    }
+    query(".vacuum")
+    query(".verify")
+    check()
+
+    # 按随机顺序插回删掉的行，分裂出的叶子分散在文件末尾；再删掉一部分，留下空闲页。
+    # 后台整理期间插入、删除和查询
+    for (i = 1; i <= rows / 2; i++) {
+        query("insert " keys[i] " user" keys[i] " user" keys[i] "@example.com")
+        present[keys[i]] = 1
+    }
+    for (i = rows / 4 + 1; i <= rows * 3 / 4; i++) {
+        query("delete where id = " keys[i])
+        delete present[keys[i]]
+    }
+    query(".vacuum incremental")
+    for (i = 1; i <= 2000; i++) {
+        id = keys[int(rand() * rows) + 1]
+        if (id in present) {
+            query("delete where id = " id)
+            delete present[id]
+        } else {
+            query("insert " id " user" id " user" id "@example.com")
+            present[id] = 1
+        }
+        if (i % 100 == 0) query("select count(*) where id between 1 and " rows, "(" length(present) ")")
+    }
+
+    input = dir "/input2"
+    query(".verify")
+    check()
+    query(".exit")
+}'
+
+{
+    cat "$dir/input1"
+    i=0
+    until grep -q "pages moved" "$dir/output" 2> /dev/null; do
+        i=$((i + 1))
+        if [ "$i" -gt 3000 ]; then
+            break
+        fi
+        sleep 0.1
+    done
+    cat "$dir/input2"
+} | stdbuf -oL "$bin" "$dir/test.db" > "$dir/output"
+
+printf '.verify\n.exit\n' | "$bin" "$dir/test.db" >> "$dir/output"
+
+awk '
+function fail(message) {
+    print "FAIL: " message " (line " NR ")"
+    failed = 1
+    exit 1
+}
+{ sub(/^(db > )+/, "") }
+/error|Error/ { fail($0) }
+/^(page|free list)/ { fail($0) }
+/^index on .* ids, table has/ { fail($0) }
+/^tree ok:/ { verified++ }
+/^vacuum:/ {
+    if ($2 + 0 <= $5 + 0) fail("vacuum did not shrink the file: " $0)
+    vacuums++
+    print
+}
+END {
+    if (failed) exit 1
+    if (vacuums != 2) { print "FAIL: expected 2 vacuum reports, got " vacuums; exit 1 }
+    if (verified != 3) { print "FAIL: .verify reported tree ok " verified " times, expected 3"; exit 1 }
+}' "$dir/output"
+
+sed -n 's/^\(db > \)*\((.*\)$/\2/p' "$dir/output" > "$dir/results"
+if ! cmp -s "$dir/expected" "$dir/results"; then
+    echo "FAIL: query results differ from expected:"
+    diff "$dir/expected" "$dir/results" | head -20
+    exit 1
+fi
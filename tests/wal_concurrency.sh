@@ -0,0 +1,47 @@
+#!/bin/sh
+# WAL 并发读和 checkpoint 测试：缓冲池只有很少的页帧，多个线程的读语句频繁从日志读页，
+# 同时写语句的提交不断触发后台 checkpoint 和日志复用。之后检查
+#   readrandom  已有的每个 id 都能读到
+#   .verify     树结构完整，行数与 count(*) 一致
+#   查询        id 从 1 起连续，max(id) 等于 count(*)
+# 用法：wal_concurrency.sh <simple_db_bench> <simple_database> [rows]，rows 默认 20000
+set -eu
+
+bench=$1
+bin=$2
+rows=${3:-20000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+"$bench" --db "$dir/test.db" --wal --cache-pages 8 --threads 4 --num "$rows" --reads $((rows * 2)) \
+    --read-percent 70 --benchmarks fillrandom,mixed,readrandom > "$dir/bench"
+cat "$dir/bench"
+if ! grep -q "^readrandom .*($((rows * 2)) of $((rows * 2)) found)" "$dir/bench"; then
+    echo "FAIL: readrandom missed existing rows"
+    exit 1
+fi
+
+printf '.verify\nselect count(*)\nselect max(id)\n.exit\n' | "$bin" --wal "$dir/test.db" > "$dir/output"
+
+awk -v rows="$rows" '
+function fail(message) {
+    print "FAIL: " message
+    failed = 1
+    exit 1
+}
+{ sub(/^(db > )+/, "") }
+/error|Error/ { fail($0) }
+/^tree ok:/ { verified = $(NF - 4); next }
+/^(page|index|free list)/ { fail($0) }
+/^\(/ { gsub(/[()]/, ""); results[n++] = $0 + 0 }
+END {
+    if (failed) exit 1
+    if (verified == "") { print "FAIL: .verify did not report tree ok"; exit 1 }
+    if (n != 2) { print "FAIL: expected 2 query results, got " n; exit 1 }
+    if (results[0] != verified) { print "FAIL: count(*) " results[0] " but .verify counted " verified; exit 1 }
+    if (results[0] < rows || results[1] != results[0]) {
+        print "FAIL: count(*) " results[0] ", max(id) " results[1] ", expected at least " rows " contiguous ids"
+        exit 1
+    }
+    printf "ok: %d rows\n", results[0]
+}' "$dir/output"
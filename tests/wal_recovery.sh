@@ -0,0 +1,67 @@
+#!/bin/sh
+# WAL 崩溃恢复测试：分别以 --group-commit 1 和 8 按 id 顺序逐行插入，运行中途 kill -9，然后重新打开数据库
+#   已确认的行    输出中每个 "executed." 都是一次已经返回的提交，这些行必须全部恢复
+#   .verify      恢复后树结构完整
+#   查询         恢复的行是从 1 开始的连续 id，max(id) 等于 count(*)
+# 标准输出用 stdbuf 行缓冲，确认在返回时就写进输出文件，不会因为被杀死而丢失。
+# 用法：wal_recovery.sh <simple_database> [seconds]，seconds 是每轮运行多久后杀死进程，默认 2
+set -eu
+
+bin=$1
+seconds=${2:-2}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+    for (i = 1; i <= 2000000; i++) {
+        printf "insert %d user%d user%d@example.com\n", i, i, i
+    }
+}' > "$dir/input"
+
+for group in 1 8; do
+    rm -f "$dir/test.db" "$dir/test.db-wal"
+    stdbuf -oL "$bin" --wal --group-commit "$group" "$dir/test.db" < "$dir/input" > "$dir/output" &
+    pid=$!
+    sleep "$seconds"
+    kill -9 "$pid"
+    wait "$pid" 2> /dev/null || true
+    acked=$(grep -o "executed\." "$dir/output" | wc -l)
+    if grep -q "error" "$dir/output"; then
+        echo "FAIL: group commit $group: $(grep error "$dir/output" | head -1)"
+        exit 1
+    fi
+    if [ "$acked" -eq 0 ]; then
+        echo "FAIL: group commit $group: no insert was acknowledged before the kill"
+        exit 1
+    fi
+
+    printf '.verify\nselect count(*)\nselect max(id)\n.exit\n' | "$bin" --wal "$dir/test.db" > "$dir/check"
+    awk -v acked="$acked" -v group="$group" '
+    function fail(message) {
+        print "FAIL: group commit " group ": " message
+        failed = 1
+        exit 1
+    }
+    { sub(/^(db > )+/, "") }
+    /error|Error/ { fail($0) }
+    /^tree ok:/ { verified = $(NF - 4); next }
+    /^(page|index|free list)/ { fail($0) }
+    /^\(/ { gsub(/[()]/, ""); results[n++] = $0 + 0 }
+    END {
+        if (failed) exit 1
+        if (verified == "") { print "FAIL: group commit " group ": .verify did not report tree ok"; exit 1 }
+        if (n != 2 || results[0] != verified) {
+            print "FAIL: group commit " group ": count(*) does not match .verify"
+            exit 1
+        }
+        if (results[0] < acked) {
+            print "FAIL: group commit " group ": " acked " inserts acknowledged, " results[0] " rows recovered"
+            exit 1
+        }
+        if (results[1] != results[0]) {
+            print "FAIL: group commit " group ": recovered ids are not 1.." results[0] " (max " results[1] ")"
+            exit 1
+        }
+        printf "ok: group commit %d, %d acknowledged, %d recovered\n", group, acked, results[0]
+    }' "$dir/check"
+done